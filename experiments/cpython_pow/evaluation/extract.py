@@ -5,7 +5,13 @@ from collections import Counter
 import pandas as pd
 import numpy as np
 
-from utils import load_trace, lat_to_hit, progress
+from utils import (
+    load_trace_capture,
+    load_trace_columns,
+    load_trace_events,
+    progress,
+    trace_hit_mask,
+)
 
 CONSUME_ZERO = 0
 WINDOW = 1
@@ -105,44 +111,30 @@ def strip_preamble(hits):
 
 
 def parse_trace(file):
-    hits = []
-    with open(file) as f:
-        lines = f.read().strip().splitlines()
-
-    for line in lines:
-        hit = []
-        entries = line.strip().split()
-
-        for entry in entries:
-            lat = int(entry.split(":")[1])
-            hit.append(lat_to_hit(lat, attack_type))
-
-        hits.append(hit)
+    columns = load_trace_columns(file)
+    capture = load_trace_capture(file)
+    rows = min(len(lat) for tsc, lat in columns)
+    hits = np.stack(
+        [
+            trace_hit_mask(lat[:rows], attack_type, capture, j)
+            for j, (tsc, lat) in enumerate(columns)
+        ],
+        axis=1,
+    ).tolist()
 
     return run_state_machine(strip_preamble(hits))
 
 
 def parse_trace_PS(filepath):
-    df = load_trace(filepath)
-
     mapping = {0: "CZ", 1: "AW", 2: "AT"}
     # 0: Comsume_Zeros
     # 1: Absorb_Window
     # 2: Absorb_Trailing
 
-    hits = []
-    for col in df.columns:
-        tmp = pd.DataFrame(df[col].tolist(), columns=["tsc", "lat"])
-        tmp["src"] = mapping[col]
-        hits.append(tmp)
-
-    cache_hits = pd.concat(hits, ignore_index=True)
-    cache_hits = cache_hits[~((cache_hits["tsc"] == 0) & (cache_hits["lat"] == 0))]
-    cache_hits = (
-        cache_hits.drop(columns=["lat"]).sort_values("tsc").reset_index(drop=True)
-    )
-
-    return cache_hits
+    # The channels come merged in tsc order, no need to sort them here
+    events = load_trace_events(filepath)
+    src = pd.Series(events["channel"]).map(mapping)
+    return pd.DataFrame({"tsc": events["tsc"], "src": src})
 
 
 def merge_traces(size, files):
@@ -235,10 +227,10 @@ def parse_PS_window(seg, window_start, window_size):
     src = seg["src"].values
 
     print("Window:")
-    window_end = window_start
-    while window_end < len(tsc) and tsc[window_end] - tsc[window_start] < window_size:
-        print(tsc[window_end], src[window_end])
-        window_end += 1
+    window_end = np.searchsorted(tsc, tsc[window_start] + window_size, side="left")
+    window_end = max(int(window_end), window_start)
+    for i in range(window_start, window_end):
+        print(tsc[i], src[i])
     return window_end
 
 
@@ -173,12 +173,10 @@ def check_image_width(occ, dist, line_width):
 
 
 def extract_p_from_file(filepath, at="PP"):
-    trace = load_trace(filepath)
+    trace = load_trace_columns(filepath)
 
-    pos = trace[0].apply(lambda x: lat_to_hit(x[1], at))
-    goto16 = trace[0][pos].apply(lambda x: x[0]).astype(float)
-    pos = trace[1].apply(lambda x: lat_to_hit(x[1], at))
-    shl = trace[1][pos].apply(lambda x: x[0]).astype(float)
+    goto16 = trace_to_timestamp(trace[0], at).astype(float)
+    shl = trace_to_timestamp(trace[1], at).astype(float)
 
     goto16_clusters = get_trace_clusters(goto16)
     shl_clusters = get_trace_clusters(shl)
@@ -26,15 +26,17 @@ static char *js_eval_file;
 
 enum { cache_line_count = 2, profile_iterations = 1 << 20 };
 static const uint64_t max_exec_cycles = (uint64_t)4e9;
-static uint64_t probe_time_arr[cache_line_count][profile_iterations];
-static uint64_t sample_tsc_arr[cache_line_count][profile_iterations];
+// Point into the run mapped by sample_buffer_init()
 static uint64_t *sample_tsc[cache_line_count];
 static uint64_t *probe_time[cache_line_count];
+static uint64_t sample_count[cache_line_count];
 
 static pthread_barrier_t attacker_threads_barrier;
 
 int main(int argc, char **argv) {
 	pthread_t thread0 = 0, thread1 = 0;
+	sample_buffer_t sample_buffer;
+	char dirpath[256];
 	int err;
 
 	get_config();
@@ -48,11 +50,6 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	for (int i = 0; i < cache_line_count; ++i) {
-		sample_tsc[i] = sample_tsc_arr[i];
-		probe_time[i] = probe_time_arr[i];
-	}
-
 	PP_attacker_thread_config_t pt_goto16 = {
 		.label = "goto16",
 		.slot = 0,
@@ -82,6 +79,20 @@ int main(int argc, char **argv) {
 		return -1;
 	}
 
+	snprintf(
+	    dirpath, sizeof(dirpath), "output/%s_r%05lu", test_name, victim_runs);
+	if (sample_buffer_init(&sample_buffer,
+	                       dirpath,
+	                       sample_tsc,
+	                       probe_time,
+	                       cache_line_count,
+	                       profile_iterations,
+	                       pinned_writer_cpu)) {
+		return 1;
+	}
+	pt_goto16.buffer = &sample_buffer;
+	pt_shl.buffer = &sample_buffer;
+
 	log_info("Prime+Probe wait for the warmup run");
 	pthread_barrier_wait(sync_ctx.barrier);
 	log_info("Prime+Probe wait for the warmup done");
@@ -97,6 +108,7 @@ int main(int argc, char **argv) {
 	pthread_join(thread0, NULL);
 	pthread_join(thread1, NULL);
 
+	sample_buffer_destroy(&sample_buffer);
 	pthread_barrier_destroy(&attacker_threads_barrier);
 
 	return 0;
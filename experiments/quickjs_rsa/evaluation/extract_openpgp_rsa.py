@@ -108,9 +108,7 @@ class RSA_KEY:
             #     print(f"Skip a group of {rounds}")
             return ""
 
-        sar_samples = data_samples[
-            data_samples.apply(lambda s: s["bytecode"] == "sar", axis=1)
-        ]
+        sar_samples = data_samples[data_samples["bytecode"] == "sar"]
         sar_interval = sar_samples["tsc"].diff()
         sar_interval = sar_interval[sar_interval.notnull()]
         sar_median = sar_interval.median()
@@ -236,72 +234,89 @@ class RSA_KEY:
         key += "1"
         return key
 
-    def infer_trace(self, trace):
+    def infer_trace(self, events):
         keys = []
-        if len(trace) == 0:
+        var_map = np.array(["goto8", "sar", "mul", "mod"])
+        # Events of all channels, already merged in tsc order
+        events = events[trace_hit_mask(events["latency"], attack_type)]
+        if len(events) == 0:
             return keys
-        var_map = {0: "goto8", 1: "sar", 2: "mul", 3: "mod"}
-        data_samples = {"tsc": [], "hit": [], "bytecode": []}
-        for row in trace.melt().itertuples():
-            idx, var, val = row
-            tsc, lat = val
-            data_samples["tsc"].append(tsc)
-            data_samples["hit"].append(lat_to_hit(lat, attack_type))
-            data_samples["bytecode"].append(var_map[var])
-
-        data_samples = pd.DataFrame(data_samples)
-        data_samples = data_samples[data_samples.apply(lambda s: s["hit"], axis=1)]
-
-        data_samples = data_samples.sort_values(
-            ["tsc", "bytecode"], ascending=[True, False]
-        ).reset_index(drop=True)
-
-        sar_samples = data_samples[
-            data_samples.apply(lambda s: s["bytecode"] == "sar", axis=1)
-        ]
+
+        data_samples = pd.DataFrame(
+            {
+                "tsc": events["tsc"].astype(np.int64),
+                "hit": True,
+                "bytecode": var_map[events["channel"]],
+            }
+        )
+
+        sar_samples = data_samples[data_samples["bytecode"] == "sar"]
         sar_interval = sar_samples["tsc"].diff()
         sar_interval = sar_interval[sar_interval.notnull()]
         sar_median = sar_interval.median()
 
-        tsc0 = 0
-        idx0 = 0
-        for s in data_samples.itertuples():
-            idx, tsc, hit, bytecode = s
-            if tsc - tsc0 > 5 * sar_median:
-                one_run_data_samples = data_samples[idx0:idx]
-                infer_key = self.single_run_inference(one_run_data_samples, sar_median)
-                keys.append(infer_key)
-                idx0 = idx
-            tsc0 = tsc
-
-        one_run_data_samples = data_samples[idx0:]
-        infer_key = self.single_run_inference(one_run_data_samples, sar_median)
-        keys.append(infer_key)
+        # Victim runs are separated by more than 5 sar intervals
+        tsc = data_samples["tsc"].values
+        bounds = np.flatnonzero(np.diff(tsc) > 5 * sar_median) + 1
+        for idx0, idx in zip(np.r_[0, bounds], np.r_[bounds, len(tsc)]):
+            one_run_data_samples = data_samples[idx0:idx]
+            infer_key = self.single_run_inference(one_run_data_samples, sar_median)
+            keys.append(infer_key)
         return keys
 
+    @property
+    def results(self):
+        return ResultStore(
+            "openpgp_rsa.infer_key/1",
+            key_bits=self.secret_key_bits,
+            attack=attack_type,
+            sample_interval=sample_interval,
+        )
+
+    def infer_key(self, events):
+        """First inferred key of the full length, None if there is none"""
+        for key in self.infer_trace(events):
+            if len(key) == self.secret_key_bits:
+                return key
+        return None
+
     def infer_file(self, filename):
-        infer_cache_fp = filename.replace(".out", ".inf")
-        cached = False
-        if use_cache and os.path.exists(infer_cache_fp):
-            cache = open(infer_cache_fp, "r")
-            keys = cache.readlines()
-
-            if len(keys) == 1:
-                if len(keys[0]) == self.secret_key_bits:
-                    self.infer_keys.append(keys[0])
-            cached = True
-        if not cached:
-            lines = load_trace(filename)
-            keys = self.infer_trace(lines)
-            for key in keys:
-                if len(key) == self.secret_key_bits:
-                    cache = open(infer_cache_fp, "w")
-                    cache.writelines(keys)
-                    self.infer_keys.append(key)
-                    break
-            else:
-                cache = open(infer_cache_fp, "w")
-                cache.writelines(["NA"])
+        key = self.results.memoize(
+            trace_content_hash(filename),
+            lambda: self.infer_key(load_trace_events(filename)),
+            refresh=not use_cache,
+        )
+        if key is not None:
+            self.infer_keys.append(key)
+        return
+
+    def infer_segment_run(self, segment_path, run_id):
+        segment = open_segment(segment_path)
+        key = self.results.memoize(
+            segment.content_hash(self.kid, run_id),
+            lambda: self.infer_key(segment.load_trace_events(self.kid, run_id)),
+            refresh=not use_cache,
+        )
+        if key is not None:
+            self.infer_keys.append(key)
+        return
+
+    def infer_segment(self, segment_path):
+        segment = open_segment(segment_path)
+        executor = ProcessPoolExecutor()
+        futures = []
+
+        runs = segment.key_runs(self.kid)
+        task_run = progress.add_task("[green]Processing traces...", total=len(runs))
+        for run_id in runs:
+            future = executor.submit(self.infer_segment_run, segment_path, run_id)
+            futures.append(future)
+
+        for future in as_completed(futures, timeout=20):
+            progress.update(task_run, advance=1)
+            future.result(timeout=2)
+
+        progress.remove_task(task_run)
         return
 
     def infer_directory(self, output_dir):
@@ -580,7 +595,21 @@ def infer_directory(skey, output_dir):
     print(f"Key: {skey.kid:03d}, Acc: {skey.check_accuracy()}")
 
 
+def infer_segment_key_pool(segment_path):
+    segment = open_segment(segment_path)
+    task_keys = progress.add_task("[blue]Resolving keys...", total=len(segment.keys()))
+    for kid in segment.keys():
+        skey = RSA_KEY.load_key(kid)
+        progress.update(task_keys, description=f"[blue]Resolving key {kid}")
+        skey.infer_segment(segment_path)
+        print(f"Key: {skey.kid:03d}, Acc: {skey.check_accuracy()}")
+        progress.update(task_keys, advance=1, refresh=True)
+
+
 def infer_key_pool(output_dir):
+    if os.path.isfile(output_dir) and is_trace_segment(output_dir):
+        infer_segment_key_pool(output_dir)
+        return
     pattern = r"quickjs_openpgp_rsa_key_pool_key(\d+)+"
     task_keys = progress.add_task(
         "[blue]Resolving keys...", total=len(os.listdir(output_dir))
@@ -641,7 +670,7 @@ if __name__ == "__main__":
         "-p",
         "--keypool",
         type=str,
-        help="Key Pool directory",
+        help="Key Pool directory or segment file",
     )
 
     parser.add_argument(
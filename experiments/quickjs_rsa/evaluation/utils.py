@@ -1,4 +1,5 @@
 import os
+import sys
 from pathlib import Path
 
 import numpy as np
@@ -13,6 +14,10 @@ from rich.progress import (
     TimeRemainingColumn,
 )
 
+# Trace readers shared by every experiment, in experiments/trace_utils.py
+sys.path.insert(0, str(Path(__file__).resolve().parents[2]))
+from trace_utils import *  # noqa: E402,F401,F403
+
 cpu_freq = 2800000000
 PS_sample_interval = 10000
 PS_fs = cpu_freq // PS_sample_interval
@@ -91,6 +96,9 @@ def lat_to_hit(lat, attack="FR"):
 
 
 def trace_to_timestamp(trace, at="FR"):
+    if isinstance(trace, tuple):
+        tsc, lat = trace
+        return np.asarray(tsc)[trace_hit_mask(lat, at)].astype(np.int64)
     return np.array([x[0] for x in trace[trace.apply(lambda x: lat_to_hit(x[1], at))]])
 
 
@@ -108,6 +116,9 @@ def trace_hit_count(trace, att):
 
 
 def load_trace(filepath):
+    if is_binary_trace(filepath):
+        return columns_to_frame(load_trace_columns(filepath))
+
     f = open(filepath)
     lines = f.readlines()
     lines = list(filter(lambda x: x, lines))
@@ -144,22 +155,19 @@ def load_ground_truth(fp=None):
 
 
 def aligned_timestamps(target_ts, reference_ts, delta=3000):
-    aligned_ts = []
-    i, j = 0, 0
-    len_target, len_ref = len(target_ts), len(reference_ts)
-
-    while i < len_target and j < len_ref:
-        ts, ts_ref = target_ts[i], reference_ts[j]
-
-        if ts_ref < ts - delta:
-            j += 1
-        elif ts_ref > ts + delta:
-            i += 1
-        else:
-            aligned_ts.append(ts)
-            i += 1
-
-    return aligned_ts
+    """Timestamps of target_ts within delta of any of reference_ts
+
+    Both inputs are sorted, so each target is matched by binary search.
+    """
+    target_ts = np.asarray(target_ts, dtype=np.int64)
+    reference_ts = np.asarray(reference_ts, dtype=np.int64)
+    if len(reference_ts) == 0:
+        return []
+
+    j = np.searchsorted(reference_ts, target_ts - delta, side="left")
+    nearest = reference_ts[np.minimum(j, len(reference_ts) - 1)]
+    aligned = (j < len(reference_ts)) & (nearest <= target_ts + delta)
+    return target_ts[aligned].tolist()
 
 
 def find_project_root(start_path=None, marker=".project"):
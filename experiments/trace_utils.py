@@ -0,0 +1,857 @@
+"""Readers of the trace files, live traces, trace segments and the result
+store, shared by the evaluation scripts of every experiment.
+
+Each experiments/<name>/evaluation/utils.py re-exports them next to its own
+loaders.
+"""
+
+import ctypes
+import json
+import os
+import sys
+import time
+from functools import lru_cache
+from pathlib import Path
+
+import numpy as np
+import pandas as pd
+
+# TSC frequency of traces that did not record one
+default_tsc_freq = 2800000000
+
+
+TRACE_MAGIC = b"SCARTRC\x00"
+
+trace_header_dtype = np.dtype(
+    [
+        ("magic", "S8"),
+        ("version", "<u2"),
+        ("header_size", "<u2"),
+        ("channel_count", "<u4"),
+        ("file_size", "<u8"),
+        ("encoding", "<u4"),
+        ("block_size", "<u4"),
+        ("index_offset", "<u8"),
+        ("index_stride", "<u4"),
+        ("flags", "<u4"),
+        ("gt_offset", "<u8"),
+        ("gt_count", "<u8"),
+    ]
+)
+
+trace_gt_dtype = np.dtype([("tsc", "<u8"), ("event", "<u8")])
+
+trace_noise_dtype = np.dtype(
+    [
+        ("tsc", "<u8"),
+        ("latency", "<u4"),
+        ("kind", "<u2"),
+        ("channel", "<u2"),
+        ("old_cpu", "<u4"),
+        ("new_cpu", "<u4"),
+    ]
+)
+
+# trace_noise_kind_t, the cpu fields are rdtscp_aux() values: node << 12 | core
+TRACE_NOISE_KINDS = {1: "cpu_switch", 2: "interrupt", 3: "dropped"}
+
+TRACE_COVERAGE_BINS = 32
+
+trace_coverage_dtype = np.dtype(
+    [
+        ("window_cycles", "<u8"),
+        ("probes", "<u8"),
+        ("reprimes", "<u8"),
+        ("blind_cycles", "<u8"),
+        ("max_blind_cycles", "<u8"),
+        ("reserved", "<u8", (3,)),
+        ("reprime_hist", "<u4", (TRACE_COVERAGE_BINS,)),
+    ]
+)
+
+trace_channel_dtype = np.dtype(
+    [
+        ("sample_count", "<u8"),
+        ("tsc_offset", "<u8"),
+        ("lat_offset", "<u8"),
+        ("tsc_base", "<u8"),
+    ]
+)
+
+trace_capture_dtype = np.dtype(
+    [
+        ("tsc_freq", "<u8"),
+        ("max_exec_cycles", "<u8"),
+        ("profile_iterations", "<u4"),
+        ("attack", "<u4"),
+        ("l2_thresh", "<i4"),
+        ("interrupt_thresh", "<i4"),
+        ("victim_action", "<u4"),
+        ("reserved0", "<u4"),
+        ("noise_offset", "<u8"),
+        ("noise_count", "<u8"),
+        ("coverage_offset", "<u8"),
+        ("victim_data", "S64"),
+    ]
+)
+
+trace_capture_channel_dtype = np.dtype(
+    [
+        ("l3_set", "<i4"),
+        ("core", "<u2"),
+        ("node", "<u2"),
+        ("threshold", "<i4"),
+        ("reserved", "<u4"),
+    ]
+)
+
+TRACE_ENCODING_PACKED = 1
+TRACE_ENCODING_RECORDS = 2
+TRACE_RECORD_TSC_BITS = 40
+TRACE_RECORD_LAT_SHIFT = 40
+TRACE_RECORD_FLAGS_SHIFT = 56
+TRACE_FLAG_EVENTS = 1
+TRACE_FLAG_COVERAGE = 2
+TRACE_ALIGN = 64
+TRACE_BLOCK_LANES = 2
+
+trace_index_dtype = np.dtype([("tsc", "<u8"), ("sample", "<u8")])
+
+# trace_event_t of include/trace_reader.h
+trace_event_dtype = np.dtype([("tsc", "<u8"), ("channel", "<u4"), ("latency", "<u4")])
+
+
+def is_binary_trace(filepath):
+    with open(filepath, "rb") as f:
+        return f.read(len(TRACE_MAGIC)) == TRACE_MAGIC
+
+
+def decode_packed_column(buf, offset, n, block_size, base=0, delta=False):
+    """Decode a frame-of-reference bit-packed column, see include/trace.h"""
+    blocks = (n + block_size - 1) // block_size
+    values = np.zeros(blocks * block_size, dtype=np.uint64)
+    for b in range(blocks):
+        ref = buf[offset : offset + 8].view("<u8")[0]
+        width = int(buf[offset + 8 : offset + 12].view("<u4")[0])
+        offset += 16
+        if width > 0:
+            nbytes = width * block_size // 8
+            # width rows of one word per lane, every lane packed down its column
+            words = buf[offset : offset + nbytes].reshape(width, TRACE_BLOCK_LANES, 8)
+            lanes = words.transpose(1, 0, 2).reshape(TRACE_BLOCK_LANES, -1)
+            bits = np.unpackbits(lanes, axis=1, bitorder="little")
+            bits = bits.reshape(TRACE_BLOCK_LANES, -1, width)
+            bits = np.pad(bits, ((0, 0), (0, 0), (0, 64 - width)))
+            packed = np.packbits(bits, axis=2, bitorder="little").view("<u8")[:, :, 0]
+            values[b * block_size : (b + 1) * block_size] = packed.T.ravel()
+            offset += nbytes
+        values[b * block_size : (b + 1) * block_size] += ref
+    values = values[:n]
+    if delta:
+        values = np.cumsum(values, dtype=np.uint64) + np.uint64(base)
+    return values
+
+
+def expand_records(records, base=0):
+    """Split trace_record_t values into (tsc, lat, flags), see include/trace.h"""
+    records = records.astype(np.uint64, copy=False)
+    tsc_mask = np.uint64((1 << TRACE_RECORD_TSC_BITS) - 1)
+    tsc = (records & tsc_mask) + np.uint64(base)
+    lat = (records >> np.uint64(TRACE_RECORD_LAT_SHIFT)) & np.uint64(0xFFFF)
+    flags = (records >> np.uint64(TRACE_RECORD_FLAGS_SHIFT)).astype(np.uint8)
+    return tsc, lat, flags
+
+
+def trace_image_columns(mm, base=0):
+    """Return a list of (tsc, lat) arrays per channel of the trace at base
+
+    Raw traces are returned as views into the mapping, packed traces and
+    records are decoded into memory.
+    """
+    header = mm[base : base + trace_header_dtype.itemsize].view(trace_header_dtype)[0]
+    if header["magic"] != TRACE_MAGIC.rstrip(b"\x00"):
+        raise ValueError(f"No binary trace at offset {base}")
+    begin = base + int(header["header_size"])
+    end = begin + int(header["channel_count"]) * trace_channel_dtype.itemsize
+    channels = mm[begin:end].view(trace_channel_dtype)
+
+    columns = []
+    for ch in channels:
+        n = int(ch["sample_count"])
+        tsc_offset = base + int(ch["tsc_offset"])
+        lat_offset = base + int(ch["lat_offset"])
+        if header["encoding"] == TRACE_ENCODING_PACKED:
+            block_size = int(header["block_size"])
+            base_tsc = int(ch["tsc_base"])
+            tsc = decode_packed_column(mm, tsc_offset, n, block_size, base_tsc, True)
+            lat = decode_packed_column(mm, lat_offset, n, block_size)
+        elif header["encoding"] == TRACE_ENCODING_RECORDS:
+            records = mm[tsc_offset : tsc_offset + 8 * n].view("<u8")
+            tsc, lat, _ = expand_records(records, int(ch["tsc_base"]))
+        else:
+            tsc = mm[tsc_offset : tsc_offset + 8 * n].view("<u8")
+            lat = mm[lat_offset : lat_offset + 8 * n].view("<u8")
+        columns.append((tsc, lat))
+    return columns
+
+
+def columns_to_events(columns, event_channel=None):
+    """Merge (tsc, lat) columns into one trace_event_dtype array in tsc order
+
+    event_channel is the channel of every event as stored with the trace,
+    without it the columns are merged by a stable sort, ties in channel
+    order like trace_merge().
+    """
+    counts = [len(tsc) for tsc, lat in columns]
+    events = np.empty(sum(counts), dtype=trace_event_dtype)
+    if event_channel is None:
+        tsc = [np.zeros(0, dtype=np.uint64)] + [tsc for tsc, lat in columns]
+        tsc = np.concatenate(tsc)
+        event_channel = np.repeat(np.arange(len(columns)), counts)
+        event_channel = event_channel[np.argsort(tsc, kind="stable")]
+    for j, (tsc, lat) in enumerate(columns):
+        samples = event_channel == j
+        events["tsc"][samples] = tsc
+        events["latency"][samples] = np.minimum(lat, 0xFFFFFFFF)
+    events["channel"] = event_channel
+    return events
+
+
+def trace_image_events(mm, base=0):
+    """Samples of all channels of the trace at base as one stream in tsc order"""
+    header = mm[base : base + trace_header_dtype.itemsize].view(trace_header_dtype)[0]
+    columns = trace_image_columns(mm, base)
+    if not header["flags"] & TRACE_FLAG_EVENTS or header["index_offset"] == 0:
+        return columns_to_events(columns)
+
+    # The event channels follow the index, see include/trace.h
+    offset = int(header["index_offset"])
+    stride = int(header["index_stride"])
+    for tsc, lat in columns:
+        offset += -(-len(tsc) // stride) * trace_index_dtype.itemsize
+    begin = base + -(-offset // TRACE_ALIGN) * TRACE_ALIGN
+    end = begin + sum(len(tsc) for tsc, lat in columns)
+    return columns_to_events(columns, mm[begin:end])
+
+
+TRACE_ATTACKS = {"FR": 0, "PS": 1, "PP": 2}
+SYNC_CTX_ACTIONS = ["UNDEFINED", "START", "PROBE", "PAUSE", "SET_KEY", "EXIT"]
+
+
+def trace_image_capture(mm, base=0):
+    """Capture block of the trace at base as a dict, None if it has none
+
+    "channels" holds l3_set, core, node and threshold per channel.
+    """
+    header = mm[base : base + trace_header_dtype.itemsize].view(trace_header_dtype)[0]
+    begin = base + trace_header_dtype.itemsize
+    end = begin + trace_capture_dtype.itemsize
+    size = int(header["channel_count"]) * trace_capture_channel_dtype.itemsize
+    if base + int(header["header_size"]) < end + size:
+        return None
+    capture = mm[begin:end].view(trace_capture_dtype)[0]
+    channels = mm[end : end + size]
+    return {
+        "tsc_freq": int(capture["tsc_freq"]) or default_tsc_freq,
+        "max_exec_cycles": int(capture["max_exec_cycles"]),
+        "profile_iterations": int(capture["profile_iterations"]),
+        "attack": list(TRACE_ATTACKS)[capture["attack"]],
+        "l2_thresh": int(capture["l2_thresh"]),
+        "interrupt_thresh": int(capture["interrupt_thresh"]),
+        "victim_action": SYNC_CTX_ACTIONS[capture["victim_action"]],
+        "victim_data": capture["victim_data"].decode(errors="replace"),
+        "channels": np.array(channels.view(trace_capture_channel_dtype)),
+    }
+
+
+def load_trace_capture(filepath):
+    """Capture block of a trace file, None for text dumps and older traces"""
+    if not is_binary_trace(filepath):
+        return None
+    return trace_image_capture(np.memmap(filepath, dtype=np.uint8, mode="r"))
+
+
+def trace_image_ground_truth(mm, base=0):
+    """Ground truth records (tsc, event) stored with the trace at base"""
+    header = mm[base : base + trace_header_dtype.itemsize].view(trace_header_dtype)[0]
+    begin = base + int(header["gt_offset"])
+    end = begin + int(header["gt_count"]) * trace_gt_dtype.itemsize
+    return mm[begin:end].view(trace_gt_dtype)
+
+
+def trace_image_noise(mm, base=0):
+    """Noise channel (tsc, latency, kind, channel, old_cpu, new_cpu) of the
+    trace at base: CPU switches, interrupts and dropped samples of the
+    attacker threads, ordered by tsc. Empty for traces without one."""
+    header = mm[base : base + trace_header_dtype.itemsize].view(trace_header_dtype)[0]
+    begin = base + trace_header_dtype.itemsize
+    end = begin + trace_capture_dtype.itemsize
+    if int(header["header_size"]) < end - base:
+        return np.zeros(0, dtype=trace_noise_dtype)
+    capture = mm[begin:end].view(trace_capture_dtype)[0]
+    begin = base + int(capture["noise_offset"])
+    end = begin + int(capture["noise_count"]) * trace_noise_dtype.itemsize
+    return mm[begin:end].view(trace_noise_dtype)
+
+
+def load_trace_noise(filepath):
+    """Noise channel of a trace file, empty if it has none"""
+    if not is_binary_trace(filepath):
+        return np.zeros(0, dtype=trace_noise_dtype)
+    return trace_image_noise(np.memmap(filepath, dtype=np.uint8, mode="r"))
+
+
+def trace_image_coverage(mm, base=0):
+    """Coverage summary of every channel of the trace at base, None if the
+    run was not profiled with TRACE_COVERAGE=1
+
+    Next to the raw trace_coverage_t fields, covered is the fraction of the
+    window the line was monitored, probe_rate the probes per second and
+    reprime_hist the re-primes by log2 of their blind cycles.
+    """
+    header = mm[base : base + trace_header_dtype.itemsize].view(trace_header_dtype)[0]
+    if not header["flags"] & TRACE_FLAG_COVERAGE:
+        return None
+    capture = trace_image_capture(mm, base)
+    begin = base + trace_header_dtype.itemsize
+    raw = mm[begin : begin + trace_capture_dtype.itemsize].view(trace_capture_dtype)[0]
+    begin = base + int(raw["coverage_offset"])
+    end = begin + int(header["channel_count"]) * trace_coverage_dtype.itemsize
+    summaries = []
+    for coverage in mm[begin:end].view(trace_coverage_dtype):
+        window = int(coverage["window_cycles"])
+        summaries.append(
+            {
+                "window_cycles": window,
+                "probes": int(coverage["probes"]),
+                "reprimes": int(coverage["reprimes"]),
+                "blind_cycles": int(coverage["blind_cycles"]),
+                "max_blind_cycles": int(coverage["max_blind_cycles"]),
+                "covered": 1 - coverage["blind_cycles"] / window if window else 0.0,
+                "probe_rate": (
+                    coverage["probes"] * capture["tsc_freq"] / window if window else 0.0
+                ),
+                "reprime_hist": np.array(coverage["reprime_hist"]),
+            }
+        )
+    return summaries
+
+
+def load_trace_coverage(filepath):
+    """Coverage summaries of a trace file, see trace_image_coverage()"""
+    if not is_binary_trace(filepath):
+        return None
+    return trace_image_coverage(np.memmap(filepath, dtype=np.uint8, mode="r"))
+
+
+def load_trace_ground_truth(filepath):
+    """Ground truth records of a trace file, empty if it has none
+
+    cpython_pow traces hold the zero (0), window (1) and trailing (2)
+    events the runtime logged during the run.
+    """
+    if not is_binary_trace(filepath):
+        return np.zeros(0, dtype=trace_gt_dtype)
+    mm = np.memmap(filepath, dtype=np.uint8, mode="r")
+    return trace_image_ground_truth(mm)
+
+
+LIVE_TRACE_MAGIC = b"SCARLIV"
+LIVE_TRACE_DONE = 1
+
+live_trace_dtype = np.dtype(
+    [
+        ("magic", "S8"),
+        ("channel_count", "<u4"),
+        ("reserved0", "<u4"),
+        ("seq", "<u8"),
+        ("run", "<u4"),
+        ("state", "<u4"),
+        ("abort", "<u4"),
+        ("reserved1", "<u4"),
+        ("reserved", "<u8", (3,)),
+    ]
+)
+
+live_channel_dtype = np.dtype([("count", "<u8"), ("reserved", "<u8", (7,))])
+
+
+class LiveTrace:
+    """Tail a capture in progress through <dirpath>/live
+
+    The capture has to run with TRACE_LIVE=1, see include/live_trace.h.
+    poll() returns the samples added since the last call, starting at run
+    first_run.
+    """
+
+    def __init__(self, dirpath, first_run=0):
+        self.dirpath = Path(dirpath)
+        self.mm = np.memmap(self.dirpath / "live", dtype=np.uint8, mode="r+")
+        self.header = self.mm[: live_trace_dtype.itemsize].view(live_trace_dtype)
+        if self.header[0]["magic"] != LIVE_TRACE_MAGIC:
+            raise ValueError(f"{dirpath} has no live trace")
+        n = int(self.header[0]["channel_count"])
+        begin = live_trace_dtype.itemsize
+        end = begin + n * live_channel_dtype.itemsize
+        self.counts = self.mm[begin:end].view(live_channel_dtype)["count"]
+        self.run = first_run
+        self.consumed = np.zeros(n, dtype=np.uint64)
+        self.run_mm = None
+
+    def snapshot(self):
+        """Consistent (run, sample count per channel) of the running run"""
+        while True:
+            seq = int(self.header["seq"][0])
+            if seq & 1:
+                time.sleep(1e-4)
+                continue
+            run = int(self.header["run"][0])
+            counts = np.array(self.counts)
+            if int(self.header["seq"][0]) == seq:
+                return run, counts
+
+    @property
+    def done(self):
+        return int(self.header["state"][0]) == LIVE_TRACE_DONE
+
+    def abort(self):
+        """Stop the capture at the next sample, the run is still committed"""
+        self.header["abort"] = 1
+
+    def poll(self):
+        """New samples as a list of (run, [(tsc, lat) per channel])
+
+        Runs that ended since the last call are first read up to the sample
+        counts of their committed channel table.
+        """
+        run, counts = self.snapshot()
+        batches = []
+        while self.run < run:
+            batches.append((self.run, self.read_run(self.run, None)))
+            self.run += 1
+            self.consumed[:] = 0
+        if np.any(counts > self.consumed):
+            batches.append((run, self.read_run(run, counts)))
+        return batches
+
+    def read_run(self, run, counts):
+        path = self.dirpath / f"r{run}.out"
+        if self.run_mm is None or self.run_mm.filename != str(path.resolve()):
+            self.run_mm = np.memmap(path, dtype=np.uint8, mode="r")
+        mm = self.run_mm
+        header = mm[: trace_header_dtype.itemsize].view(trace_header_dtype)[0]
+        begin = int(header["header_size"])
+        end = begin + len(self.consumed) * trace_channel_dtype.itemsize
+        channels = mm[begin:end].view(trace_channel_dtype)
+        if counts is None:
+            counts = channels["sample_count"].astype(np.uint64)
+        counts = np.maximum(counts, self.consumed)
+
+        columns = []
+        for ch, first, n in zip(channels, self.consumed.tolist(), counts.tolist()):
+            tsc_offset = int(ch["tsc_offset"])
+            lat_offset = int(ch["lat_offset"])
+            tsc = mm[tsc_offset + 8 * first : tsc_offset + 8 * n].view("<u8")
+            lat = mm[lat_offset + 8 * first : lat_offset + 8 * n].view("<u8")
+            columns.append((np.array(tsc), np.array(lat)))
+        self.consumed = counts
+        return columns
+
+
+class TraceSlice(ctypes.Structure):
+    """trace_slice_t of include/trace_reader.h"""
+
+    _fields_ = [
+        ("tsc", ctypes.c_void_p),
+        ("latency", ctypes.c_void_p),
+        ("first", ctypes.c_uint64),
+        ("count", ctypes.c_uint64),
+    ]
+
+
+class ResultKey(ctypes.Structure):
+    """result_key_t of include/result_store.h"""
+
+    _fields_ = [
+        ("content", ctypes.c_uint64),
+        ("analysis", ctypes.c_uint64),
+        ("params", ctypes.c_uint64),
+    ]
+
+
+RESULT_MISS, RESULT_FOUND, RESULT_EMPTY = 0, 1, 2
+
+
+@lru_cache(maxsize=None)
+def trace_library():
+    """libtrace_reader.so from src/utils, None if it has not been built"""
+    root = Path(__file__).resolve().parents[1]
+    for path in (
+        os.environ.get("TRACE_READER_LIB"),
+        root / "build" / "src" / "utils" / "libtrace_reader.so",
+    ):
+        if path and os.path.exists(path):
+            break
+    else:
+        return None
+
+    lib = ctypes.CDLL(str(path))
+    ptr, u32, u64 = ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint64
+    lib.trace_reader_size.restype = ctypes.c_size_t
+    lib.trace_reader_open.argtypes = [ptr, ctypes.c_char_p]
+    lib.trace_reader_attach.argtypes = [ptr, ptr, u64]
+    lib.trace_reader_close.argtypes = [ptr]
+    lib.trace_reader_channel_count.argtypes = [ptr]
+    lib.trace_reader_channel_count.restype = u32
+    lib.trace_reader_sample_count.argtypes = [ptr, u32]
+    lib.trace_reader_sample_count.restype = u64
+    for column in (lib.trace_reader_tsc, lib.trace_reader_latency):
+        column.argtypes = [ptr, u32]
+        column.restype = ptr
+    lib.trace_range.argtypes = [ptr, u32, u64, u64, ctypes.POINTER(TraceSlice)]
+    lib.trace_reader_event_count.argtypes = [ptr]
+    lib.trace_reader_event_count.restype = u64
+    lib.trace_reader_events.argtypes = [ptr, ptr]
+    lib.trace_hit_mask.argtypes = [ptr, u64, ctypes.c_int, ptr]
+    lib.trace_hit_mask.restype = u64
+    key, size = ctypes.POINTER(ResultKey), ctypes.POINTER(u64)
+    lib.result_store_size.restype = ctypes.c_size_t
+    lib.result_hash.argtypes = [ptr, u64, u64]
+    lib.result_hash.restype = u64
+    lib.result_store_open.argtypes = [ptr, ctypes.c_char_p]
+    lib.result_store_get.argtypes = [ptr, key, ptr, u64, size]
+    lib.result_store_put.argtypes = [ptr, key, ctypes.c_int, ptr, u64]
+    return lib
+
+
+class NativeTrace:
+    """trace_reader_t of include/trace_reader.h
+
+    Columns are read-only NumPy views of the mapped trace (or of the
+    decoded packed columns) and keep the reader alive.
+    """
+
+    def __init__(self, filepath=None, image=None, offset=0):
+        self.lib = trace_library()
+        self.reader = ctypes.create_string_buffer(self.lib.trace_reader_size())
+        self.image = image
+        if image is None:
+            ret = self.lib.trace_reader_open(self.reader, os.fsencode(filepath))
+        else:
+            ret = self.lib.trace_reader_attach(
+                self.reader, image.ctypes.data + offset, len(image) - offset
+            )
+        if ret:
+            raise ValueError(f"Cannot read trace {filepath or offset}")
+
+    def __del__(self):
+        self.lib.trace_reader_close(self.reader)
+
+    def view(self, address, n):
+        if address is None:
+            raise ValueError("Cannot read trace column")
+        if n == 0:
+            return np.zeros(0, dtype=np.uint64)
+        buf = (ctypes.c_uint64 * n).from_address(address)
+        buf.owner = self
+        column = np.frombuffer(buf, dtype=np.uint64)
+        column.flags.writeable = False
+        return column
+
+    def columns(self):
+        columns = []
+        for j in range(self.lib.trace_reader_channel_count(self.reader)):
+            n = self.lib.trace_reader_sample_count(self.reader, j)
+            tsc = self.view(self.lib.trace_reader_tsc(self.reader, j), n)
+            lat = self.view(self.lib.trace_reader_latency(self.reader, j), n)
+            columns.append((tsc, lat))
+        return columns
+
+    def events(self):
+        """Samples of all channels as one trace_event_dtype array in tsc order"""
+        events = np.empty(
+            self.lib.trace_reader_event_count(self.reader), dtype=trace_event_dtype
+        )
+        if self.lib.trace_reader_events(self.reader, events.ctypes.data):
+            raise ValueError("Cannot merge trace channels")
+        return events
+
+    def range(self, channel, tsc_lo, tsc_hi):
+        """(tsc, lat) views of the samples with tsc_lo <= tsc < tsc_hi"""
+        s = TraceSlice()
+        if self.lib.trace_range(self.reader, channel, tsc_lo, tsc_hi, s):
+            raise ValueError(f"Cannot read trace channel {channel}")
+        return self.view(s.tsc, s.count), self.view(s.latency, s.count)
+
+
+def trace_range(column, tsc_lo, tsc_hi):
+    """(tsc, lat) views of a column with tsc_lo <= tsc < tsc_hi
+
+    Same as NativeTrace.range() for columns already in memory, found by
+    binary search instead of a scan.
+    """
+    tsc, lat = column
+    lo, hi = np.searchsorted(tsc, [tsc_lo, max(tsc_lo, tsc_hi)], side="left")
+    return tsc[lo:hi], lat[lo:hi]
+
+
+def trace_hit_mask(lat, attack="FR", capture=None, channel=0):
+    """lat_to_hit over a whole latency column
+
+    With the capture block of the trace, the thresholds the attacker ran
+    with replace the global lat_to_clevel() constants.
+    """
+    lat = np.ascontiguousarray(lat, dtype=np.uint64)
+    if capture is not None and channel < len(capture["channels"]):
+        threshold = int(capture["channels"][channel]["threshold"])
+        if attack == "FR" and threshold > 0:
+            return (lat > 0) & (lat < threshold)
+        if attack != "FR" and capture["interrupt_thresh"] > 0:
+            return (lat > max(threshold, 0)) & (lat < capture["interrupt_thresh"])
+    lib = trace_library()
+    if lib is None:
+        if attack == "FR":
+            return (lat > 0) & (lat < 240)
+        return lat > 0
+    mask = np.empty(len(lat), dtype=np.bool_)
+    lib.trace_hit_mask(
+        lat.ctypes.data, len(lat), TRACE_ATTACKS[attack], mask.ctypes.data
+    )
+    return mask
+
+
+def text_trace_columns(filepath):
+    """Parse a tsc:lat text dump into columns, dropping the 0:0 padding"""
+    with open(filepath) as f:
+        text = f.read()
+    channels = len(text.split("\n", 1)[0].split())
+    if channels == 0:
+        return []
+    values = np.array(text.replace(":", " ").split(), dtype=np.uint64)
+    values = values.reshape(-1, 2 * channels)
+    columns = []
+    for j in range(channels):
+        tsc, lat = values[:, 2 * j], values[:, 2 * j + 1]
+        samples = (tsc != 0) | (lat != 0)
+        columns.append((tsc[samples], lat[samples]))
+    return columns
+
+
+def load_trace_columns(filepath):
+    """Return a list of (tsc, lat) arrays per channel of a trace file
+
+    Binary traces go through libtrace_reader.so when it is built and
+    through numpy.memmap otherwise, text dumps are parsed.
+    """
+    if not is_binary_trace(filepath):
+        return text_trace_columns(filepath)
+    if trace_library() is not None:
+        return NativeTrace(filepath).columns()
+    return trace_image_columns(np.memmap(filepath, dtype=np.uint8, mode="r"))
+
+
+def load_trace_events(filepath):
+    """Samples of all channels of a trace file as one stream in tsc order
+
+    Returns a trace_event_dtype array (tsc, channel, latency), read from the
+    event channels stored with binary traces when there are any.
+    """
+    if not is_binary_trace(filepath):
+        return columns_to_events(text_trace_columns(filepath))
+    if trace_library() is not None:
+        return NativeTrace(filepath).events()
+    return trace_image_events(np.memmap(filepath, dtype=np.uint8, mode="r"))
+
+
+def columns_to_frame(columns):
+    # Channels hold only their own samples, the row-aligned frame pads the
+    # shorter ones with [0, 0] like the text format
+    rows = max((len(tsc) for tsc, lat in columns), default=0)
+    frame = {}
+    for j, (tsc, lat) in enumerate(columns):
+        samples = np.zeros((rows, 2), dtype=np.uint64)
+        samples[: len(tsc), 0] = tsc
+        samples[: len(lat), 1] = lat
+        frame[j] = samples.tolist()
+    return pd.DataFrame(frame)
+
+
+TRACE_SEGMENT_MAGIC = b"SCARSEG\x00"
+TRACE_SEGMENT_INDEX_MAGIC = b"SCARIDX\x00"
+TRACE_SEGMENT_RUN = 0xFFFFFFFF
+
+trace_segment_entry_dtype = np.dtype(
+    [
+        ("key_id", "<u4"),
+        ("run_id", "<u4"),
+        ("channel", "<u4"),
+        ("reserved", "<u4"),
+        ("offset", "<u8"),
+        ("length", "<u8"),
+    ]
+)
+
+trace_segment_trailer_dtype = np.dtype(
+    [
+        ("index_offset", "<u8"),
+        ("entry_count", "<u8"),
+        ("magic", "S8"),
+        ("reserved", "<u8"),
+    ]
+)
+
+
+def is_trace_segment(filepath):
+    with open(filepath, "rb") as f:
+        return f.read(len(TRACE_SEGMENT_MAGIC)) == TRACE_SEGMENT_MAGIC
+
+
+class TraceSegment:
+    """Reader for the append-only segment files of include/trace_segment.h"""
+
+    def __init__(self, filepath):
+        self.filepath = str(filepath)
+        self.mm = np.memmap(self.filepath, dtype=np.uint8, mode="r")
+        if bytes(self.mm[: len(TRACE_SEGMENT_MAGIC)]) != TRACE_SEGMENT_MAGIC:
+            raise ValueError(f"{filepath} is not a trace segment")
+        trailer = self.mm[-trace_segment_trailer_dtype.itemsize :]
+        trailer = trailer.view(trace_segment_trailer_dtype)[0]
+        if trailer["magic"] != TRACE_SEGMENT_INDEX_MAGIC.rstrip(b"\x00"):
+            raise ValueError(f"{filepath} has no segment index")
+        begin = int(trailer["index_offset"])
+        end = begin + int(trailer["entry_count"]) * trace_segment_entry_dtype.itemsize
+        self.index = self.mm[begin:end].view(trace_segment_entry_dtype)
+        runs = self.index[self.index["channel"] == TRACE_SEGMENT_RUN]
+        run_keys = list(zip(runs["key_id"].tolist(), runs["run_id"].tolist()))
+        self.runs = dict(zip(run_keys, runs["offset"].tolist()))
+        self.run_lengths = dict(zip(run_keys, runs["length"].tolist()))
+
+    def keys(self):
+        return sorted({key_id for key_id, _ in self.runs})
+
+    def key_runs(self, key_id):
+        return sorted(run_id for k, run_id in self.runs if k == key_id)
+
+    def load_trace_columns(self, key_id, run_id):
+        offset = self.runs[(key_id, run_id)]
+        if trace_library() is not None:
+            return NativeTrace(image=self.mm, offset=offset).columns()
+        return trace_image_columns(self.mm, offset)
+
+    def load_trace_events(self, key_id, run_id):
+        offset = self.runs[(key_id, run_id)]
+        if trace_library() is not None:
+            return NativeTrace(image=self.mm, offset=offset).events()
+        return trace_image_events(self.mm, offset)
+
+    def load_trace_capture(self, key_id, run_id):
+        return trace_image_capture(self.mm, self.runs[(key_id, run_id)])
+
+    def load_trace_noise(self, key_id, run_id):
+        return trace_image_noise(self.mm, self.runs[(key_id, run_id)])
+
+    def load_trace_coverage(self, key_id, run_id):
+        return trace_image_coverage(self.mm, self.runs[(key_id, run_id)])
+
+    def load_trace(self, key_id, run_id):
+        return columns_to_frame(self.load_trace_columns(key_id, run_id))
+
+    def content_hash(self, key_id, run_id):
+        """Result store key of a run, the hash of its trace image"""
+        offset = self.runs[(key_id, run_id)]
+        length = self.run_lengths[(key_id, run_id)]
+        return result_hash(self.mm[offset : offset + length])
+
+
+@lru_cache(maxsize=None)
+def open_segment(filepath):
+    """Per-process segment mapping, shared by worker tasks"""
+    return TraceSegment(filepath)
+
+
+def result_hash(data, seed=0):
+    """result_hash() of include/result_store.h over a str, bytes or array"""
+    if isinstance(data, str):
+        data = data.encode()
+    if isinstance(data, bytes):
+        data = np.frombuffer(data, dtype=np.uint8)
+    data = np.ascontiguousarray(data)
+    return trace_library().result_hash(data.ctypes.data, data.nbytes, seed)
+
+
+def trace_content_hash(filepath):
+    """Result store key of a trace file, independent of its name"""
+    return result_hash(np.memmap(filepath, dtype=np.uint8, mode="r"))
+
+
+def result_store_path():
+    """$SCAR_RESULT_STORE, or results.store next to the running script"""
+    default = Path(sys.argv[0] or ".").resolve().parent / "results.store"
+    return os.environ.get("SCAR_RESULT_STORE", str(default))
+
+
+@lru_cache(maxsize=None)
+def open_result_store(filepath):
+    """Per-process result_store_t, shared by every ResultStore of filepath"""
+    lib = trace_library()
+    store = ctypes.create_string_buffer(lib.result_store_size())
+    if lib.result_store_open(store, os.fsencode(filepath)):
+        raise OSError(f"Cannot open result store {filepath}")
+    return store
+
+
+class ResultStore:
+    """Results of one analysis in the store of include/result_store.h
+
+    Results are keyed by the content hash of the trace, the analysis name
+    and the analysis parameters. Bump the version in the name whenever the
+    algorithm changes, parameter changes miss on their own. None is stored
+    as an empty result rather than a sentinel string. The object only holds
+    hashes, so it can be passed to pool workers, which commit concurrently.
+    Without libtrace_reader.so nothing is stored.
+    """
+
+    def __init__(self, analysis, filepath=None, **params):
+        self.filepath = filepath or result_store_path()
+        self.enabled = trace_library() is not None
+        if self.enabled:
+            self.analysis = result_hash(analysis)
+            params = json.dumps(params, sort_keys=True, default=str)
+            self.params = result_hash(params)
+
+    def key(self, content):
+        return ResultKey(content, self.analysis, self.params)
+
+    def get(self, content):
+        """(True, result) if content was analyzed before, else (False, None)"""
+        if not self.enabled:
+            return False, None
+        lib, store = trace_library(), open_result_store(self.filepath)
+        key, size = self.key(content), ctypes.c_uint64(0)
+        buf = ctypes.create_string_buffer(4096)
+        status = lib.result_store_get(store, key, buf, len(buf), size)
+        if status == RESULT_FOUND and size.value > len(buf):
+            buf = ctypes.create_string_buffer(size.value)
+            status = lib.result_store_get(store, key, buf, len(buf), size)
+        if status == RESULT_MISS:
+            return False, None
+        if status == RESULT_EMPTY:
+            return True, None
+        return True, buf.raw[: size.value].decode()
+
+    def put(self, content, result):
+        if not self.enabled:
+            return
+        status = RESULT_EMPTY if result is None else RESULT_FOUND
+        value = b"" if result is None else str(result).encode()
+        lib, store = trace_library(), open_result_store(self.filepath)
+        if lib.result_store_put(store, self.key(content), status, value, len(value)):
+            raise OSError(f"Cannot commit to result store {self.filepath}")
+
+    def memoize(self, content, analyze, refresh=False):
+        """Result of analyze() for content, only run if it is not stored yet"""
+        hit, result = (False, None) if refresh else self.get(content)
+        if not hit:
+            result = analyze()
+            self.put(content, result)
+        return result
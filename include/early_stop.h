@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Sequential early stop of target set screening.
+ *
+ * The line of a target set is hit at multiples of a known base frequency.
+ * The phases of the hits at that frequency are summed over blocks of
+ * EARLY_STOP_BLOCK_HITS hits, a running Goertzel power. Without a component
+ * at the base frequency the power of a block divided by its hits is
+ * exponential with mean 1. A target set keeping EARLY_STOP_COHERENCE of
+ * its phase has a mean of 1 + EARLY_STOP_BLOCK_HITS * EARLY_STOP_COHERENCE^2.
+ * A sequential probability ratio test over the blocks stops at the first
+ * block its log-likelihood ratio leaves [log(beta / (1 - alpha)),
+ * log((1 - beta) / alpha)].
+ *
+ * A block is also closed when it lasts EARLY_STOP_SLACK times as long as
+ * its hits would take at the base frequency, so that quiet sets are
+ * rejected after a few blocks too.
+ */
+
+#define EARLY_STOP_BLOCK_HITS (64)
+#define EARLY_STOP_SLACK (16)
+#define EARLY_STOP_COHERENCE (0.25)
+// False reject and false accept rates
+#define EARLY_STOP_ALPHA (0.01)
+#define EARLY_STOP_BETA (0.01)
+
+typedef enum early_stop_decision_t {
+	EARLY_STOP_UNDECIDED,
+	EARLY_STOP_REJECT,
+	EARLY_STOP_ACCEPT,
+} early_stop_decision_t;
+
+typedef struct early_stop_t {
+	// Radians per cycle of the base frequency, 0 never decides
+	double omega;
+	uint64_t block_cycles;
+	// Phase sums and hits of the current block, and where it started
+	double re;
+	double im;
+	uint32_t block_hits;
+	uint64_t block_tsc;
+	uint64_t blocks;
+	uint64_t hits;
+	double llr;
+	early_stop_decision_t decision;
+} early_stop_t;
+
+/* EARLY_STOP is set in the environment */
+int early_stop_enabled(void);
+
+/*
+ * Test for base_freq Hz on a tsc_freq Hz time stamp counter, a base_freq of
+ * 0 never decides
+ */
+void early_stop_init(early_stop_t *es, uint32_t base_freq, uint64_t tsc_freq);
+
+/* Forget every block, the first one starts at tsc */
+void early_stop_reset(early_stop_t *es, uint64_t tsc);
+
+/* Add a hit at tsc, returns the decision */
+early_stop_decision_t early_stop_hit(early_stop_t *es, uint64_t tsc);
+
+/* Close the current block at tsc as timed out, returns the decision */
+early_stop_decision_t early_stop_timeout(early_stop_t *es, uint64_t tsc);
+
+/* Decision at tsc, closes the current block if it timed out */
+static inline early_stop_decision_t early_stop_poll(early_stop_t *es,
+                                                    uint64_t tsc) {
+	if (es->decision != EARLY_STOP_UNDECIDED ||
+	    tsc - es->block_tsc < es->block_cycles) {
+		return es->decision;
+	}
+	return early_stop_timeout(es, tsc);
+}
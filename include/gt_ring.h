@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "trace.h"
+
+/*
+ * Ground truth ring in shared memory, between a runtime and the attacker.
+ *
+ * The runtime pushes one trace_gt_t per instrumented victim event, the
+ * attacker drains the ring after every run and stores the records in its
+ * trace. head and tail are 64-bit counters that never wrap, so a run is not
+ * limited in the number of events it logs, only in how many may be pending
+ * at once. Pushing to a full ring drops the record and counts it.
+ */
+
+#define GT_RING_SIZE (1 << 20)
+
+typedef struct gt_ring_t {
+	uint64_t head;
+	uint64_t dropped;
+	uint8_t pad0[48];
+	uint64_t tail;
+	uint8_t pad1[56];
+	trace_gt_t records[GT_RING_SIZE];
+} gt_ring_t;
+
+/* Attach to the ring of proj_id, creating it if needed */
+gt_ring_t *gt_ring_attach(int proj_id);
+
+/* Remove the ring of proj_id and attach to a new, empty one */
+gt_ring_t *gt_ring_reset(int proj_id);
+
+static inline void gt_ring_push(gt_ring_t *ring, uint64_t tsc, uint64_t event) {
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail >= GT_RING_SIZE) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	trace_gt_t *record = &ring->records[head & (GT_RING_SIZE - 1)];
+	record->tsc = tsc;
+	record->event = event;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Number of records waiting to be drained */
+uint64_t gt_ring_pending(gt_ring_t *ring);
+
+/* Move up to max records to dst, oldest first. Returns how many */
+uint64_t gt_ring_drain(gt_ring_t *ring, trace_gt_t *dst, uint64_t max);
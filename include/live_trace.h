@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Live publication of a capture in progress, enabled with TRACE_LIVE=1.
+ *
+ * The samples already go to the MAP_SHARED run files of sample_buffer.h, so
+ * only the number of samples per channel has to be published. The profiling
+ * loops release-store it into <dirpath>/live after every sample, and a
+ * reader process maps that file next to the current rN.out to consume the
+ * new samples in batches (LiveTrace in experiments/trace_utils.py).
+ *
+ * Live file layout:
+ *
+ *   live_trace_t                              64 bytes
+ *   live_channel_t[channel_count]             64 bytes each
+ *
+ * run and the channel counts are switched under the seqlock seq, which is
+ * odd while the next run is being set up. A reader takes a consistent
+ * snapshot by reading seq, run and the counts, then seq again. Setting abort
+ * makes the profiling loops stop at their next sample and the attacker
+ * threads stop after the current run.
+ */
+
+#define LIVE_TRACE_MAGIC "SCARLIV"
+
+typedef enum live_trace_state_t {
+	LIVE_TRACE_RUNNING,
+	LIVE_TRACE_DONE,
+} live_trace_state_t;
+
+typedef struct live_channel_t {
+	uint64_t count;
+	uint64_t reserved[7];
+} live_channel_t;
+
+typedef struct live_trace_t {
+	char magic[8];
+	uint32_t channel_count;
+	uint32_t reserved0;
+	uint64_t seq;
+	uint32_t run;
+	uint32_t state;
+	uint32_t abort;
+	uint32_t reserved1;
+	uint64_t reserved[3];
+	live_channel_t channels[];
+} live_trace_t;
+
+/* TRACE_LIVE is set in the environment */
+int live_trace_enabled(void);
+
+/*
+ * Create <dirpath>/live for cl_cnt channels, NULL on error. It is returned
+ * by live_trace_get() until it is closed.
+ */
+live_trace_t *live_trace_create(const char *dirpath, int cl_cnt);
+
+/* Mark the capture as done and unmap it */
+void live_trace_close(live_trace_t *live);
+
+/* Live trace of the running capture, NULL if there is none */
+live_trace_t *live_trace_get(void);
+
+/* Switch readers to run, with every channel count back at 0 */
+void live_trace_begin_run(live_trace_t *live, uint32_t run);
+
+static inline void
+live_trace_publish(live_trace_t *live, int channel, uint64_t count) {
+	if (live != NULL) {
+		__atomic_store_n(
+		    &live->channels[channel].count, count, __ATOMIC_RELEASE);
+	}
+}
+
+static inline int live_trace_aborted(live_trace_t *live) {
+	return live != NULL &&
+	       __atomic_load_n(&live->abort, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "trace.h"
+
+/*
+ * Out-of-band event log of the profiling loops.
+ *
+ * Formatting a log line inside the timed loop takes longer than the event
+ * it reports. Every attacker slot instead pushes its CPU migrations,
+ * interrupt probes and dropped samples into a ring of its own, a handful of
+ * stores per event. After the run, noise_ring_collect() drains the rings of
+ * all slots into the noise channel of the next traces (trace.h). A ring
+ * keeps the last NOISE_RING_SIZE events of a run, older ones are lost and
+ * counted.
+ */
+
+#define NOISE_RING_SIZE (1 << 12)
+
+typedef struct noise_ring_t {
+	// Events pushed since the last drain, lost ones included
+	uint64_t head;
+	int slot;
+	trace_noise_t events[NOISE_RING_SIZE];
+} noise_ring_t;
+
+/*
+ * Ring of slot, allocated and faulted in by the first call. NULL if slot is
+ * out of range.
+ */
+noise_ring_t *noise_ring_get(int slot);
+
+static inline __attribute__((always_inline)) void
+noise_ring_push(noise_ring_t *ring,
+                uint64_t tsc,
+                trace_noise_kind_t kind,
+                uint32_t old_cpu,
+                uint32_t new_cpu,
+                uint64_t latency) {
+	if (ring == NULL) {
+		return;
+	}
+	trace_noise_t *event = &ring->events[ring->head++ & (NOISE_RING_SIZE - 1)];
+	event->tsc = tsc;
+	event->latency = latency > UINT32_MAX ? UINT32_MAX : latency;
+	event->kind = kind;
+	event->channel = ring->slot;
+	event->old_cpu = old_cpu;
+	event->new_cpu = new_cpu;
+}
+
+/*
+ * Drain the rings of slots [0, cl_cnt) by tsc into the noise channel of the
+ * traces the calling thread writes next (trace_set_noise()). Returns the
+ * number of events.
+ */
+uint64_t noise_ring_collect(int cl_cnt);
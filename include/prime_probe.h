@@ -1,13 +1,19 @@
 #pragma once
 
+#include "sample_buffer.h"
+#include "sample_stream.h"
 #include "shared_memory.h"
+#include "trace_segment.h"
+#include "trace_writer.h"
 #include "cache/helper_thread.h"
 #include "cache/cache.h"
+#include "prime_scope.h"
 
 #include <stdint.h>
 #include <pthread.h>
 
 #define NUM_PAGE_SLOTS (PAGE_SIZE / CL_SIZE)
+#define PS_SCAN_SETS (4)
 
 extern const uint32_t l2_repeat, array_repeat;
 extern const double bad_threshold_ratio;
@@ -24,7 +30,15 @@ typedef struct PS_attacker_thread_config_t {
 	pthread_barrier_t *threads_barrier;
 	uint64_t **sample_tsc;
 	uint64_t **probe_time;
+	uint64_t *sample_count;
+	// Packed records in the sample_tsc columns relative to tsc_base[slot],
+	// NULL for (tsc, latency) columns. Not used with buffer or stream.
+	uint64_t *tsc_base;
+	trace_writer_t *writer;
+	sample_buffer_t *buffer;
+	sample_stream_t *stream;
 	uint8_t *target;
+	int l3_set;
 	EVSet *evset;
 	evchain *chain;
 	uint8_t *scope;
@@ -42,8 +56,12 @@ typedef struct PP_attacker_thread_config_t {
 	pthread_barrier_t *threads_barrier;
 	uint64_t **sample_tsc;
 	uint64_t **probe_time;
+	uint64_t *sample_count;
+	trace_writer_t *writer;
+	sample_buffer_t *buffer;
 	uintptr_t target;
 	int threshold;
+	int l3_set;
 	EVSet *evset;
 } PP_attacker_thread_config_t;
 
@@ -51,15 +69,35 @@ typedef struct PP_attacker_thread_config_t {
 	do {                                                    \
 		config.test_name = test_name;                       \
 		config.cache_line_count = cache_line_count;         \
-		config.profile_iterations = profile_iterations;           \
+		config.profile_iterations = profile_iterations;     \
 		config.max_exec_cycles = max_exec_cycles;           \
 		config.victim_runs = victim_runs;                   \
 		config.threads_barrier = &attacker_threads_barrier; \
 		config.sample_tsc = sample_tsc;                     \
 		config.probe_time = probe_time;                     \
+		config.sample_count = sample_count;                 \
+		config.writer = NULL;                               \
+		config.buffer = NULL;                               \
+		config.stream = NULL;                               \
+		config.tsc_base = NULL;                             \
+		config.l3_set = -1;                                 \
 	} while (0)
 
-#define PP_thread_config_init(config) PS_thread_config_init(config)
+#define PP_thread_config_init(config)                       \
+	do {                                                    \
+		config.test_name = test_name;                       \
+		config.cache_line_count = cache_line_count;         \
+		config.profile_iterations = profile_iterations;     \
+		config.max_exec_cycles = max_exec_cycles;           \
+		config.victim_runs = victim_runs;                   \
+		config.threads_barrier = &attacker_threads_barrier; \
+		config.sample_tsc = sample_tsc;                     \
+		config.probe_time = probe_time;                     \
+		config.sample_count = sample_count;                 \
+		config.writer = NULL;                               \
+		config.buffer = NULL;                               \
+		config.l3_set = -1;                                 \
+	} while (0)
 
 uint32_t PS_profile_once(EVSet *evset,
                          int slot,
@@ -68,24 +106,121 @@ uint32_t PS_profile_once(EVSet *evset,
                          uint64_t **sample_tsc,
                          uint64_t **probe_time);
 
-void PP_profile_once(EVSet *evset,
-                     int slot,
-                     const char *label,
-                     int threshold,
-                     int profile_iterations,
-                     uint64_t max_exec_cycles,
-                     uint64_t **sample_tsc,
-                     uint64_t **probe_time);
+/*
+ * Number of eviction sets the target set searches screen per victim run,
+ * PS_SCAN_SETS unless PS_SCAN_SETS is set in the environment
+ */
+int PS_scan_sets(void);
+
+/*
+ * Profile count <= PRIME_SCOPE_MAX_SETS eviction sets round-robin from slot
+ * 0 during one victim run, recording evsets[k] in column k and its number of
+ * samples in sample_count[k]. Profiling stops when the victim pauses.
+ * Returns the blind spot in cycles the scan adds to every set.
+ */
+uint64_t PS_profile_multi(EVSet **evsets,
+                          int count,
+                          uint64_t profile_iterations,
+                          uint64_t max_exec_cycles,
+                          uint64_t **sample_tsc,
+                          uint64_t **probe_time,
+                          uint64_t *sample_count);
+
+/*
+ * PS_profile_multi() over a queue: evsets[0, count) are profiled first and
+ * every set its early_stop rejects makes room for the next of evsets[count,
+ * total), early_stop NULL rejects none. early_stop[k] has to be initialized
+ * for evsets[k]. place[k] gets the set whose samples ended in column k, -1
+ * for none, and sample_count[k] their number. Returns the number of sets
+ * profiled, the others are left for the next victim run.
+ */
+int PS_profile_screen(EVSet **evsets,
+                      int count,
+                      int total,
+                      early_stop_t *early_stop,
+                      uint64_t profile_iterations,
+                      uint64_t max_exec_cycles,
+                      uint64_t **sample_tsc,
+                      uint64_t **probe_time,
+                      uint64_t *sample_count,
+                      int *place);
+
+/*
+ * PS_profile_once() pushing the samples to ring instead of columns, for as
+ * long as the profiling window lasts
+ */
+uint32_t PS_profile_stream(EVSet *evset,
+                           int slot,
+                           uint64_t max_exec_cycles,
+                           sample_ring_t *ring);
+
+/*
+ * PS_profile_once() storing every sample as one trace_record_t, relative to
+ * the tsc_base it sets
+ */
+uint32_t PS_profile_records(EVSet *evset,
+                            int slot,
+                            uint64_t profile_iterations,
+                            uint64_t max_exec_cycles,
+                            trace_record_t *records,
+                            uint64_t *tsc_base);
+
+uint32_t PP_profile_once(EVSet *evset,
+                         int slot,
+                         const char *label,
+                         int threshold,
+                         int profile_iterations,
+                         uint64_t max_exec_cycles,
+                         uint64_t **sample_tsc,
+                         uint64_t **probe_time);
+
+/*
+ * Record the attacker thread of slot in the trace capture: its core and
+ * node, the L3 set of its eviction set (-1 if unknown) and its threshold.
+ * Slot 0 also records the parameters shared by all channels.
+ */
+void capture_profiling_thread(int slot,
+                              trace_attack_t attack,
+                              int l3_set,
+                              int threshold,
+                              int profile_iterations,
+                              uint64_t max_exec_cycles);
+
+/* Record the action starting the victim and its sync_ctx.data argument */
+void capture_victim_action(sync_ctx_action_t action);
+
+/*
+ * Update the threshold tracker of a slot once its run is dumped and record
+ * the threshold of its next run in the trace capture; returns it, or
+ * calibrated without a tracker. Once the hit and miss latencies of the slot
+ * overlap it falls back to calibrated. After THRESH_TRACK_STRIKES such runs
+ * in a row it first rebuilds *evset from target (0 for never) on hctrl, or
+ * a helper thread of its own if NULL, frees the old set if it rebuilt that
+ * one too and relinks *sf_chain if set. A Prime+Probe slot (para) also
+ * recalibrates calibrated.
+ */
+int profiling_thresh_update(thresh_track_t *thresh,
+                            EVSet **evset,
+                            evchain **sf_chain,
+                            uintptr_t target,
+                            helper_thread_ctrl *hctrl,
+                            int *calibrated,
+                            int para);
 
 void *PS_attacker_thread(void *args);
 void *PP_attacker_thread(void *args);
 
 int LLCF_multi_evset(u32 n_offset, helper_thread_ctrl *hctrl);
 
+/*
+ * sample_count holds the number of samples of every channel, NULL ends a
+ * channel at its first zero timestamp.
+ */
 void dump_profiling_trace(const char *dump_prefix,
                           int dump_id,
                           uint64_t **sample_tsc,
                           uint64_t **reload_time,
+                          const uint64_t *sample_count,
                           int cl_cnt,
                           int sp_cnt);
 
@@ -93,13 +228,41 @@ void dump_profiling_traces(const char *dump_prefix,
                            int victim_runs,
                            uint64_t **sample_tsc,
                            uint64_t **reload_time,
+                           const uint64_t *sample_count,
                            int cl_cnt,
                            int sp_cnt,
                            int reset);
 
+/*
+ * dump_profiling_traces() of records, written as they are with
+ * TRACE_FORMAT=records and expanded into columns otherwise
+ */
+void dump_profiling_records(const char *dump_prefix,
+                            int victim_runs,
+                            trace_record_t **records,
+                            const uint64_t *tsc_base,
+                            const uint64_t *sample_count,
+                            int cl_cnt,
+                            int sp_cnt,
+                            int reset);
+
+/*
+ * Append the following dump_profiling_traces() runs to segment under key_id
+ * instead of creating output/<prefix>_rNNNNN/rN.out files. NULL restores the
+ * per-run files.
+ */
+void dump_profiling_segment(trace_segment_t *segment, uint32_t key_id);
+
 // LLCFeasible
 EVSet ***build_l2_evsets_all(void);
 EVCands ***build_evcands_all(EVBuildConfig *conf, EVSet ***l2evsets);
 EVSet *get_sf_kth_evset(int k);
 EVSet *prepare_evset(u8 *target, helper_thread_ctrl *hctrl);
 void prepare_evset_thres(uintptr_t target, EVSet **evset, int *threshold);
+/*
+ * prepare_evset() on hctrl, or on a helper thread of its own if NULL.
+ * NULL on failure.
+ */
+EVSet *rebuild_evset(uintptr_t target, helper_thread_ctrl *hctrl);
+/* Free an eviction set prepare_evset() built, its lines stay in the pool */
+void release_evset(EVSet *evset);
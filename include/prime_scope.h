@@ -0,0 +1,393 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "arch.h"
+#include "cache/cache.h"
+#include "early_stop.h"
+#include "live_trace.h"
+#include "log.h"
+#include "noise_ring.h"
+#include "sample_stream.h"
+#include "shared_memory.h"
+#include "thresh_track.h"
+#include "trace.h"
+
+/*
+ * Prime+Scope profiling kernel shared by all attackers.
+ *
+ * The scope line of the primed eviction set is timed in a tight loop. A
+ * latency above threshold means the victim evicted it: the sample is kept
+ * unless it is an interrupt, and the eviction set is primed again. The
+ * loop ends after max_exec_cycles, after max_samples samples, or when a
+ * live trace reader aborts the capture (live_trace.h). Streamed samples
+ * (sample_stream.h) are not bounded by max_samples.
+ *
+ * With PRIME_SCOPE_NOISE_LOG, the single set kernel pushes every CPU
+ * migration and interrupt probe to the noise ring of the slot instead of
+ * logging it, nothing in the loop formats text.
+ *
+ * PRIME_SCOPE_RECORD_PACKED stores every sample as one trace_record_t
+ * (trace.h) relative to tsc_base, half the memory of the two columns. The
+ * single set kernel also flags CPU switches, interrupts and samples taken
+ * on the first probe after a re-prime.
+ *
+ * With coverage set, the single set kernel also adds its probes, its
+ * window and the blind spot of every re-prime after a hit, from the end of
+ * the probe to the end of the re-prime, to the trace_coverage_t.
+ *
+ * With thresh set, the single set kernel also counts the latency of every
+ * probe into the threshold tracker of the slot (thresh_track.h).
+ *
+ * With gap_hist set, the kernel also counts the log2 of the cycles between
+ * consecutive samples, the first one from the start of the loop, into
+ * PRIME_SCOPE_GAP_BINS bins. Together with PRIME_SCOPE_RECORD_COUNT this
+ * describes the activity of a set without touching any sample buffer.
+ *
+ * prime_scope_profile_multi() screens up to PRIME_SCOPE_MAX_SETS eviction
+ * sets in one window by polling their scope lines round-robin. A set is only
+ * looked at once per round, the rest of the round is its blind spot. Sets
+ * past the first count queue behind them: a set its early_stop rejects
+ * (early_stop.h) hands its place in the round and its columns to the next
+ * one, so a window screens as many sets as it can tell apart.
+ *
+ * The kernels are always inlined and take their policies as arguments.
+ * Callers pass constants, so every call site gets a loop with only the
+ * stores and checks its policies need.
+ */
+
+#define PRIME_SCOPE_GAP_BINS (32)
+#define PRIME_SCOPE_MAX_SETS (16)
+
+typedef enum prime_scope_record_t {
+	// tsc and latency of every sample
+	PRIME_SCOPE_RECORD_SAMPLES,
+	// Only the tsc, probe_time is not written
+	PRIME_SCOPE_RECORD_TSC,
+	// Only the sample count, no memory is written
+	PRIME_SCOPE_RECORD_COUNT,
+	// tsc and latency pushed to ring, max_samples does not apply
+	PRIME_SCOPE_RECORD_STREAM,
+	// One trace_record_t per sample in records
+	PRIME_SCOPE_RECORD_PACKED,
+} prime_scope_record_t;
+
+typedef enum prime_scope_stop_t {
+	// Only max_exec_cycles and max_samples
+	PRIME_SCOPE_STOP_BUDGET,
+	// Also as soon as the victim sets SYNC_CTX_PAUSE
+	PRIME_SCOPE_STOP_PAUSE,
+} prime_scope_stop_t;
+
+typedef enum prime_scope_noise_t {
+	PRIME_SCOPE_NOISE_IGNORE,
+	// Push every migration and interrupt probe to the noise ring
+	PRIME_SCOPE_NOISE_LOG,
+} prime_scope_noise_t;
+
+typedef struct prime_scope_t {
+	EVSet *evset;
+	evchain *sf_chain;
+	u32 array_repeat;
+	u32 l2_repeat;
+	int slot;
+	i64 threshold;
+	uint64_t max_exec_cycles;
+	uint64_t max_samples;
+	// Columns of slot, NULL where the record policy does not write
+	uint64_t *sample_tsc;
+	uint64_t *probe_time;
+	// PRIME_SCOPE_GAP_BINS counters, NULL for no histogram
+	u32 *gap_hist;
+	// Ring of PRIME_SCOPE_RECORD_STREAM
+	sample_ring_t *ring;
+	// Records of PRIME_SCOPE_RECORD_PACKED and the tsc they are relative to
+	trace_record_t *records;
+	uint64_t tsc_base;
+	live_trace_t *live;
+	// Ring of PRIME_SCOPE_NOISE_LOG, NULL drops the events
+	noise_ring_t *noise;
+	// Blind spot accounting, NULL for none
+	trace_coverage_t *coverage;
+	// Probe latency histogram, NULL for none
+	thresh_track_t *thresh;
+	// Sequential test of prime_scope_profile_multi(), NULL never rejects
+	early_stop_t *early_stop;
+} prime_scope_t;
+
+/* Profile from a primed eviction set, returns the number of samples */
+static inline __attribute__((always_inline)) u32
+prime_scope_profile(const prime_scope_t *ps,
+                    prime_scope_record_t record,
+                    prime_scope_stop_t stop,
+                    prime_scope_noise_t noise) {
+	u8 *scope = ps->evset->addrs[0];
+	u64 tsc0, tsc1, last_tsc, scope_lat, end;
+	u64 probes = 0;
+	u32 aux, last_aux, index = 0;
+	// TRACE_RECORD_* flags of the next packed record
+	u32 flags = 0, reprimed = 0;
+
+	tsc0 = tsc1 = last_tsc = _rdtscp_aux(&last_aux);
+	do {
+		tsc1 = rdtscp();
+
+		scope_lat = _time_maccess_aux(scope, end, aux);
+		probes++;
+		if (ps->thresh != NULL &&
+		    scope_lat < detected_cache_lats.interrupt_thresh) {
+			thresh_track_probe(ps->thresh, scope_lat);
+		}
+
+		if ((noise == PRIME_SCOPE_NOISE_LOG ||
+		     record == PRIME_SCOPE_RECORD_PACKED) &&
+		    aux != last_aux) {
+			if (noise == PRIME_SCOPE_NOISE_LOG) {
+				noise_ring_push(ps->noise,
+				                tsc1,
+				                TRACE_NOISE_CPU_SWITCH,
+				                last_aux,
+				                aux,
+				                scope_lat);
+			}
+			flags |= TRACE_RECORD_CPU_SWITCH;
+			last_aux = aux;
+		}
+
+		if (scope_lat > ps->threshold) {
+			if (scope_lat < detected_cache_lats.interrupt_thresh) {
+				if (record == PRIME_SCOPE_RECORD_PACKED) {
+					ps->records[index] = trace_record_pack(
+					    tsc1 - ps->tsc_base,
+					    scope_lat,
+					    flags | (reprimed ? TRACE_RECORD_REPRIME : 0));
+					flags = 0;
+				} else if (record == PRIME_SCOPE_RECORD_STREAM) {
+					sample_ring_push(ps->ring, tsc1, scope_lat);
+				} else if (record != PRIME_SCOPE_RECORD_COUNT) {
+					ps->sample_tsc[index] = tsc1;
+				}
+				if (record == PRIME_SCOPE_RECORD_SAMPLES) {
+					ps->probe_time[index] = scope_lat;
+				}
+				if (ps->gap_hist != NULL) {
+					u32 bin = 63 - __builtin_clzll((tsc1 - last_tsc) | 1);
+					if (bin >= PRIME_SCOPE_GAP_BINS) {
+						bin = PRIME_SCOPE_GAP_BINS - 1;
+					}
+					ps->gap_hist[bin]++;
+					last_tsc = tsc1;
+				}
+				index++;
+				live_trace_publish(ps->live, ps->slot, index);
+			} else {
+				if (noise == PRIME_SCOPE_NOISE_LOG) {
+					noise_ring_push(ps->noise,
+					                tsc1,
+					                TRACE_NOISE_INTERRUPT,
+					                aux,
+					                aux,
+					                scope_lat);
+				}
+				flags |= TRACE_RECORD_INTERRUPT;
+			}
+			prime_skx_sf_evset_ps_flush(
+			    ps->evset, ps->sf_chain, ps->array_repeat, ps->l2_repeat);
+			if (ps->coverage != NULL) {
+				trace_coverage_reprime(ps->coverage, rdtscp() - end);
+			}
+			reprimed = 1;
+		} else {
+			reprimed = 0;
+		}
+	} while (tsc1 - tsc0 < ps->max_exec_cycles &&
+	         (record == PRIME_SCOPE_RECORD_STREAM || index < ps->max_samples) &&
+	         !live_trace_aborted(ps->live) &&
+	         (stop != PRIME_SCOPE_STOP_PAUSE ||
+	          __atomic_load_n(sync_ctx.action, __ATOMIC_RELAXED) !=
+	              SYNC_CTX_PAUSE));
+
+	if (ps->coverage != NULL) {
+		ps->coverage->window_cycles += tsc1 - tsc0;
+		ps->coverage->probes += probes;
+	}
+	return index;
+}
+
+/* Rounds of prime_scope_profile_multi() */
+typedef struct prime_scope_rounds_t {
+	uint64_t count;
+	// Cycles of all rounds and of the longest one
+	uint64_t cycles;
+	uint64_t max_cycles;
+} prime_scope_rounds_t;
+
+/*
+ * Move the next queued set of ps into place k after the set there was
+ * rejected at tsc, taking over its columns, and build its chain if it has
+ * none yet. Returns 0 and empties the place if the queue is drained.
+ */
+static inline int prime_scope_refill(prime_scope_t *ps,
+                                     int total,
+                                     int *place,
+                                     int *next,
+                                     int k,
+                                     uint64_t *hits,
+                                     u64 tsc) {
+	const prime_scope_t *rejected = &ps[place[k]];
+
+	if (*next == total) {
+		place[k] = -1;
+		return 0;
+	}
+	prime_scope_t *set = &ps[*next];
+	set->sample_tsc = rejected->sample_tsc;
+	set->probe_time = rejected->probe_time;
+	set->records = rejected->records;
+	set->gap_hist = rejected->gap_hist;
+	hits[*next] = 0;
+	place[k] = (*next)++;
+	if (set->sf_chain == NULL) {
+		set->sf_chain = evchain_build(set->evset->addrs, SF_ASSOC);
+	}
+
+	prime_skx_sf_evset_ps_flush(
+	    set->evset, set->sf_chain, set->array_repeat, set->l2_repeat);
+	if (set->early_stop != NULL) {
+		early_stop_reset(set->early_stop, tsc);
+	}
+	return 1;
+}
+
+/*
+ * Profile the first count primed eviction sets of ps round-robin, hits[k]
+ * gets the number of samples of ps[k]. ps[count, total) are primed and
+ * profiled as sets early_stop rejects make room, place[k] gets the set that
+ * ends up in place k, -1 for none. A queued set without a chain gets one
+ * when it is refilled. A set with max_samples samples is still primed but
+ * records no more, the loop ends when no place records. The window, the
+ * live trace and the stop policy are the ones of ps[0]. Returns the number
+ * of sets of ps profiled.
+ */
+static inline __attribute__((always_inline)) int
+prime_scope_profile_multi(prime_scope_t *ps,
+                          int count,
+                          int total,
+                          uint64_t *hits,
+                          int *place,
+                          prime_scope_record_t record,
+                          prime_scope_stop_t stop,
+                          prime_scope_rounds_t *rounds) {
+	u64 last_tsc[PRIME_SCOPE_MAX_SETS];
+	u64 tsc0, tsc1, round_tsc, round_cycles, scope_lat, end;
+	u64 round_count = 0, round_max = 0;
+	u32 aux;
+	int open = count, next = count;
+
+	tsc0 = tsc1 = round_tsc = rdtscp();
+	for (int k = 0; k < total; ++k) {
+		hits[k] = 0;
+	}
+	for (int k = 0; k < count; ++k) {
+		last_tsc[k] = tsc0;
+		place[k] = k;
+		if (ps[k].early_stop != NULL) {
+			early_stop_reset(ps[k].early_stop, tsc0);
+		}
+	}
+	do {
+		for (int k = 0; k < count; ++k) {
+			if (place[k] < 0) {
+				continue;
+			}
+			prime_scope_t *set = &ps[place[k]];
+			int recording = record == PRIME_SCOPE_RECORD_STREAM ||
+			                hits[place[k]] < set->max_samples;
+
+			tsc1 = rdtscp();
+
+			scope_lat = _time_maccess_aux(set->evset->addrs[0], end, aux);
+
+			if (scope_lat <= set->threshold) {
+				if (set->early_stop != NULL && recording &&
+				    early_stop_poll(set->early_stop, tsc1) ==
+				        EARLY_STOP_REJECT) {
+					open -= !prime_scope_refill(
+					    ps, total, place, &next, k, hits, tsc1);
+					last_tsc[k] = tsc1;
+				}
+				continue;
+			}
+			if (scope_lat < detected_cache_lats.interrupt_thresh &&
+			    recording) {
+				u64 index = hits[place[k]];
+				if (record == PRIME_SCOPE_RECORD_PACKED) {
+					set->records[index] =
+					    trace_record_pack(tsc1 - set->tsc_base, scope_lat, 0);
+				} else if (record == PRIME_SCOPE_RECORD_STREAM) {
+					sample_ring_push(set->ring, tsc1, scope_lat);
+				} else if (record != PRIME_SCOPE_RECORD_COUNT) {
+					set->sample_tsc[index] = tsc1;
+				}
+				if (record == PRIME_SCOPE_RECORD_SAMPLES) {
+					set->probe_time[index] = scope_lat;
+				}
+				if (set->gap_hist != NULL) {
+					u32 bin = 63 - __builtin_clzll((tsc1 - last_tsc[k]) | 1);
+					if (bin >= PRIME_SCOPE_GAP_BINS) {
+						bin = PRIME_SCOPE_GAP_BINS - 1;
+					}
+					set->gap_hist[bin]++;
+					last_tsc[k] = tsc1;
+				}
+				hits[place[k]] = ++index;
+				open -= record != PRIME_SCOPE_RECORD_STREAM &&
+				        index == set->max_samples;
+				live_trace_publish(set->live, set->slot, index);
+				if (set->early_stop != NULL &&
+				    (record == PRIME_SCOPE_RECORD_STREAM ||
+				     index < set->max_samples) &&
+				    early_stop_hit(set->early_stop, tsc1) ==
+				        EARLY_STOP_REJECT) {
+					// The refill primes the next set instead
+					open -= !prime_scope_refill(
+					    ps, total, place, &next, k, hits, tsc1);
+					last_tsc[k] = tsc1;
+					continue;
+				}
+			}
+			prime_skx_sf_evset_ps_flush(
+			    set->evset, set->sf_chain, set->array_repeat, set->l2_repeat);
+		}
+
+		// From the last probe of the previous round to this one
+		round_cycles = tsc1 - round_tsc;
+		round_tsc = tsc1;
+		round_count++;
+		if (round_cycles > round_max) {
+			round_max = round_cycles;
+		}
+	} while (tsc1 - tsc0 < ps->max_exec_cycles && open > 0 &&
+	         !live_trace_aborted(ps->live) &&
+	         (stop != PRIME_SCOPE_STOP_PAUSE ||
+	          __atomic_load_n(sync_ctx.action, __ATOMIC_RELAXED) !=
+	              SYNC_CTX_PAUSE));
+
+	rounds->count = round_count;
+	rounds->cycles = tsc1 - tsc0;
+	rounds->max_cycles = round_max;
+	return next;
+}
+
+/*
+ * Cycles a set of a count set scan goes unobserved per round on top of what
+ * scanning it alone would leave, about (count - 1) probes and re-primes
+ */
+static inline uint64_t
+prime_scope_blind_spot(const prime_scope_rounds_t *rounds, int count) {
+	if (rounds->count == 0) {
+		return 0;
+	}
+	uint64_t round = rounds->cycles / rounds->count;
+	return round - round / count;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Content-addressed store of analysis results, shared by the evaluation
+ * process pools through libtrace_reader.so.
+ *
+ * Store file layout:
+ *
+ *   result_store_header_t                     64 bytes
+ *   per commit, 8 byte aligned:
+ *     result_record_t                         48 bytes
+ *     value                                   record.value_size bytes
+ *
+ * A result is keyed by the hash of the trace it was computed from, the
+ * hash of the analysis name and the hash of the analysis parameters, so a
+ * new analysis version or a parameter change misses instead of returning a
+ * stale result. Records are only ever appended and the latest record of a
+ * key wins. Every process keeps its own hash index of the log and picks up
+ * the records of other processes before each lookup.
+ *
+ * A commit is a single write of the record and its value under an exclusive
+ * flock() of the store. Records carry a checksum, so a record torn by a
+ * crashed writer is never returned and is cut off by the next commit.
+ */
+
+#define RESULT_STORE_MAGIC "SCARRES"
+#define RESULT_STORE_VERSION (1)
+#define RESULT_RECORD_MAGIC (0x43455252U)
+
+typedef struct result_key_t {
+	uint64_t content;
+	uint64_t analysis;
+	uint64_t params;
+} result_key_t;
+
+typedef enum result_status_t {
+	RESULT_MISS = 0,
+	RESULT_FOUND,
+	// The analysis ran but had no result, e.g. for a broken trace
+	RESULT_EMPTY,
+} result_status_t;
+
+typedef struct result_store_header_t {
+	char magic[8];
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t reserved0;
+	uint64_t reserved[6];
+} result_store_header_t;
+
+typedef struct result_record_t {
+	uint32_t magic;
+	uint32_t status;
+	uint64_t value_size;
+	result_key_t key;
+	uint64_t checksum;
+} result_record_t;
+
+typedef struct result_slot_t {
+	result_key_t key;
+	uint64_t offset;
+	uint64_t value_size;
+	uint32_t status;
+	uint32_t reserved;
+} result_slot_t;
+
+typedef struct result_store_t {
+	int fd;
+	char filepath[256];
+	uint64_t end;
+	result_slot_t *slots;
+	uint64_t slot_count;
+	uint64_t used;
+} result_store_t;
+
+/* Size of result_store_t, for callers that cannot include this header */
+size_t result_store_size(void);
+
+/* XXH64 of size bytes, used for trace contents, names and parameters */
+uint64_t result_hash(const void *data, uint64_t size, uint64_t seed);
+
+/* Create filepath, or open it and index the records already committed */
+int result_store_open(result_store_t *store, const char *filepath);
+
+void result_store_close(result_store_t *store);
+
+/*
+ * Look up key. For RESULT_FOUND, up to buf_size bytes of the value are
+ * copied to buf and value_size is set to the full size of the value.
+ */
+result_status_t result_store_get(result_store_t *store,
+                                 const result_key_t *key,
+                                 void *buf,
+                                 uint64_t buf_size,
+                                 uint64_t *value_size);
+
+/* Commit the result of key, value is ignored for RESULT_EMPTY */
+int result_store_put(result_store_t *store,
+                     const result_key_t *key,
+                     result_status_t status,
+                     const void *value,
+                     uint64_t value_size);
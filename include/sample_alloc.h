@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sample storage of the profilers.
+ *
+ * Static sample arrays are faulted in by their first write, inside the timed
+ * loop, where the faults read as interrupt latencies and blind spots of the
+ * first victim run. The allocator maps the columns with
+ * config_t::mmap_flag, on 1 GiB pages for buffers that fill one and 2 MiB
+ * pages otherwise, binds them to the NUMA node of the attacker core, locks
+ * and faults them in before profiling starts.
+ */
+
+#define SAMPLE_ALLOC_HUGEPAGE_SIZE (2ul << 20)
+
+typedef struct sample_alloc_t {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	// Page size backing the buffer
+	size_t page_size;
+	// NUMA node the buffer is bound to, -1 if it is not
+	int node;
+	int locked;
+} sample_alloc_t;
+
+/* Page faults taken by the calling thread */
+typedef struct sample_faults_t {
+	uint64_t minor;
+	uint64_t major;
+} sample_faults_t;
+
+/*
+ * Map, bind, lock and fault in size bytes on the node rdtscp_aux() reports
+ * on cpu, -1 for the core of the calling thread. Falls back to 4 KB pages
+ * if there are no hugepages, binding and locking are best effort.
+ */
+int sample_alloc_init(sample_alloc_t *alloc, size_t size, int cpu);
+
+void sample_alloc_destroy(sample_alloc_t *alloc);
+
+/*
+ * Carve count columns of length samples out of alloc into columns, returns
+ * the first one, NULL if alloc is too small
+ */
+uint64_t *sample_alloc_columns(sample_alloc_t *alloc,
+                               uint64_t **columns,
+                               int count,
+                               size_t length);
+
+/* Zero every column carved out of alloc */
+void sample_alloc_clear(sample_alloc_t *alloc);
+
+void sample_faults_read(sample_faults_t *faults);
+
+/*
+ * Log the faults of slot since before, warning if there are any, returns
+ * their number
+ */
+uint64_t sample_faults_report(int slot, const sample_faults_t *before);
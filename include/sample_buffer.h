@@ -0,0 +1,99 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gt_ring.h"
+#include "live_trace.h"
+#include "trace.h"
+
+/*
+ * File-backed sample buffers.
+ *
+ * Every run gets its own <dirpath>/rN.out, preallocated with
+ * posix_fallocate() and mapped MAP_SHARED. The file already has the raw
+ * binary trace layout of trace.h with sp_cnt rows reserved per column, and
+ * the caller's sample_tsc/probe_time arrays point straight into the
+ * mapping. Runs are double-buffered: while one run is profiled, a finisher
+ * thread completes the one committed before and maps the run after.
+ * Committing a run only fills in the channel table, snapshots its ground
+ * truth, noise and coverage, schedules writeback and switches to the
+ * prepared mapping. The finisher thread then writes the sparse index, the
+ * event channels and the snapshots, and releases the unused column tails.
+ * With gt_ring set, the ground truth goes after the event channels.
+ *
+ * With TRACE_LIVE set, the sample counts of the running run are also
+ * published to <dirpath>/live (live_trace.h). aborted is set on the commit
+ * of the run a reader aborted, the attacker threads stop there.
+ */
+
+typedef struct sample_run_t {
+	char filepath[512];
+	int run;
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	// Snapshot of the run taken on commit, for the finisher thread
+	uint64_t *counts;
+	trace_gt_t *gt;
+	uint64_t gt_count;
+	uint64_t gt_size;
+	trace_noise_t *noise;
+	uint64_t noise_count;
+	uint64_t noise_size;
+	trace_coverage_t *coverage;
+	int has_coverage;
+} sample_run_t;
+
+typedef struct sample_buffer_t {
+	char dirpath[256];
+	int cl_cnt;
+	int sp_cnt;
+	// Run being profiled, in runs[active]
+	int run;
+	int active;
+	sample_run_t runs[2];
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int pin_cpu;
+	int busy;
+	int stop;
+	// The finisher thread failed on a run
+	int failed;
+	uint64_t **sample_tsc;
+	uint64_t **probe_time;
+	gt_ring_t *gt_ring;
+	live_trace_t *live;
+	int aborted;
+} sample_buffer_t;
+
+/*
+ * Map run 0, point sample_tsc/probe_time at it and start the finisher
+ * thread on run 1, on pin_cpu (-1: not pinned). Keep it off the attacker
+ * and victim cores, it touches whole runs while the next one is profiled.
+ */
+int sample_buffer_init(sample_buffer_t *buffer,
+                       const char *dirpath,
+                       uint64_t **sample_tsc,
+                       uint64_t **probe_time,
+                       int cl_cnt,
+                       int sp_cnt,
+                       int pin_cpu);
+
+/*
+ * Persist the current run and switch to the next. sample_count holds the
+ * samples of every channel (NULL: up to the first zero timestamp), bounded
+ * by sp_cnt. Waits for the finisher thread if it is still on the previous
+ * run, fails if it failed.
+ */
+int sample_buffer_commit(sample_buffer_t *buffer,
+                         const uint64_t *sample_count,
+                         int sp_cnt);
+
+/*
+ * Wait for the last committed run, unmap and remove the prepared but
+ * unused runs, end the live trace
+ */
+void sample_buffer_destroy(sample_buffer_t *buffer);
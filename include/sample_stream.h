@@ -0,0 +1,126 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Streaming capture, enabled with TRACE_STREAM=1.
+ *
+ * The attacker threads do not fill sample columns of a fixed size but push
+ * every sample into a lock-free single-producer/single-consumer ring of
+ * their channel. A consumer thread, pinned away from the attackers, drains
+ * all rings into a sink, so a run is only bounded by its profiling window
+ * and the attacker keeps a small, fixed resident buffer.
+ *
+ * head is only written by the producer and tail only by the consumer, each
+ * on its own cache line next to the producer's or consumer's cached copy of
+ * the other index. The producer only reloads tail when its copy says the
+ * ring is full. It never waits: a sample that finds the ring really full is
+ * dropped and counted.
+ *
+ * The ring indices come from the color arena (color_alloc.h) when there is
+ * one, so that the producers do not touch the monitored sets.
+ *
+ * Without a sink, every channel is spooled to an unlinked file in dirpath,
+ * and sample_stream_commit() writes the run as <dirpath>/rN.out with
+ * trace_write(), in TRACE_FORMAT.
+ */
+
+#define SAMPLE_STREAM_RING_SIZE (1 << 16)
+
+typedef struct sample_record_t {
+	uint64_t tsc;
+	uint64_t latency;
+} sample_record_t;
+
+typedef struct sample_ring_t {
+	// Producer
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail_cache;
+	uint64_t dropped;
+	// Consumer
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t head_cache;
+	// Shared, read-only
+	uint64_t mask __attribute__((aligned(64)));
+	sample_record_t *records;
+} sample_ring_t;
+
+/* Consume count records of channel, non-zero stops the stream */
+typedef int (*sample_sink_t)(void *arg,
+                             int channel,
+                             const sample_record_t *records,
+                             size_t count);
+
+typedef struct sample_spool_t {
+	int fd[2];
+	FILE *fp[2];
+	uint64_t count;
+} sample_spool_t;
+
+typedef struct sample_stream_t {
+	char dirpath[256];
+	int cl_cnt;
+	int run;
+	int pin_cpu;
+	int stop;
+	int failed;
+	pthread_t thread;
+	sample_ring_t *rings;
+	// rings is in the color arena
+	int rings_colored;
+	sample_sink_t sink;
+	void *sink_arg;
+	sample_spool_t *spools;
+} sample_stream_t;
+
+/* TRACE_STREAM is set in the environment */
+int sample_stream_enabled(void);
+
+/*
+ * Allocate cl_cnt rings of ring_size (a power of 2) records and start the
+ * consumer on pin_cpu (-1: not pinned). With sink NULL, runs are written to
+ * dirpath.
+ */
+int sample_stream_init(sample_stream_t *stream,
+                       const char *dirpath,
+                       int cl_cnt,
+                       uint64_t ring_size,
+                       int pin_cpu,
+                       sample_sink_t sink,
+                       void *sink_arg);
+
+static inline sample_ring_t *sample_stream_ring(sample_stream_t *stream,
+                                                int channel) {
+	return &stream->rings[channel];
+}
+
+/*
+ * Wait until the consumer has drained the run the producers just ended and
+ * write it out. The producers must be done with the run.
+ */
+int sample_stream_commit(sample_stream_t *stream);
+
+/* Stop the consumer and release the rings, the last run is not written */
+void sample_stream_destroy(sample_stream_t *stream);
+
+/* Push a sample from the producer thread of ring, 1 if it was dropped */
+static inline int
+sample_ring_push(sample_ring_t *ring, uint64_t tsc, uint64_t latency) {
+	uint64_t head = ring->head;
+
+	if (head - ring->tail_cache > ring->mask) {
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head - ring->tail_cache > ring->mask) {
+			ring->dropped++;
+			return 1;
+		}
+	}
+	sample_record_t *record = &ring->records[head & ring->mask];
+	record->tsc = tsc;
+	record->latency = latency;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -38,6 +38,11 @@ typedef struct sync_ctx_t {
 extern sync_ctx_t sync_ctx;
 extern const size_t sync_ctx_data_size;
 
+/* SysV shared memory keyed by /tmp/<name> and proj_id, zeroed when created */
+void* shm_alloc(const char* name, int proj_id, size_t size);
+
+void shm_release(const char* name, int proj_id, size_t size);
+
 void init_sync_ctx(int proj_id);
 
 void free_sync_ctx(int proj_id);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Online tracking of the eviction threshold of one attacker slot.
+ *
+ * The threshold is calibrated once, but hours-long captures drift with
+ * temperature, uncore frequency and co-runners. With THRESH_TRACK set, the
+ * profiling loops count the latency of every probe into a histogram of
+ * THRESH_TRACK_BIN_CYCLES wide bins, interrupts and the overflow bin aside.
+ * Between victim runs, thresh_track_update() splits the histogram into a
+ * hit and a miss mode (isodata: the split is moved to the midpoint of the
+ * two means until it settles, from the middle of the latency range if the
+ * threshold drifted past a mode) and moves the threshold by
+ * THRESH_TRACK_ALPHA towards the split. When both modes are populated but
+ * their separation, the difference of their means over their pooled
+ * standard deviation, falls below THRESH_TRACK_MIN_SEPARATION, the run is a
+ * strike; callers fall back to the calibrated threshold and rebuild the
+ * eviction set after THRESH_TRACK_STRIKES strikes in a row.
+ */
+
+#define THRESH_TRACK_BIN_CYCLES (4)
+#define THRESH_TRACK_BINS (512)
+#define THRESH_TRACK_ALPHA (0.25)
+#define THRESH_TRACK_MIN_SEPARATION (5.0)
+// Probes each mode needs before the split is trusted
+#define THRESH_TRACK_MIN_PROBES (64)
+#define THRESH_TRACK_STRIKES (2)
+
+typedef enum thresh_track_status_t {
+	THRESH_TRACK_KEPT,
+	THRESH_TRACK_ADJUSTED,
+	THRESH_TRACK_INSEPARABLE,
+} thresh_track_status_t;
+
+typedef struct thresh_track_t {
+	uint32_t hist[THRESH_TRACK_BINS];
+	int slot;
+	// Threshold of the next run and the average it is rounded from
+	int32_t threshold;
+	double level;
+	// Means and separation of the modes of the last update
+	double hit_mean;
+	double miss_mean;
+	double separation;
+	// Inseparable runs in a row
+	uint32_t strikes;
+	// The eviction set of the slot was rebuilt by its tracker and is freed
+	// on the next rebuild
+	int owns_evset;
+	uint64_t adjustments;
+} thresh_track_t;
+
+/* THRESH_TRACK is set in the environment */
+int thresh_track_enabled(void);
+
+/* Track the threshold of slot from threshold, strikes included */
+void thresh_track_init(thresh_track_t *track, int slot, int32_t threshold);
+
+/* Move the threshold to threshold and clear the histogram */
+void thresh_track_seed(thresh_track_t *track, int32_t threshold);
+
+static inline __attribute__((always_inline)) void
+thresh_track_probe(thresh_track_t *track, uint64_t latency) {
+	uint64_t bin = latency / THRESH_TRACK_BIN_CYCLES;
+	if (bin >= THRESH_TRACK_BINS) {
+		bin = THRESH_TRACK_BINS - 1;
+	}
+	track->hist[bin]++;
+}
+
+/*
+ * Fit the modes of the probes since the last update, adjust the threshold
+ * and clear the histogram. Logs every adjustment.
+ */
+thresh_track_status_t thresh_track_update(thresh_track_t *track);
@@ -0,0 +1,439 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Binary trace layout (all fields little-endian):
+ *
+ *   trace_file_header_t                       64 bytes
+ *   trace_capture_t                           128 bytes
+ *   trace_capture_channel_t[channel_count]    16 bytes each
+ *   trace_channel_t[channel_count]            32 bytes each, at header_size
+ *   per channel, TRACE_ALIGN aligned:
+ *     uint64_t tsc[sample_count]
+ *     uint64_t lat[sample_count]
+ *   TRACE_ALIGN aligned, at header.index_offset:
+ *     trace_index_t[ceil(sample_count / index_stride)] per channel
+ *   TRACE_ALIGN aligned, after the index, with TRACE_FLAG_EVENTS:
+ *     uint8_t event_channel[sum of sample_count]
+ *   TRACE_ALIGN aligned, at header.gt_offset:
+ *     trace_gt_t[gt_count]
+ *   TRACE_ALIGN aligned, at capture.noise_offset:
+ *     trace_noise_t[capture.noise_count]
+ *   TRACE_ALIGN aligned, at capture.coverage_offset, with TRACE_FLAG_COVERAGE:
+ *     trace_coverage_t[channel_count]
+ *
+ * The capture block records how the trace was taken, so that the analysis
+ * does not have to assume a TSC frequency or cache thresholds. Traces
+ * written before it existed have header_size 64 and no capture block.
+ *
+ * Offsets in trace_channel_t are relative to the file header, so a trace can be
+ * consumed through mmap(2) or numpy.memmap without any parsing step. Every
+ * channel has its own sample_count and holds only real samples.
+ *
+ * The sparse index holds the tsc of every index_stride-th sample of each
+ * channel, the channels one after another, so a TSC window can be located
+ * by binary search without touching the columns. Traces without an index
+ * have index_offset 0.
+ *
+ * The event channels merge all channels into one stream ordered by tsc:
+ * event_channel[i] is the channel of the i-th sample of the run, the
+ * samples of a channel following in column order. Walking the columns with
+ * one cursor per channel yields the (tsc, channel, latency) events without
+ * any comparison, so the analysis never sorts the run. They are written
+ * when the trace is dumped, for at most TRACE_EVENTS_MAX_CHANNELS channels.
+ *
+ * Runtimes that log victim events (gt_ring.h) store them as ground truth
+ * records next to the attacker samples of the same run, ordered by tsc.
+ * Traces without ground truth have gt_count 0.
+ *
+ * The noise channel holds what the attacker threads saw besides samples
+ * during the run (noise_ring.h): CPU migrations, probes dropped as
+ * interrupts and samples dropped as spurious, ordered by tsc. Traces without
+ * noise, and all traces written before it existed, have noise_count 0.
+ *
+ * With TRACE_COVERAGE set, every channel also gets a coverage summary of
+ * its run: the probes, the cycles the line went unmonitored while it was
+ * re-primed after a hit, and a histogram of the re-prime durations.
+ *
+ * With TRACE_ENCODING_PACKED each column is instead a sequence of
+ * TRACE_BLOCK_SIZE sample blocks, every block being a trace_block_t followed
+ * by width rows of TRACE_BLOCK_LANES uint64_t words. Sample i of a block
+ * goes to lane i % TRACE_BLOCK_LANES, and every lane packs its width-bit
+ * values LSB first down its own column of words, so that all lanes shift
+ * and mask in step. A value is stored relative to the block reference
+ * (frame of reference). TSC columns store the deltas to the previous
+ * sample, starting from tsc_base. The last block of a column is zero
+ * padded.
+ *
+ * With TRACE_ENCODING_RECORDS each channel is a single column of
+ * trace_record_t at tsc_offset (lat_offset is the same), the tsc of a
+ * record being relative to the tsc_base of its channel. The index holds
+ * absolute tsc values, as for the other encodings.
+ */
+
+#define TRACE_MAGIC "SCARTRC"
+#define TRACE_VERSION (1)
+#define TRACE_ALIGN (64)
+#define TRACE_BLOCK_SIZE (128)
+#define TRACE_BLOCK_LANES (2)
+#define TRACE_INDEX_STRIDE (1024)
+#define TRACE_CAPTURE_MAX_CHANNELS (64)
+#define TRACE_CAPTURE_UNKNOWN (0xffff)
+#define TRACE_EVENTS_MAX_CHANNELS (256)
+
+/* trace_file_header_t flags */
+#define TRACE_FLAG_EVENTS (1 << 0)
+#define TRACE_FLAG_COVERAGE (1 << 1)
+
+typedef enum trace_format_t {
+	TRACE_FORMAT_TEXT,
+	TRACE_FORMAT_BINARY,
+	TRACE_FORMAT_PACKED,
+	TRACE_FORMAT_RECORDS,
+} trace_format_t;
+
+typedef enum trace_attack_t {
+	TRACE_ATTACK_FR,
+	TRACE_ATTACK_PS,
+	TRACE_ATTACK_PP,
+} trace_attack_t;
+
+typedef enum trace_encoding_t {
+	TRACE_ENCODING_RAW,
+	TRACE_ENCODING_PACKED,
+	TRACE_ENCODING_RECORDS,
+} trace_encoding_t;
+
+typedef struct trace_file_header_t {
+	char magic[8];
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t channel_count;
+	uint64_t file_size;
+	uint32_t encoding;
+	uint32_t block_size;
+	uint64_t index_offset;
+	uint32_t index_stride;
+	uint32_t flags;
+	uint64_t gt_offset;
+	uint64_t gt_count;
+} trace_file_header_t;
+
+typedef struct trace_capture_t {
+	uint64_t tsc_freq;
+	uint64_t max_exec_cycles;
+	uint32_t profile_iterations;
+	uint32_t attack;
+	int32_t l2_thresh;
+	int32_t interrupt_thresh;
+	// sync_ctx_action_t that started the victim and its sync_ctx.data
+	uint32_t victim_action;
+	uint32_t reserved0;
+	// Noise channel of the run, relative to the file header
+	uint64_t noise_offset;
+	uint64_t noise_count;
+	// Coverage summaries with TRACE_FLAG_COVERAGE
+	uint64_t coverage_offset;
+	char victim_data[64];
+} trace_capture_t;
+
+typedef struct trace_capture_channel_t {
+	int32_t l3_set;
+	uint16_t core;
+	uint16_t node;
+	int32_t threshold;
+	uint32_t reserved;
+} trace_capture_channel_t;
+
+typedef struct trace_channel_t {
+	uint64_t sample_count;
+	uint64_t tsc_offset;
+	uint64_t lat_offset;
+	uint64_t tsc_base;
+} trace_channel_t;
+
+typedef struct trace_index_t {
+	uint64_t tsc;
+	uint64_t sample;
+} trace_index_t;
+
+/* A victim event, e.g. the cpython_pow opcode index of gt_N.out */
+typedef struct trace_gt_t {
+	uint64_t tsc;
+	uint64_t event;
+} trace_gt_t;
+
+typedef enum trace_noise_kind_t {
+	// The attacker thread moved to new_cpu
+	TRACE_NOISE_CPU_SWITCH = 1,
+	// A probe took longer than the interrupt threshold
+	TRACE_NOISE_INTERRUPT,
+	// A probe above the threshold was not kept as a sample
+	TRACE_NOISE_DROPPED,
+} trace_noise_kind_t;
+
+/* An event of the profiling loop that is not a sample */
+typedef struct trace_noise_t {
+	uint64_t tsc;
+	uint32_t latency;
+	uint16_t kind;
+	uint16_t channel;
+	// rdtscp_aux() of the attacker before and after, node << 12 | core
+	uint32_t old_cpu;
+	uint32_t new_cpu;
+} trace_noise_t;
+
+#define TRACE_COVERAGE_BINS (32)
+
+/* How much of its profiling window a channel watched its line */
+typedef struct trace_coverage_t {
+	// From the first to the last probe
+	uint64_t window_cycles;
+	uint64_t probes;
+	uint64_t reprimes;
+	// From a hit to the end of its re-prime, summed over the run
+	uint64_t blind_cycles;
+	uint64_t max_blind_cycles;
+	uint64_t reserved[3];
+	// Re-primes by log2 of their blind cycles
+	uint32_t reprime_hist[TRACE_COVERAGE_BINS];
+} trace_coverage_t;
+
+/* Account one re-prime that left the line unmonitored for cycles */
+static inline void trace_coverage_reprime(trace_coverage_t *coverage,
+                                          uint64_t cycles) {
+	uint32_t bin = 63 - __builtin_clzll(cycles | 1);
+	if (bin >= TRACE_COVERAGE_BINS) {
+		bin = TRACE_COVERAGE_BINS - 1;
+	}
+	coverage->reprime_hist[bin]++;
+	coverage->reprimes++;
+	coverage->blind_cycles += cycles;
+	if (cycles > coverage->max_blind_cycles) {
+		coverage->max_blind_cycles = cycles;
+	}
+}
+
+typedef struct trace_block_t {
+	uint64_t ref;
+	uint32_t width;
+	uint32_t reserved;
+} trace_block_t;
+
+/*
+ * A sample in a single 8-byte store, half of a (tsc, latency) column pair:
+ *
+ *   bits  0-39   tsc - tsc_base of the run, 6 minutes at 3 GHz
+ *   bits 40-55   latency, saturated at TRACE_RECORD_LAT_MAX
+ *   bits 56-63   TRACE_RECORD_* flags
+ */
+typedef uint64_t trace_record_t;
+
+#define TRACE_RECORD_TSC_BITS (40)
+#define TRACE_RECORD_TSC_MAX ((1UL << TRACE_RECORD_TSC_BITS) - 1)
+#define TRACE_RECORD_LAT_SHIFT (40)
+#define TRACE_RECORD_LAT_MAX (0xffff)
+#define TRACE_RECORD_FLAGS_SHIFT (56)
+
+/* The attacker thread moved to another core since the previous sample */
+#define TRACE_RECORD_CPU_SWITCH (1 << 0)
+/* A probe was dropped as an interrupt since the previous sample */
+#define TRACE_RECORD_INTERRUPT (1 << 1)
+/* First probe after the previous re-prime, the sets may not be settled */
+#define TRACE_RECORD_REPRIME (1 << 2)
+
+static inline trace_record_t
+trace_record_pack(uint64_t tsc_delta, uint64_t latency, uint32_t flags) {
+	if (latency > TRACE_RECORD_LAT_MAX) {
+		latency = TRACE_RECORD_LAT_MAX;
+	}
+	return (tsc_delta & TRACE_RECORD_TSC_MAX) |
+	       latency << TRACE_RECORD_LAT_SHIFT |
+	       (uint64_t)flags << TRACE_RECORD_FLAGS_SHIFT;
+}
+
+static inline uint64_t trace_record_tsc(trace_record_t record,
+                                        uint64_t tsc_base) {
+	return tsc_base + (record & TRACE_RECORD_TSC_MAX);
+}
+
+static inline uint64_t trace_record_latency(trace_record_t record) {
+	return (record >> TRACE_RECORD_LAT_SHIFT) & TRACE_RECORD_LAT_MAX;
+}
+
+static inline uint32_t trace_record_flags(trace_record_t record) {
+	return record >> TRACE_RECORD_FLAGS_SHIFT;
+}
+
+/*
+ * Expand count records into (tsc, latency) columns for consumers of the
+ * column layout. Either column may be NULL.
+ */
+void trace_expand_records(const trace_record_t *records,
+                          uint64_t count,
+                          uint64_t tsc_base,
+                          uint64_t *sample_tsc,
+                          uint64_t *latency);
+
+/*
+ * Output format of dump_profiling_trace(s),
+ * TRACE_FORMAT=text|binary|packed|records.
+ * trace_set_default_format() only applies when TRACE_FORMAT is not set.
+ */
+trace_format_t trace_get_format(void);
+
+void trace_set_format(trace_format_t format);
+
+void trace_set_default_format(trace_format_t format);
+
+/*
+ * Capture parameters written into every following trace. Channels default
+ * to l3_set -1 and core/node TRACE_CAPTURE_UNKNOWN.
+ */
+trace_capture_t *trace_get_capture(void);
+
+/* NULL if channel is out of range */
+trace_capture_channel_t *trace_get_capture_channel(int channel);
+
+/* Copy the capture block and the first cl_cnt channels as they are now */
+void trace_copy_capture(trace_capture_t *capture,
+                        trace_capture_channel_t *channels,
+                        int cl_cnt);
+
+/*
+ * Capture block and channel table of the following traces written by the
+ * calling thread in place of the current ones, NULL for the current ones.
+ * Both have to stay valid until they are written, channels has to hold
+ * every channel of the traces.
+ */
+void trace_set_capture(const trace_capture_t *capture,
+                       const trace_capture_channel_t *channels);
+
+/*
+ * Noise channel of the following traces written by the calling thread,
+ * NULL for none. noise has to stay valid until they are written.
+ */
+void trace_set_noise(const trace_noise_t *noise, uint64_t count);
+
+const trace_noise_t *trace_get_noise(uint64_t *count);
+
+/* TRACE_COVERAGE is set in the environment */
+int trace_coverage_enabled(void);
+
+/*
+ * Coverage summaries of the following traces written by the calling
+ * thread, one per channel, NULL for none. coverage has to stay valid until
+ * they are written.
+ */
+void trace_set_coverage(const trace_coverage_t *coverage);
+
+const trace_coverage_t *trace_get_coverage(void);
+
+/* Header size of a trace with the capture block and cl_cnt channels */
+uint64_t trace_header_size(int cl_cnt);
+
+/* Fill the header and the capture block in front of the channel table */
+void trace_fill_header(uint8_t *header, int cl_cnt);
+
+/*
+ * Sample count of every channel, at most sp_cnt. Without sample_count a
+ * channel ends at its first zero timestamp.
+ */
+void trace_sample_counts(uint64_t **sample_tsc,
+                         const uint64_t *sample_count,
+                         int cl_cnt,
+                         int sp_cnt,
+                         uint64_t *counts);
+
+int trace_write(const char *filepath,
+                uint64_t **sample_tsc,
+                uint64_t **latency,
+                const uint64_t *sample_count,
+                int cl_cnt,
+                int sp_cnt);
+
+int trace_write_text(const char *filepath,
+                     uint64_t **sample_tsc,
+                     uint64_t **latency,
+                     const uint64_t *sample_count,
+                     int cl_cnt,
+                     int sp_cnt);
+
+int trace_write_binary(const char *filepath,
+                       uint64_t **sample_tsc,
+                       uint64_t **latency,
+                       const uint64_t *sample_count,
+                       int cl_cnt,
+                       int sp_cnt);
+
+int trace_write_packed(const char *filepath,
+                       uint64_t **sample_tsc,
+                       uint64_t **latency,
+                       const uint64_t *sample_count,
+                       int cl_cnt,
+                       int sp_cnt);
+
+/*
+ * Write records as a TRACE_ENCODING_RECORDS trace, sample_count[j] records
+ * of channel j relative to tsc_base[j]
+ */
+int trace_write_records(const char *filepath,
+                        trace_record_t **records,
+                        const uint64_t *tsc_base,
+                        const uint64_t *sample_count,
+                        int cl_cnt);
+
+int trace_fwrite_records(FILE *fp,
+                         trace_record_t **records,
+                         const uint64_t *tsc_base,
+                         const uint64_t *sample_count,
+                         int cl_cnt);
+
+/*
+ * Write one trace at the current position of fp. Offsets inside the trace
+ * are relative to that position, so traces can be embedded in other files.
+ */
+int trace_fwrite(FILE *fp,
+                 trace_format_t format,
+                 uint64_t **sample_tsc,
+                 uint64_t **latency,
+                 const uint64_t *sample_count,
+                 int cl_cnt,
+                 int sp_cnt);
+
+/* Number of trace_index_t entries of a channel */
+uint64_t trace_index_count(uint64_t sample_count, uint32_t index_stride);
+
+/* Fill the sparse index of one tsc column */
+void trace_build_index(const uint64_t *sample_tsc,
+                       uint64_t sample_count,
+                       uint32_t index_stride,
+                       trace_index_t *index);
+
+/*
+ * Decode one packed column of sample_count values into dst. Set delta for
+ * TSC columns. Returns the number of bytes consumed from src.
+ */
+uint64_t trace_decode_column(const uint8_t *src,
+                             uint64_t sample_count,
+                             uint64_t base,
+                             int delta,
+                             uint64_t *dst);
+
+/*
+ * Merge the tsc columns of cl_cnt channels, each sorted, into event_channel:
+ * the channel of every sample in tsc order, ties going to the lower
+ * channel. A loser tree over the channels, so every sample takes
+ * ceil(log2(cl_cnt)) comparisons. cl_cnt is at most
+ * TRACE_EVENTS_MAX_CHANNELS.
+ */
+void trace_merge(const uint64_t *const *sample_tsc,
+                 const uint64_t *counts,
+                 int cl_cnt,
+                 uint8_t *event_channel);
+
+/* Offset of the event channels of a trace, right after its index */
+uint64_t trace_events_offset(const trace_file_header_t *header,
+                             const trace_channel_t *channels);
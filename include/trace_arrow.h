@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Apache Arrow IPC file (Feather v2) export of traces and ground truth.
+ *
+ * A dataset is a directory with one file per table:
+ *
+ *   traces.arrow        experiment, key, run, channel, tsc, latency
+ *   ground_truth.arrow  experiment, key, run, opcode, tsc
+ *
+ * experiment, channel and opcode are dictionary encoded (int8 indices into
+ * utf8 dictionaries), key and run are uint32, tsc and latency uint64. Every
+ * appended run becomes its own record batch, so readers can scan a dataset
+ * one run at a time. The files are written without any Arrow dependency and
+ * read by pyarrow, pandas, polars and DuckDB.
+ */
+
+#define TRACE_ARROW_MAX_LABELS (64)
+
+typedef struct trace_arrow_block_t {
+	int64_t offset;
+	int32_t meta_length;
+	int32_t reserved;
+	int64_t body_length;
+} trace_arrow_block_t;
+
+typedef struct trace_arrow_t {
+	FILE *fp;
+	char filepath[256];
+	const char *label_name;
+	int label_count;
+	int with_latency;
+	int64_t offset;
+	trace_arrow_block_t dictionaries[2];
+	trace_arrow_block_t *batches;
+	uint64_t batch_count;
+	uint64_t batch_capacity;
+} trace_arrow_t;
+
+/* Channel j of every appended run is labelled labels[j] */
+int trace_arrow_open_traces(trace_arrow_t *arrow,
+                            const char *filepath,
+                            const char *experiment,
+                            const char **labels,
+                            int label_count);
+
+/* Opcode i of every appended ground truth is labelled labels[i] */
+int trace_arrow_open_ground_truth(trace_arrow_t *arrow,
+                                  const char *filepath,
+                                  const char *experiment,
+                                  const char **labels,
+                                  int label_count);
+
+int trace_arrow_append_run(trace_arrow_t *arrow,
+                           uint32_t key_id,
+                           uint32_t run_id,
+                           const uint64_t **sample_tsc,
+                           const uint64_t **latency,
+                           const uint64_t *sample_count,
+                           int cl_cnt);
+
+int trace_arrow_append_ground_truth(trace_arrow_t *arrow,
+                                    uint32_t key_id,
+                                    uint32_t run_id,
+                                    const uint64_t *tsc,
+                                    const uint8_t *opcode,
+                                    uint64_t count);
+
+/* Write the footer and close the file */
+int trace_arrow_close(trace_arrow_t *arrow);
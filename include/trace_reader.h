@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+/*
+ * Read-only access to binary traces, built as the shared library
+ * libtrace_reader.so for the evaluation scripts (ctypes).
+ *
+ * Raw columns are returned as pointers into the mapped trace, packed
+ * columns and records are decoded once on first access and kept until the
+ * reader is closed. TSC windows are located through the sparse index of the
+ * trace.
+ */
+
+/* Same thresholds as lat_to_clevel() in the evaluation utils.py */
+typedef enum trace_cache_level_t {
+	TRACE_CLEVEL_L1 = 1,
+	TRACE_CLEVEL_L2,
+	TRACE_CLEVEL_L3,
+	TRACE_CLEVEL_RML2,
+	TRACE_CLEVEL_DRAM,
+	TRACE_CLEVEL_PAGE,
+	TRACE_CLEVEL_UND,
+} trace_cache_level_t;
+
+typedef struct trace_reader_t {
+	const uint8_t *base;
+	uint64_t size;
+	void *map;
+	size_t map_size;
+	const trace_file_header_t *header;
+	const trace_channel_t *channels;
+	const trace_index_t **index;
+	uint64_t **decoded;
+} trace_reader_t;
+
+/* A sample of the merged stream, latency saturates at UINT32_MAX */
+typedef struct trace_event_t {
+	uint64_t tsc;
+	uint32_t channel;
+	uint32_t latency;
+} trace_event_t;
+
+typedef struct trace_slice_t {
+	const uint64_t *tsc;
+	const uint64_t *latency;
+	uint64_t first;
+	uint64_t count;
+} trace_slice_t;
+
+/* Size of trace_reader_t, for callers that cannot include this header */
+size_t trace_reader_size(void);
+
+/* Map filepath and attach to the trace at its start */
+int trace_reader_open(trace_reader_t *reader, const char *filepath);
+
+/* Attach to a trace image owned by the caller, e.g. a segment run */
+int trace_reader_attach(trace_reader_t *reader,
+                        const uint8_t *image,
+                        uint64_t size);
+
+void trace_reader_close(trace_reader_t *reader);
+
+uint32_t trace_reader_channel_count(const trace_reader_t *reader);
+
+uint64_t trace_reader_sample_count(const trace_reader_t *reader,
+                                   uint32_t channel);
+
+/* Capture block of the trace, NULL for traces written without one */
+const trace_capture_t *trace_reader_capture(const trace_reader_t *reader);
+
+const trace_capture_channel_t *
+trace_reader_capture_channel(const trace_reader_t *reader, uint32_t channel);
+
+/* Ground truth records of the run, NULL with count 0 if it has none */
+const trace_gt_t *trace_reader_ground_truth(const trace_reader_t *reader,
+                                            uint64_t *count);
+
+/* Noise channel of the run, NULL with count 0 if it has none */
+const trace_noise_t *trace_reader_noise(const trace_reader_t *reader,
+                                        uint64_t *count);
+
+/* Coverage summary of every channel, NULL if the trace has none */
+const trace_coverage_t *trace_reader_coverage(const trace_reader_t *reader);
+
+/* Column of sample_count values, NULL on error */
+const uint64_t *trace_reader_tsc(trace_reader_t *reader, uint32_t channel);
+
+const uint64_t *trace_reader_latency(trace_reader_t *reader, uint32_t channel);
+
+/*
+ * Records of a TRACE_ENCODING_RECORDS channel and their tsc_base, with the
+ * flags the columns drop. NULL for the other encodings.
+ */
+const trace_record_t *trace_reader_records(const trace_reader_t *reader,
+                                           uint32_t channel,
+                                           uint64_t *tsc_base);
+
+/*
+ * Samples of channel with tsc_lo <= tsc < tsc_hi, as pointers into the
+ * columns. Binary searches the sparse index and then at most index_stride
+ * samples, or the whole column for traces without an index.
+ */
+int trace_range(trace_reader_t *reader,
+                uint32_t channel,
+                uint64_t tsc_lo,
+                uint64_t tsc_hi,
+                trace_slice_t *slice);
+
+/* Number of samples over all channels */
+uint64_t trace_reader_event_count(const trace_reader_t *reader);
+
+/* Event channels stored with the trace (trace.h), NULL if it has none */
+const uint8_t *trace_reader_event_channels(const trace_reader_t *reader);
+
+/*
+ * Fill events with the samples of every channel in tsc order, ties in
+ * channel order, trace_reader_event_count() of them. Follows the stored
+ * event channels, traces without them are merged with trace_merge().
+ */
+int trace_reader_events(trace_reader_t *reader, trace_event_t *events);
+
+trace_cache_level_t trace_cache_level(uint64_t latency);
+
+/*
+ * Set mask[i] to 1 if latency[i] counts as a hit for attack, like
+ * lat_to_hit() in the evaluation utils.py. Returns the number of hits.
+ */
+uint64_t trace_hit_mask(const uint64_t *latency,
+                        uint64_t sample_count,
+                        trace_attack_t attack,
+                        uint8_t *mask);
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+/*
+ * Segment file layout:
+ *
+ *   trace_segment_header_t                    64 bytes
+ *   per run, TRACE_ALIGN aligned:
+ *     trace_segment_record_t                  64 bytes
+ *     trace image (see trace.h)               record.length bytes
+ *   trace_segment_entry_t[entry_count]        32 bytes each
+ *   trace_segment_trailer_t                   32 bytes
+ *
+ * Records are only ever appended. The index and the trailer are rewritten at
+ * the end of the file whenever the segment is closed, sorted by
+ * (key_id, run_id, channel). Each run has one TRACE_SEGMENT_RUN entry
+ * covering the whole trace image and one entry per channel covering its
+ * tsc and latency columns. If the trailer is missing, the index is rebuilt
+ * from the record headers on the next open.
+ */
+
+#define TRACE_SEGMENT_MAGIC "SCARSEG"
+#define TRACE_SEGMENT_INDEX_MAGIC "SCARIDX"
+#define TRACE_SEGMENT_VERSION (1)
+#define TRACE_SEGMENT_RUN (0xffffffffU)
+
+typedef struct trace_segment_header_t {
+	char magic[8];
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t reserved0;
+	uint64_t reserved[6];
+} trace_segment_header_t;
+
+typedef struct trace_segment_record_t {
+	char magic[8];
+	uint32_t key_id;
+	uint32_t run_id;
+	uint64_t length;
+	uint64_t reserved[5];
+} trace_segment_record_t;
+
+typedef struct trace_segment_entry_t {
+	uint32_t key_id;
+	uint32_t run_id;
+	uint32_t channel;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t length;
+} trace_segment_entry_t;
+
+typedef struct trace_segment_trailer_t {
+	uint64_t index_offset;
+	uint64_t entry_count;
+	char magic[8];
+	uint64_t reserved;
+} trace_segment_trailer_t;
+
+typedef struct trace_segment_t {
+	FILE *fp;
+	char filepath[256];
+	trace_format_t format;
+	uint64_t end;
+	trace_segment_entry_t *entries;
+	uint64_t entry_count;
+	uint64_t entry_capacity;
+} trace_segment_t;
+
+typedef struct trace_segment_reader_t {
+	const uint8_t *base;
+	uint64_t size;
+	const trace_segment_entry_t *entries;
+	uint64_t entry_count;
+} trace_segment_reader_t;
+
+/* Create filepath, or reopen it and append after the last record */
+int trace_segment_open(trace_segment_t *segment, const char *filepath);
+
+int trace_segment_append(trace_segment_t *segment,
+                         uint32_t key_id,
+                         uint32_t run_id,
+                         uint64_t **sample_tsc,
+                         uint64_t **latency,
+                         const uint64_t *sample_count,
+                         int cl_cnt,
+                         int sp_cnt);
+
+/* Write the index and the trailer, then close the file */
+int trace_segment_close(trace_segment_t *segment);
+
+int trace_segment_map(trace_segment_reader_t *reader, const char *filepath);
+
+void trace_segment_unmap(trace_segment_reader_t *reader);
+
+/* Binary search the index, channel may be TRACE_SEGMENT_RUN */
+const trace_segment_entry_t *
+trace_segment_find(const trace_segment_reader_t *reader,
+                   uint32_t key_id,
+                   uint32_t run_id,
+                   uint32_t channel);
+
+/* Trace image of one run, NULL if the run is not in the segment */
+const uint8_t *trace_segment_run(const trace_segment_reader_t *reader,
+                                 uint32_t key_id,
+                                 uint32_t run_id,
+                                 uint64_t *length);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "sample_alloc.h"
+#include "trace.h"
+
+#define TRACE_WRITER_MAX_CHANNELS (8)
+
+typedef struct trace_buffer_set_t {
+	uint64_t *sample_tsc[TRACE_WRITER_MAX_CHANNELS];
+	uint64_t *probe_time[TRACE_WRITER_MAX_CHANNELS];
+	uint64_t sample_count[TRACE_WRITER_MAX_CHANNELS];
+	// Records in sample_tsc (trace.h) relative to tsc_base, probe_time unused
+	int records;
+	uint64_t tsc_base[TRACE_WRITER_MAX_CHANNELS];
+	// Noise channel of the submitting thread, copied for the writer thread
+	trace_noise_t *noise;
+	uint64_t noise_count;
+	uint64_t noise_size;
+	// Coverage of the submitting thread, if it had any
+	int has_coverage;
+	trace_coverage_t coverage[TRACE_WRITER_MAX_CHANNELS];
+	// Capture block and channels of the run, the slots move on to the next
+	trace_capture_t capture;
+	trace_capture_channel_t channels[TRACE_WRITER_MAX_CHANNELS];
+} trace_buffer_set_t;
+
+/*
+ * Double-buffered background trace writer.
+ *
+ * The profiler owns one buffer set while the writer thread dumps and clears
+ * the other one. trace_writer_submit() hands the filled set over and points
+ * the caller's sample_tsc/probe_time arrays at the spare set, so the next
+ * victim run can start without waiting for file I/O.
+ */
+typedef struct trace_writer_t {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int cl_cnt;
+	int sp_cnt;
+	int pin_cpu;
+	int busy;
+	int stop;
+	int active;
+	trace_buffer_set_t sets[2];
+	sample_alloc_t spare_alloc;
+	// First column of the spare set
+	uint64_t *spare;
+
+	/* pending dump */
+	char dump_prefix[256];
+	int victim_runs;
+	int reset;
+} trace_writer_t;
+
+int trace_writer_init(trace_writer_t *writer,
+                      uint64_t **sample_tsc,
+                      uint64_t **probe_time,
+                      int cl_cnt,
+                      int sp_cnt,
+                      int pin_cpu);
+
+/* tsc_base NULL submits columns, else records (dump_profiling_records()) */
+void trace_writer_submit(trace_writer_t *writer,
+                         const char *dump_prefix,
+                         int victim_runs,
+                         uint64_t **sample_tsc,
+                         uint64_t **probe_time,
+                         const uint64_t *sample_count,
+                         const uint64_t *tsc_base,
+                         int reset);
+
+void trace_writer_flush(trace_writer_t *writer);
+
+void trace_writer_destroy(trace_writer_t *writer);
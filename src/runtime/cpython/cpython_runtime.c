@@ -2,7 +2,7 @@
 
 #include "arch.h"
 #include "config.h"
-#include "fs.h"
+#include "gt_ring.h"
 #include "log.h"
 #include "Python.h"
 #include "shared_memory.h"
@@ -15,6 +15,8 @@
 
 sync_ctx_t sync_ctx;
 
+static gt_ring_t *gt_ring;
+
 static char s_initial_key_path[PATH_LEN] = "";
 
 void cpython_pow_set_key(const char *path) {
@@ -71,25 +73,24 @@ void cpython_free() {
 	Py_Finalize();
 }
 
-void cpython_save_gt(const char *filename) {
-	FILE *fp = fopen(filename, "w");
-	if (fp == NULL) {
-		log_error("Error opening ground truth file %s", filename);
-		return;
-	}
-
+/*
+ * Move the pow opcodes logged by the last call into the ground truth ring,
+ * as the 0 (zero), 1 (window) and 2 (trailing) events of gt_N.out, and
+ * restart the log. Runs in the idle time between calls, so the 16-bit log
+ * only has to hold a single call.
+ */
+static void cpython_push_gt(void) {
 	for (uint16_t j = 0; j < python_opcode_log_ctr; ++j) {
 		uint64_t time = python_opcode_log[j][0];
 		uint64_t opcode = python_opcode_log[j][1];
 		if (opcode == INSTR_POW_ZERO)
-			fprintf(fp, "0:%lu:zero\n", time);
+			gt_ring_push(gt_ring, time, 0);
 		if (opcode == INSTR_POW_WINDOW)
-			fprintf(fp, "1:%lu:window\n", time);
+			gt_ring_push(gt_ring, time, 1);
 		if (opcode == INSTR_POW_TRAILING)
-			fprintf(fp, "2:%lu:trailing\n", time);
+			gt_ring_push(gt_ring, time, 2);
 	}
-
-	fclose(fp);
+	python_opcode_log_ctr = 0;
 }
 
 void cpython_eval_loop(char *file, uint32_t iterations) {
@@ -98,6 +99,10 @@ void cpython_eval_loop(char *file, uint32_t iterations) {
 	log_info("Start cpython eval loop");
 
 	reset_sync_ctx(CPYTHON_PROJ_ID);
+	gt_ring = gt_ring_reset(CPYTHON_PROJ_ID);
+	if (gt_ring == NULL) {
+		exit(1);
+	}
 
 	cpython_init(file);
 	PyObject *module = PyImport_ImportModule("__main__");
@@ -122,8 +127,6 @@ void cpython_eval_loop(char *file, uint32_t iterations) {
 	log_info("Runtime wait Attacker initialization done %lu", rdtscp());
 
 	uint64_t *data = calloc(PAGE_SIZE, sizeof(uint64_t));
-	int iteration = 0;
-	create_directory("output/cpython_gt");
 
 	do {
 		log_info("Runtime start barrier %lu", rdtscp());
@@ -148,6 +151,7 @@ void cpython_eval_loop(char *file, uint32_t iterations) {
 				assert(ret != NULL);
 				PyObject tmp = *ret;
 				Py_XDECREF(ret);
+				cpython_push_gt();
 
 				while (rdtscp() - tsc < extra_waiting_time) {
 				}
@@ -162,6 +166,7 @@ void cpython_eval_loop(char *file, uint32_t iterations) {
 				assert(ret != NULL);
 				PyObject tmp = *ret;
 				Py_XDECREF(ret);
+				cpython_push_gt();
 
 				while (rdtscp() - tsc < extra_waiting_time) {
 				}
@@ -185,11 +190,6 @@ void cpython_eval_loop(char *file, uint32_t iterations) {
 		log_info("Runtime end barrier %lu", rdtscp());
 		pthread_barrier_wait(sync_ctx.barrier);
 		log_info("Runtime end done %lu", rdtscp());
-
-		char filename[256];
-		snprintf(filename, 256, "output/cpython_gt/gt_%d.out", iteration++);
-		cpython_save_gt(filename);
-
 	} while (1);
 
 	Py_XDECREF(set_key);
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -13,6 +14,7 @@
 const int pinned_cpu0 = 10;
 const int pinned_cpu1 = 12;
 const int pinned_cpu2 = 14;
+const int pinned_writer_cpu = 8;
 
 /**
  * \description:
@@ -38,3 +40,42 @@ int pin_cpu(int cpu_id) {
     }
     return ret;
 }
+
+static uint64_t tsc_calibrate(void) {
+    struct timespec t0, t1;
+    const uint64_t wait_ns = 100000000;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+    uint64_t tsc0 = rdtscp();
+    uint64_t ns;
+    do {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+        ns = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+    } while (ns < wait_ns);
+    uint64_t tsc1 = rdtscp();
+    return (tsc1 - tsc0) * 1000000000ull / ns;
+}
+
+uint64_t tsc_frequency(void) {
+    static uint64_t freq = 0;
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    if (freq != 0) {
+        return freq;
+    }
+    __cpuid(&eax, &ebx, &ecx, &edx);
+    if (eax >= 0x15) {
+        eax = 0x15;
+        ecx = 0;
+        __cpuid(&eax, &ebx, &ecx, &edx);
+        // eax/ebx is the TSC/crystal ratio, ecx the crystal in Hz
+        if (eax != 0 && ebx != 0 && ecx != 0) {
+            freq = (uint64_t)ecx * ebx / eax;
+        }
+    }
+    if (freq == 0) {
+        freq = tsc_calibrate();
+    }
+    log_info("TSC frequency %lu Hz", freq);
+    return freq;
+}
@@ -0,0 +1,174 @@
+#include "color_alloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arch.h"
+#include "cache.h"
+#include "config.h"
+#include "log.h"
+
+static color_arena_t *color_arena;
+
+int color_audit_enabled(void) {
+	const char *env_audit = getenv("COLOR_AUDIT");
+	return env_audit != NULL && strlen(env_audit) > 0 &&
+	       strcmp(env_audit, "0") != 0;
+}
+
+/* Set index bits an address reveals, all of them on a hugepage */
+static uint64_t color_index_mask(const color_arena_t *arena, int hugepage) {
+	uint64_t mask = arena->sets - 1;
+	return hugepage ? mask : mask & ((PAGE_SIZE - 1) >> CACHE_LINE_BITS);
+}
+
+int color_arena_init(color_arena_t *arena, size_t size) {
+	config_t *cfg = get_config();
+
+	memset(arena, 0, sizeof(*arena));
+	// Only the index bits below the slice count are certain
+	arena->sets = 1ul << (63 - __builtin_clzll(cfg->sets_per_slice));
+	arena->size = (size + COLOR_ARENA_SIZE - 1) & ~(COLOR_ARENA_SIZE - 1);
+	arena->hugepage = (cfg->mmap_flag & MAP_HUGETLB) != 0;
+
+	arena->base = mmap(NULL,
+	                   arena->size,
+	                   PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS | cfg->mmap_flag,
+	                   -1,
+	                   0);
+	if (arena->base == MAP_FAILED && arena->hugepage) {
+		log_warn("No hugepages for the color arena, only page offsets "
+		         "are colored");
+		arena->hugepage = 0;
+		arena->base = mmap(NULL,
+		                   arena->size,
+		                   PROT_READ | PROT_WRITE,
+		                   MAP_PRIVATE | MAP_ANONYMOUS,
+		                   -1,
+		                   0);
+	}
+	if (arena->base == MAP_FAILED) {
+		log_error("Cannot map a color arena of %lu bytes", arena->size);
+		arena->base = NULL;
+		return 1;
+	}
+	// Fault the arena in now, not in the profiling window
+	memset(arena->base, 0, arena->size);
+	return 0;
+}
+
+void color_arena_destroy(color_arena_t *arena) {
+	if (color_arena == arena) {
+		color_arena = NULL;
+	}
+	if (arena->base != NULL) {
+		munmap(arena->base, arena->size);
+		arena->base = NULL;
+	}
+}
+
+int color_arena_avoid(color_arena_t *arena, const void *addr, int hugepage) {
+	if (arena->set_count == COLOR_MAX_SETS) {
+		log_error("Color arena avoids %d sets already", COLOR_MAX_SETS);
+		return 1;
+	}
+	color_set_t *set = &arena->avoid[arena->set_count++];
+	set->index = cache_parse_set_index((uintptr_t)addr, arena->sets);
+	set->mask = color_index_mask(arena, hugepage);
+	log_info("Color arena avoids set %#lx/%#lx", set->index, set->mask);
+	return 0;
+}
+
+/* Number of avoided sets the line at addr may map to */
+static int color_line_collisions(const color_arena_t *arena,
+                                 uintptr_t addr,
+                                 uint64_t line_mask,
+                                 uint64_t *per_set) {
+	uint64_t index = cache_parse_set_index(addr, arena->sets);
+	int collisions = 0;
+
+	for (int k = 0; k < arena->set_count; ++k) {
+		const color_set_t *set = &arena->avoid[k];
+		if (((index ^ set->index) & set->mask & line_mask) == 0) {
+			collisions++;
+			if (per_set != NULL) {
+				per_set[k]++;
+			}
+		}
+	}
+	return collisions;
+}
+
+void *color_alloc(color_arena_t *arena, size_t size, size_t align) {
+	uint64_t line_mask = color_index_mask(arena, arena->hugepage);
+	uintptr_t end = (uintptr_t)arena->base + arena->size;
+
+	if (align < CACHE_LINE_SIZE) {
+		align = CACHE_LINE_SIZE;
+	}
+	uintptr_t start = ((uintptr_t)arena->base + arena->used + align - 1) &
+	                  ~(uintptr_t)(align - 1);
+	uintptr_t line = start;
+	while (start + size <= end) {
+		if (line >= start + size) {
+			arena->used = line - (uintptr_t)arena->base;
+			return (void *)start;
+		}
+		if (color_line_collisions(arena, line, line_mask, NULL) > 0) {
+			// Restart the run after the avoided line
+			start = (line + CACHE_LINE_SIZE + align - 1) &
+			        ~(uintptr_t)(align - 1);
+			line = start;
+			continue;
+		}
+		line += CACHE_LINE_SIZE;
+	}
+	log_warn("Color arena has no run of %lu bytes left", size);
+	return NULL;
+}
+
+color_arena_t *color_arena_get(void) {
+	return color_arena;
+}
+
+void color_arena_set(color_arena_t *arena) {
+	color_arena = arena;
+}
+
+uint64_t color_audit(const color_arena_t *arena,
+                     const char *label,
+                     const void *addr,
+                     size_t size) {
+	uintptr_t begin = (uintptr_t)addr & CACHE_LINE_MASK;
+	uintptr_t end = (uintptr_t)addr + size;
+	uintptr_t arena_begin = (uintptr_t)arena->base;
+	uint64_t per_set[COLOR_MAX_SETS] = { 0 };
+	uint64_t lines = 0, total = 0;
+	char summary[COLOR_MAX_SETS * 24] = "";
+	size_t len = 0;
+
+	for (uintptr_t line = begin; line < end; line += CACHE_LINE_SIZE) {
+		int in_arena =
+		    line >= arena_begin && line < arena_begin + arena->size;
+		uint64_t line_mask =
+		    color_index_mask(arena, in_arena && arena->hugepage);
+		total += color_line_collisions(arena, line, line_mask, per_set);
+		lines++;
+	}
+	for (int k = 0; k < arena->set_count && len < sizeof(summary); ++k) {
+		len += snprintf(summary + len,
+		                sizeof(summary) - len,
+		                " %#lx:%lu",
+		                arena->avoid[k].index,
+		                per_set[k]);
+	}
+	log_info("Color audit %s: %lu collisions in %lu lines, per set%s",
+	         label,
+	         total,
+	         lines,
+	         summary);
+	return total;
+}
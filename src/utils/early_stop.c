@@ -0,0 +1,80 @@
+#include "early_stop.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Mean block power of a target set
+#define EARLY_STOP_POWER                                                       \
+	(1 + EARLY_STOP_BLOCK_HITS * EARLY_STOP_COHERENCE * EARLY_STOP_COHERENCE)
+
+int early_stop_enabled(void) {
+	const char *env_early_stop = getenv("EARLY_STOP");
+	return env_early_stop != NULL && strlen(env_early_stop) > 0 &&
+	       strcmp(env_early_stop, "0") != 0;
+}
+
+void early_stop_init(early_stop_t *es, uint32_t base_freq, uint64_t tsc_freq) {
+	memset(es, 0, sizeof(*es));
+	if (base_freq == 0) {
+		es->block_cycles = UINT64_MAX;
+		return;
+	}
+	es->omega = 2 * M_PI * base_freq / tsc_freq;
+	es->block_cycles =
+	    EARLY_STOP_SLACK * EARLY_STOP_BLOCK_HITS * tsc_freq / base_freq;
+}
+
+void early_stop_reset(early_stop_t *es, uint64_t tsc) {
+	es->re = es->im = 0;
+	es->block_hits = 0;
+	es->block_tsc = tsc;
+	es->blocks = 0;
+	es->hits = 0;
+	es->llr = 0;
+	es->decision = EARLY_STOP_UNDECIDED;
+}
+
+/* Add the power of the current block to the test and start the next one */
+static early_stop_decision_t early_stop_close(early_stop_t *es, uint64_t tsc) {
+	double power = 0;
+
+	if (es->block_hits > 0) {
+		power = (es->re * es->re + es->im * es->im) / es->block_hits;
+	}
+	// Log-likelihood ratio of an exponential with mean EARLY_STOP_POWER
+	// against one with mean 1, a short block has less power than a full one
+	es->llr += power * (1 - 1 / EARLY_STOP_POWER) - log(EARLY_STOP_POWER);
+	es->blocks++;
+	es->re = es->im = 0;
+	es->block_hits = 0;
+	es->block_tsc = tsc;
+
+	if (es->llr >= log((1 - EARLY_STOP_BETA) / EARLY_STOP_ALPHA)) {
+		es->decision = EARLY_STOP_ACCEPT;
+	} else if (es->llr <= log(EARLY_STOP_BETA / (1 - EARLY_STOP_ALPHA))) {
+		es->decision = EARLY_STOP_REJECT;
+	}
+	return es->decision;
+}
+
+early_stop_decision_t early_stop_hit(early_stop_t *es, uint64_t tsc) {
+	if (es->decision != EARLY_STOP_UNDECIDED || es->omega == 0) {
+		return es->decision;
+	}
+	double phase = es->omega * (tsc - es->block_tsc);
+	es->re += cos(phase);
+	es->im += sin(phase);
+	es->hits++;
+	if (++es->block_hits == EARLY_STOP_BLOCK_HITS) {
+		return early_stop_close(es, tsc);
+	}
+	return es->decision;
+}
+
+early_stop_decision_t early_stop_timeout(early_stop_t *es, uint64_t tsc) {
+	if (es->decision != EARLY_STOP_UNDECIDED || es->omega == 0) {
+		return es->decision;
+	}
+	return early_stop_close(es, tsc);
+}
@@ -0,0 +1,49 @@
+#include "gt_ring.h"
+
+#include <string.h>
+
+#include "log.h"
+#include "shared_memory.h"
+
+#define GT_RING_NAME "gt_ring"
+
+gt_ring_t *gt_ring_attach(int proj_id) {
+	gt_ring_t *ring = shm_alloc(GT_RING_NAME, proj_id, sizeof(gt_ring_t));
+
+	if (ring == (void *)-1) {
+		log_error("Cannot attach ground truth ring");
+		return NULL;
+	}
+	return ring;
+}
+
+gt_ring_t *gt_ring_reset(int proj_id) {
+	shm_release(GT_RING_NAME, proj_id, sizeof(gt_ring_t));
+	return gt_ring_attach(proj_id);
+}
+
+uint64_t gt_ring_pending(gt_ring_t *ring) {
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+uint64_t gt_ring_drain(gt_ring_t *ring, trace_gt_t *dst, uint64_t max) {
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	uint64_t count = gt_ring_pending(ring);
+	uint64_t dropped =
+	    __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+
+	if (dropped > 0) {
+		log_warn("Ground truth ring full, dropped %lu records", dropped);
+	}
+	count = count < max ? count : max;
+
+	// At most two copies, up to the end of the ring and from its start
+	uint64_t first = tail & (GT_RING_SIZE - 1);
+	uint64_t n = count < GT_RING_SIZE - first ? count : GT_RING_SIZE - first;
+	memcpy(dst, &ring->records[first], n * sizeof(trace_gt_t));
+	memcpy(dst + n, ring->records, (count - n) * sizeof(trace_gt_t));
+
+	__atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+	return count;
+}
@@ -0,0 +1,87 @@
+#include "live_trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+
+_Static_assert(sizeof(live_trace_t) == 64, "live trace header size");
+_Static_assert(sizeof(live_channel_t) == 64, "live channel size");
+
+static live_trace_t *live_trace;
+
+static size_t live_trace_size(uint32_t cl_cnt) {
+	return sizeof(live_trace_t) + cl_cnt * sizeof(live_channel_t);
+}
+
+int live_trace_enabled(void) {
+	const char *env_live = getenv("TRACE_LIVE");
+	return env_live != NULL && strlen(env_live) > 0 &&
+	       strcmp(env_live, "0") != 0;
+}
+
+live_trace_t *live_trace_create(const char *dirpath, int cl_cnt) {
+	char filepath[512];
+	size_t size = live_trace_size(cl_cnt);
+
+	snprintf(filepath, sizeof(filepath), "%s/live", dirpath);
+	int fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, size) != 0) {
+		log_error("Error creating live trace %s", filepath);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+	live_trace_t *live =
+	    mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (live == MAP_FAILED) {
+		log_error("Error mapping live trace %s", filepath);
+		return NULL;
+	}
+
+	live->channel_count = cl_cnt;
+	live->seq = 1;
+	memcpy(live->magic, LIVE_TRACE_MAGIC, sizeof(LIVE_TRACE_MAGIC));
+	log_info("Publishing live trace to %s", filepath);
+	live_trace = live;
+	return live;
+}
+
+void live_trace_close(live_trace_t *live) {
+	if (live == NULL) {
+		return;
+	}
+	__atomic_store_n(&live->state, LIVE_TRACE_DONE, __ATOMIC_RELEASE);
+	if (live_trace == live) {
+		live_trace = NULL;
+	}
+	munmap(live, live_trace_size(live->channel_count));
+}
+
+live_trace_t *live_trace_get(void) {
+	return live_trace;
+}
+
+void live_trace_begin_run(live_trace_t *live, uint32_t run) {
+	if (live == NULL) {
+		return;
+	}
+
+	// A new file starts with seq 1, so that readers wait for the first run
+	uint64_t seq = __atomic_load_n(&live->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) == 0) {
+		__atomic_store_n(&live->seq, ++seq, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&live->run, run, __ATOMIC_RELAXED);
+	for (uint32_t j = 0; j < live->channel_count; ++j) {
+		__atomic_store_n(&live->channels[j].count, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&live->seq, seq + 1, __ATOMIC_RELEASE);
+}
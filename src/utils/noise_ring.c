@@ -0,0 +1,95 @@
+#include "noise_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+static noise_ring_t *noise_rings[TRACE_CAPTURE_MAX_CHANNELS];
+
+// Events of the last collected run, handed to trace_set_noise()
+static trace_noise_t *noise_run;
+static uint64_t noise_run_size;
+
+noise_ring_t *noise_ring_get(int slot) {
+	if (slot < 0 || slot >= TRACE_CAPTURE_MAX_CHANNELS) {
+		return NULL;
+	}
+	if (noise_rings[slot] == NULL) {
+		noise_ring_t *ring = aligned_alloc(64, sizeof(noise_ring_t));
+		if (ring == NULL) {
+			log_error("Cannot allocate the noise ring of slot %d", slot);
+			return NULL;
+		}
+		// Fault the ring in now, not in the profiling window
+		memset(ring, 0, sizeof(noise_ring_t));
+		ring->slot = slot;
+		noise_rings[slot] = ring;
+	}
+	return noise_rings[slot];
+}
+
+static int noise_tsc_lt(const void *a, const void *b) {
+	uint64_t va = ((const trace_noise_t *)a)->tsc;
+	uint64_t vb = ((const trace_noise_t *)b)->tsc;
+	return va < vb ? -1 : va > vb;
+}
+
+uint64_t noise_ring_collect(int cl_cnt) {
+	uint64_t total = 0, count = 0;
+
+	if (cl_cnt > TRACE_CAPTURE_MAX_CHANNELS) {
+		cl_cnt = TRACE_CAPTURE_MAX_CHANNELS;
+	}
+	for (int j = 0; j < cl_cnt; ++j) {
+		if (noise_rings[j] != NULL) {
+			uint64_t head = noise_rings[j]->head;
+			total += head < NOISE_RING_SIZE ? head : NOISE_RING_SIZE;
+		}
+	}
+	if (total > noise_run_size) {
+		trace_noise_t *run = realloc(noise_run, total * sizeof(trace_noise_t));
+		if (run == NULL) {
+			log_error("Cannot allocate %lu noise events", total);
+			total = 0;
+		} else {
+			noise_run = run;
+			noise_run_size = total;
+		}
+	}
+
+	for (int j = 0; j < cl_cnt; ++j) {
+		noise_ring_t *ring = noise_rings[j];
+		uint64_t kinds[TRACE_NOISE_DROPPED + 1] = { 0 };
+		if (ring == NULL || ring->head == 0) {
+			continue;
+		}
+		uint64_t begin = 0;
+		if (ring->head > NOISE_RING_SIZE) {
+			begin = ring->head - NOISE_RING_SIZE;
+			log_warn("Slot %d lost %lu noise events", j, begin);
+		}
+		for (uint64_t i = begin; i < ring->head && count < total; ++i) {
+			const trace_noise_t *event =
+			    &ring->events[i & (NOISE_RING_SIZE - 1)];
+			noise_run[count++] = *event;
+			kinds[event->kind <= TRACE_NOISE_DROPPED ? event->kind : 0]++;
+		}
+		if (kinds[TRACE_NOISE_CPU_SWITCH] > 0) {
+			log_warn("Attacker %d switched CPU %lu times",
+			         j,
+			         kinds[TRACE_NOISE_CPU_SWITCH]);
+		}
+		log_debug("Attacker %d noise: %lu interrupts, %lu dropped samples",
+		          j,
+		          kinds[TRACE_NOISE_INTERRUPT],
+		          kinds[TRACE_NOISE_DROPPED]);
+		ring->head = 0;
+	}
+
+	if (count > 1) {
+		qsort(noise_run, count, sizeof(trace_noise_t), noise_tsc_lt);
+	}
+	trace_set_noise(noise_run, count);
+	return count;
+}
@@ -0,0 +1,352 @@
+#include "result_store.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+_Static_assert(sizeof(result_store_header_t) == 64, "result header size");
+_Static_assert(sizeof(result_record_t) == 48, "result record size");
+
+#define XXH_PRIME1 (11400714785074694791ULL)
+#define XXH_PRIME2 (14029467366897019727ULL)
+#define XXH_PRIME3 (1609587929392839161ULL)
+#define XXH_PRIME4 (9650029242287828579ULL)
+#define XXH_PRIME5 (2870177450012600261ULL)
+
+size_t result_store_size(void) {
+	return sizeof(result_store_t);
+}
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+	acc += input * XXH_PRIME2;
+	return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+	acc ^= xxh_round(0, v);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t result_hash(const void *data, uint64_t size, uint64_t seed) {
+	const uint8_t *p = data, *end = p + size;
+	uint64_t h;
+
+	if (size >= 32) {
+		uint64_t v[4] = { seed + XXH_PRIME1 + XXH_PRIME2,
+			              seed + XXH_PRIME2,
+			              seed,
+			              seed - XXH_PRIME1 };
+		for (; p + 32 <= end; p += 32) {
+			for (int i = 0; i < 4; ++i) {
+				v[i] = xxh_round(v[i], xxh_read64(p + 8 * i));
+			}
+		}
+		h = xxh_rotl(v[0], 1) + xxh_rotl(v[1], 7) + xxh_rotl(v[2], 12) +
+		    xxh_rotl(v[3], 18);
+		for (int i = 0; i < 4; ++i) {
+			h = xxh_merge(h, v[i]);
+		}
+	} else {
+		h = seed + XXH_PRIME5;
+	}
+	h += size;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (p + 4 <= end) {
+		uint32_t k;
+		memcpy(&k, p, sizeof(k));
+		h ^= (uint64_t)k * XXH_PRIME1;
+		h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		h ^= *p * XXH_PRIME5;
+		h = xxh_rotl(h, 11) * XXH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t result_align(uint64_t offset) {
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+static uint64_t result_checksum(const result_record_t *record,
+                                const void *value) {
+	result_record_t head = *record;
+
+	head.checksum = 0;
+	return result_hash(
+	    value, record->value_size, result_hash(&head, sizeof(head), 0));
+}
+
+static int result_key_eq(const result_key_t *a, const result_key_t *b) {
+	return a->content == b->content && a->analysis == b->analysis &&
+	       a->params == b->params;
+}
+
+static result_slot_t *result_store_slot(const result_store_t *store,
+                                        const result_key_t *key) {
+	uint64_t mask = store->slot_count - 1;
+	uint64_t i = (key->content ^ xxh_rotl(key->analysis, 21) ^
+	              xxh_rotl(key->params, 42)) &
+	             mask;
+
+	// Linear probing, the table is never more than half full
+	while (store->slots[i].status != RESULT_MISS &&
+	       !result_key_eq(&store->slots[i].key, key)) {
+		i = (i + 1) & mask;
+	}
+	return &store->slots[i];
+}
+
+static int result_store_grow(result_store_t *store) {
+	result_slot_t *old = store->slots;
+	uint64_t old_count = store->slot_count;
+	uint64_t count = old_count ? 2 * old_count : 1024;
+
+	store->slots = calloc(count, sizeof(result_slot_t));
+	if (store->slots == NULL) {
+		log_error("Cannot grow result index of %s", store->filepath);
+		store->slots = old;
+		return 1;
+	}
+	store->slot_count = count;
+	for (uint64_t i = 0; i < old_count; ++i) {
+		if (old[i].status != RESULT_MISS) {
+			*result_store_slot(store, &old[i].key) = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static int result_store_index(result_store_t *store,
+                              const result_record_t *record,
+                              uint64_t offset) {
+	if (2 * (store->used + 1) > store->slot_count && result_store_grow(store)) {
+		return 1;
+	}
+
+	result_slot_t *slot = result_store_slot(store, &record->key);
+	store->used += slot->status == RESULT_MISS;
+	slot->key = record->key;
+	slot->offset = offset + sizeof(*record);
+	slot->value_size = record->value_size;
+	slot->status = record->status;
+	return 0;
+}
+
+/*
+ * Index the records appended since the last call. Stops at the first
+ * invalid record, which can only be a torn commit, and cuts it off when
+ * the caller holds the exclusive lock.
+ */
+static int result_store_catch_up(result_store_t *store, int exclusive) {
+	struct stat st;
+	result_record_t record;
+	uint8_t *value = NULL;
+	uint64_t capacity = 0;
+	int ret = 0;
+
+	if (fstat(store->fd, &st) != 0) {
+		log_error("Error reading result store %s", store->filepath);
+		return 1;
+	}
+	uint64_t size = st.st_size;
+	while (store->end + sizeof(record) <= size) {
+		if (pread(store->fd, &record, sizeof(record), store->end) !=
+		        sizeof(record) ||
+		    record.magic != RESULT_RECORD_MAGIC ||
+		    (record.status != RESULT_FOUND && record.status != RESULT_EMPTY) ||
+		    record.value_size > size - store->end - sizeof(record)) {
+			break;
+		}
+		if (record.value_size > capacity) {
+			capacity = record.value_size;
+			uint8_t *buf = realloc(value, capacity);
+			if (buf == NULL) {
+				log_error("Cannot read result store %s", store->filepath);
+				ret = 1;
+				break;
+			}
+			value = buf;
+		}
+		if (pread(store->fd,
+		          value,
+		          record.value_size,
+		          store->end + sizeof(record)) != (ssize_t)record.value_size ||
+		    record.checksum != result_checksum(&record, value)) {
+			break;
+		}
+		if (result_store_index(store, &record, store->end)) {
+			ret = 1;
+			break;
+		}
+		store->end =
+		    result_align(store->end + sizeof(record) + record.value_size);
+	}
+	free(value);
+
+	if (!ret && exclusive && store->end < size) {
+		log_warn("Dropping torn result record at %lu of %s",
+		         store->end,
+		         store->filepath);
+		if (ftruncate(store->fd, store->end) != 0) {
+			log_error("Error truncating result store %s", store->filepath);
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+int result_store_open(result_store_t *store, const char *filepath) {
+	result_store_header_t header;
+	struct stat st;
+
+	memset(store, 0, sizeof(*store));
+	snprintf(store->filepath, sizeof(store->filepath), "%s", filepath);
+	store->fd = open(filepath, O_RDWR | O_CREAT, 0644);
+	if (store->fd < 0) {
+		log_error("Error opening result store %s", filepath);
+		return 1;
+	}
+	if (flock(store->fd, LOCK_EX) != 0 || fstat(store->fd, &st) != 0) {
+		log_error("Error locking result store %s", filepath);
+		close(store->fd);
+		return 1;
+	}
+
+	int ret = 0;
+	if (st.st_size == 0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, RESULT_STORE_MAGIC, sizeof(RESULT_STORE_MAGIC));
+		header.version = RESULT_STORE_VERSION;
+		header.header_size = sizeof(header);
+		ret = pwrite(store->fd, &header, sizeof(header), 0) != sizeof(header);
+	} else {
+		ret = pread(store->fd, &header, sizeof(header), 0) != sizeof(header) ||
+		      memcmp(header.magic,
+		             RESULT_STORE_MAGIC,
+		             sizeof(RESULT_STORE_MAGIC)) != 0;
+	}
+	if (ret) {
+		log_error("%s is not a result store", filepath);
+	}
+	store->end = header.header_size;
+	ret = ret || result_store_catch_up(store, 1);
+	flock(store->fd, LOCK_UN);
+	if (ret) {
+		result_store_close(store);
+	}
+	return ret;
+}
+
+void result_store_close(result_store_t *store) {
+	if (store->fd >= 0) {
+		close(store->fd);
+	}
+	free(store->slots);
+	memset(store, 0, sizeof(*store));
+	store->fd = -1;
+}
+
+result_status_t result_store_get(result_store_t *store,
+                                 const result_key_t *key,
+                                 void *buf,
+                                 uint64_t buf_size,
+                                 uint64_t *value_size) {
+	if (flock(store->fd, LOCK_SH) != 0) {
+		log_error("Error locking result store %s", store->filepath);
+		return RESULT_MISS;
+	}
+	int ret = result_store_catch_up(store, 0);
+	flock(store->fd, LOCK_UN);
+	if (ret || store->slot_count == 0) {
+		return RESULT_MISS;
+	}
+
+	const result_slot_t *slot = result_store_slot(store, key);
+	*value_size = slot->value_size;
+	if (slot->status == RESULT_FOUND) {
+		uint64_t n = slot->value_size < buf_size ? slot->value_size : buf_size;
+		if (pread(store->fd, buf, n, slot->offset) != (ssize_t)n) {
+			log_error("Error reading result store %s", store->filepath);
+			return RESULT_MISS;
+		}
+	}
+	return slot->status;
+}
+
+int result_store_put(result_store_t *store,
+                     const result_key_t *key,
+                     result_status_t status,
+                     const void *value,
+                     uint64_t value_size) {
+	if (status == RESULT_EMPTY) {
+		value_size = 0;
+	}
+	uint64_t length = result_align(sizeof(result_record_t) + value_size);
+	uint8_t *commit = calloc(1, length);
+	if (commit == NULL) {
+		log_error("Cannot allocate result of %lu bytes", value_size);
+		return 1;
+	}
+
+	result_record_t *record = (result_record_t *)commit;
+	record->magic = RESULT_RECORD_MAGIC;
+	record->status = status;
+	record->value_size = value_size;
+	record->key = *key;
+	if (value_size > 0) {
+		memcpy(commit + sizeof(*record), value, value_size);
+	}
+	record->checksum = result_checksum(record, commit + sizeof(*record));
+
+	if (flock(store->fd, LOCK_EX) != 0) {
+		log_error("Error locking result store %s", store->filepath);
+		free(commit);
+		return 1;
+	}
+	// Append right after the last valid record of any writer
+	int ret = result_store_catch_up(store, 1);
+	if (!ret && pwrite(store->fd, commit, length, store->end) !=
+	                (ssize_t)length) {
+		log_error("Error writing result store %s", store->filepath);
+		if (ftruncate(store->fd, store->end) != 0) {
+			log_error("Error truncating result store %s", store->filepath);
+		}
+		ret = 1;
+	}
+	if (!ret) {
+		ret = result_store_index(store, record, store->end);
+		store->end += length;
+	}
+	flock(store->fd, LOCK_UN);
+	free(commit);
+	return ret;
+}
@@ -0,0 +1,204 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "sample_alloc.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "arch.h"
+#include "cache.h"
+#include "config.h"
+#include "log.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT (26)
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// MPOL_BIND of <numaif.h>, without depending on libnuma
+#define SAMPLE_MPOL_BIND (2)
+
+/* NUMA node rdtscp_aux() reports on cpu, the calling thread's if -1 */
+static int sample_alloc_node(int cpu) {
+	cpu_set_t saved;
+	uint32_t aux;
+
+	if (cpu != -1) {
+		if (sched_getaffinity(0, sizeof(saved), &saved) != 0 ||
+		    pin_cpu(cpu) != 0) {
+			return -1;
+		}
+	}
+	rdtscp_aux(&aux);
+	if (cpu != -1) {
+		sched_setaffinity(0, sizeof(saved), &saved);
+	}
+	return aux >> 12;
+}
+
+static int sample_alloc_map(sample_alloc_t *alloc,
+                            size_t size,
+                            size_t page_size,
+                            int flags) {
+	size_t map_size = (size + page_size - 1) & ~(page_size - 1);
+	void *base = mmap(NULL,
+	                  map_size,
+	                  PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS | flags,
+	                  -1,
+	                  0);
+	if (base == MAP_FAILED) {
+		return 1;
+	}
+	alloc->base = base;
+	alloc->size = map_size;
+	alloc->page_size = page_size;
+	return 0;
+}
+
+int sample_alloc_init(sample_alloc_t *alloc, size_t size, int cpu) {
+	config_t *cfg = get_config();
+	int err = 1;
+
+	memset(alloc, 0, sizeof(*alloc));
+	alloc->node = -1;
+
+	if (cfg->mmap_flag & MAP_HUGETLB) {
+		// Leave the 1 GiB pages to the eviction sets unless one is filled
+		if (size >= HUGEPAGE_SIZE) {
+			err = sample_alloc_map(alloc,
+			                       size,
+			                       HUGEPAGE_SIZE,
+			                       cfg->mmap_flag | MAP_HUGE_1GB);
+		}
+		if (err) {
+			err = sample_alloc_map(alloc,
+			                       size,
+			                       SAMPLE_ALLOC_HUGEPAGE_SIZE,
+			                       cfg->mmap_flag | MAP_HUGE_2MB);
+		}
+		if (err) {
+			log_warn("No hugepages for %lu sample bytes, using 4 KB pages",
+			         size);
+		}
+	}
+	if (err) {
+		err = sample_alloc_map(alloc, size, PAGE_SIZE, 0);
+	}
+	if (err) {
+		log_error("Cannot map %lu sample bytes", size);
+		alloc->base = NULL;
+		return 1;
+	}
+
+	int node = sample_alloc_node(cpu);
+	if (node >= 0 && node < 64) {
+		unsigned long nodemask = 1ul << node;
+		if (syscall(SYS_mbind,
+		            alloc->base,
+		            alloc->size,
+		            SAMPLE_MPOL_BIND,
+		            &nodemask,
+		            64,
+		            0) == 0) {
+			alloc->node = node;
+		} else {
+			log_warn("Cannot bind sample buffer to node %d, errno: %d",
+			         node,
+			         errno);
+		}
+	}
+	if (mlock(alloc->base, alloc->size) == 0) {
+		alloc->locked = 1;
+	} else {
+		log_warn("Cannot lock %lu sample bytes, errno: %d", alloc->size, errno);
+	}
+	// Fault the buffer in now, not in the profiling window
+	memset(alloc->base, 0, alloc->size);
+
+	log_info("Sample buffer of %lu bytes on %lu KB pages, node %d%s",
+	         alloc->size,
+	         alloc->page_size >> 10,
+	         alloc->node,
+	         alloc->locked ? ", locked" : "");
+	return 0;
+}
+
+void sample_alloc_destroy(sample_alloc_t *alloc) {
+	if (alloc->base != NULL) {
+		if (alloc->locked) {
+			munlock(alloc->base, alloc->size);
+		}
+		munmap(alloc->base, alloc->size);
+		alloc->base = NULL;
+	}
+}
+
+uint64_t *sample_alloc_columns(sample_alloc_t *alloc,
+                               uint64_t **columns,
+                               int count,
+                               size_t length) {
+	size_t column_size =
+	    (length * sizeof(uint64_t) + CACHE_LINE_SIZE - 1) & CACHE_LINE_MASK;
+
+	if (alloc->used + count * column_size > alloc->size) {
+		log_error("Sample buffer has no room for %d columns of %lu samples",
+		          count,
+		          length);
+		return NULL;
+	}
+	for (int j = 0; j < count; ++j) {
+		columns[j] = (uint64_t *)(alloc->base + alloc->used);
+		alloc->used += column_size;
+	}
+	return columns[0];
+}
+
+void sample_alloc_clear(sample_alloc_t *alloc) {
+	memset(alloc->base, 0, alloc->used);
+}
+
+void sample_faults_read(sample_faults_t *faults) {
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+		memset(faults, 0, sizeof(*faults));
+		return;
+	}
+	faults->minor = usage.ru_minflt;
+	faults->major = usage.ru_majflt;
+}
+
+uint64_t sample_faults_report(int slot, const sample_faults_t *before) {
+	sample_faults_t after;
+
+	sample_faults_read(&after);
+	uint64_t minor = after.minor - before->minor;
+	uint64_t major = after.major - before->major;
+	log_debug("Slot %d page faults: minor %lu -> %lu, major %lu -> %lu",
+	          slot,
+	          before->minor,
+	          after.minor,
+	          before->major,
+	          after.major);
+	if (minor + major > 0) {
+		log_warn("Slot %d took %lu minor and %lu major page faults while "
+		         "profiling",
+		         slot,
+		         minor,
+		         major);
+	}
+	return minor + major;
+}
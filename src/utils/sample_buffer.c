@@ -0,0 +1,506 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "sample_buffer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arch.h"
+#include "fs.h"
+#include "log.h"
+#include "trace.h"
+
+static uint64_t sample_buffer_align(uint64_t offset, uint64_t align) {
+	return (offset + align - 1) & ~(align - 1);
+}
+
+static trace_channel_t *sample_buffer_channels(sample_buffer_t *buffer,
+                                               sample_run_t *run) {
+	return (trace_channel_t *)(run->map + trace_header_size(buffer->cl_cnt));
+}
+
+/* Point sample_tsc/probe_time at the columns of run */
+static void sample_buffer_point(sample_buffer_t *buffer, sample_run_t *run) {
+	trace_channel_t *channels = sample_buffer_channels(buffer, run);
+
+	for (int j = 0; j < buffer->cl_cnt; ++j) {
+		buffer->sample_tsc[j] = (uint64_t *)(run->map + channels[j].tsc_offset);
+		buffer->probe_time[j] = (uint64_t *)(run->map + channels[j].lat_offset);
+	}
+}
+
+static int sample_buffer_map_run(sample_buffer_t *buffer,
+                                 sample_run_t *run,
+                                 int index) {
+	trace_file_header_t *header;
+	trace_channel_t *channels;
+	uint64_t offset = trace_header_size(buffer->cl_cnt) +
+	                  buffer->cl_cnt * sizeof(*channels);
+	uint64_t column_size = buffer->sp_cnt * sizeof(uint64_t);
+
+	offset = sample_buffer_align(offset, TRACE_ALIGN);
+	run->run = index;
+	run->map_size = offset;
+	for (int j = 0; j < buffer->cl_cnt; ++j) {
+		run->map_size += 2 * sample_buffer_align(column_size, TRACE_ALIGN);
+	}
+	// Room for the sparse index of full columns, filled in once committed
+	run->map_size += buffer->cl_cnt * sizeof(trace_index_t) *
+	                 trace_index_count(buffer->sp_cnt, TRACE_INDEX_STRIDE);
+
+	snprintf(run->filepath,
+	         sizeof(run->filepath),
+	         "%s/r%d.out",
+	         buffer->dirpath,
+	         index);
+	run->fd = open(run->filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (run->fd < 0) {
+		log_error("Error opening sample buffer %s", run->filepath);
+		return 1;
+	}
+	int err = posix_fallocate(run->fd, 0, run->map_size);
+	if (err != 0) {
+		log_error("Cannot allocate sample buffer %s: %s",
+		          run->filepath,
+		          strerror(err));
+		close(run->fd);
+		run->fd = -1;
+		return 1;
+	}
+	run->map = mmap(NULL,
+	                run->map_size,
+	                PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE,
+	                run->fd,
+	                0);
+	if (run->map == MAP_FAILED) {
+		log_error("Error mapping sample buffer %s", run->filepath);
+		run->map = NULL;
+		close(run->fd);
+		run->fd = -1;
+		return 1;
+	}
+
+	// MAP_POPULATE only maps the pages read-only, write them once so that
+	// the profiling loop does not take the write faults
+	memset(run->map, 0, run->map_size);
+	// Keep them resident until the run is committed
+	if (mlock(run->map, run->map_size) != 0 && index == 0) {
+		log_warn("Cannot lock sample buffer %s, errno: %d",
+		         run->filepath,
+		         errno);
+	}
+
+	header = (trace_file_header_t *)run->map;
+	trace_fill_header(run->map, buffer->cl_cnt);
+	header->file_size = run->map_size;
+	header->index_stride = TRACE_INDEX_STRIDE;
+
+	channels = sample_buffer_channels(buffer, run);
+	for (int j = 0; j < buffer->cl_cnt; ++j) {
+		channels[j].tsc_offset = offset;
+		offset += sample_buffer_align(column_size, TRACE_ALIGN);
+		channels[j].lat_offset = offset;
+		offset += sample_buffer_align(column_size, TRACE_ALIGN);
+	}
+	header->index_offset = offset;
+	return 0;
+}
+
+static void sample_buffer_unmap_run(sample_run_t *run) {
+	munmap(run->map, run->map_size);
+	close(run->fd);
+	run->map = NULL;
+	run->fd = -1;
+}
+
+/* Write the sparse index of every column into the reserved room */
+static void sample_buffer_write_index(sample_buffer_t *buffer,
+                                      sample_run_t *run) {
+	trace_file_header_t *header = (trace_file_header_t *)run->map;
+	trace_channel_t *channels = sample_buffer_channels(buffer, run);
+	trace_index_t *index = (trace_index_t *)(run->map + header->index_offset);
+
+	for (int j = 0; j < buffer->cl_cnt; ++j) {
+		trace_build_index((uint64_t *)(run->map + channels[j].tsc_offset),
+		                  run->counts[j],
+		                  TRACE_INDEX_STRIDE,
+		                  index);
+		index += trace_index_count(run->counts[j], TRACE_INDEX_STRIDE);
+	}
+}
+
+/*
+ * Write the event channels after the index. They may run past the mapping
+ * into the rest of the reserved index and beyond, so they go through the
+ * file like the ground truth.
+ */
+static int sample_buffer_write_events(sample_buffer_t *buffer,
+                                      sample_run_t *run) {
+	trace_file_header_t *header = (trace_file_header_t *)run->map;
+	trace_channel_t *channels = sample_buffer_channels(buffer, run);
+	const uint64_t *columns[buffer->cl_cnt];
+	uint64_t total = 0;
+
+	if (buffer->cl_cnt > TRACE_EVENTS_MAX_CHANNELS) {
+		return 0;
+	}
+	for (int j = 0; j < buffer->cl_cnt; ++j) {
+		columns[j] = (const uint64_t *)(run->map + channels[j].tsc_offset);
+		total += run->counts[j];
+	}
+	uint8_t *event_channel = malloc(total + 1);
+	if (event_channel == NULL) {
+		log_error("Cannot allocate %lu trace events", total);
+		return 1;
+	}
+	trace_merge(columns, run->counts, buffer->cl_cnt, event_channel);
+
+	uint64_t offset = trace_events_offset(header, channels);
+	if (pwrite(run->fd, event_channel, total, offset) != (ssize_t)total) {
+		log_error("Error writing trace events to %s", run->filepath);
+		free(event_channel);
+		return 1;
+	}
+	free(event_channel);
+	header->flags |= TRACE_FLAG_EVENTS;
+	if (offset + total > header->file_size) {
+		header->file_size = offset + total;
+	}
+	return 0;
+}
+
+/* Take the ground truth of the run off the ring before the next run starts */
+static int sample_buffer_drain_gt(sample_buffer_t *buffer, sample_run_t *run) {
+	uint64_t count = gt_ring_pending(buffer->gt_ring);
+
+	if (count > run->gt_size) {
+		trace_gt_t *gt = realloc(run->gt, count * sizeof(trace_gt_t));
+		if (gt == NULL) {
+			log_error("Cannot allocate %lu ground truth records", count);
+			return 1;
+		}
+		run->gt = gt;
+		run->gt_size = count;
+	}
+	run->gt_count = gt_ring_drain(buffer->gt_ring, run->gt, count);
+	return 0;
+}
+
+static int sample_buffer_write_gt(sample_run_t *run) {
+	trace_file_header_t *header = (trace_file_header_t *)run->map;
+	uint64_t offset = sample_buffer_align(header->file_size, TRACE_ALIGN);
+
+	// Past the mapping, the file just grows by the records
+	ssize_t size = run->gt_count * sizeof(trace_gt_t);
+	if (pwrite(run->fd, run->gt, size, offset) != size) {
+		log_error("Error writing ground truth to %s", run->filepath);
+		return 1;
+	}
+	header->gt_offset = offset;
+	header->gt_count = run->gt_count;
+	header->file_size = offset + size;
+	return 0;
+}
+
+/* Copy the noise and coverage of the run, the next one refills them */
+static int sample_buffer_snapshot(sample_buffer_t *buffer, sample_run_t *run) {
+	uint64_t count;
+	const trace_noise_t *noise = trace_get_noise(&count);
+	const trace_coverage_t *coverage = trace_get_coverage();
+
+	if (count > run->noise_size) {
+		trace_noise_t *copy =
+		    realloc(run->noise, count * sizeof(trace_noise_t));
+		if (copy == NULL) {
+			log_error("Cannot copy %lu noise events", count);
+			return 1;
+		}
+		run->noise = copy;
+		run->noise_size = count;
+	}
+	if (count > 0) {
+		memcpy(run->noise, noise, count * sizeof(trace_noise_t));
+	}
+	run->noise_count = count;
+	run->has_coverage = coverage != NULL;
+	if (run->has_coverage) {
+		memcpy(run->coverage,
+		       coverage,
+		       buffer->cl_cnt * sizeof(trace_coverage_t));
+	}
+	return 0;
+}
+
+/* Append the noise channel of the run after everything else */
+static int sample_buffer_write_noise(sample_run_t *run) {
+	trace_file_header_t *header = (trace_file_header_t *)run->map;
+	trace_capture_t *capture = (trace_capture_t *)(header + 1);
+	uint64_t offset = sample_buffer_align(header->file_size, TRACE_ALIGN);
+
+	if (run->noise_count == 0) {
+		return 0;
+	}
+	ssize_t size = run->noise_count * sizeof(trace_noise_t);
+	if (pwrite(run->fd, run->noise, size, offset) != size) {
+		log_error("Error writing the noise channel to %s", run->filepath);
+		return 1;
+	}
+	capture->noise_offset = offset;
+	capture->noise_count = run->noise_count;
+	header->file_size = offset + size;
+	return 0;
+}
+
+/* Append the coverage summary of every channel after the noise */
+static int sample_buffer_write_coverage(sample_buffer_t *buffer,
+                                        sample_run_t *run) {
+	trace_file_header_t *header = (trace_file_header_t *)run->map;
+	trace_capture_t *capture = (trace_capture_t *)(header + 1);
+	uint64_t offset = sample_buffer_align(header->file_size, TRACE_ALIGN);
+
+	if (!run->has_coverage) {
+		return 0;
+	}
+	ssize_t size = buffer->cl_cnt * sizeof(trace_coverage_t);
+	if (pwrite(run->fd, run->coverage, size, offset) != size) {
+		log_error("Error writing the coverage to %s", run->filepath);
+		return 1;
+	}
+	header->flags |= TRACE_FLAG_COVERAGE;
+	capture->coverage_offset = offset;
+	header->file_size = offset + size;
+	return 0;
+}
+
+/* Give the unused tail of every column back to the file system */
+static void sample_buffer_punch_tails(sample_buffer_t *buffer,
+                                      sample_run_t *run) {
+	trace_channel_t *channels = sample_buffer_channels(buffer, run);
+	uint64_t column_size = buffer->sp_cnt * sizeof(uint64_t);
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+	for (int j = 0; j < buffer->cl_cnt; ++j) {
+		uint64_t offsets[2] = {
+			channels[j].tsc_offset,
+			channels[j].lat_offset,
+		};
+		for (int k = 0; k < 2; ++k) {
+			uint64_t begin = sample_buffer_align(
+			    offsets[k] + run->counts[j] * sizeof(uint64_t), page_size);
+			uint64_t end = (offsets[k] + column_size) & ~(page_size - 1);
+			if (begin < end &&
+			    fallocate(run->fd,
+			              FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			              begin,
+			              end - begin) != 0) {
+				// The file is complete, the tail just stays allocated
+				log_warn("Cannot release the column tails of %s, errno: %d",
+				         run->filepath,
+				         errno);
+				return;
+			}
+		}
+	}
+}
+
+/* Complete a committed run and unmap it */
+static int sample_buffer_finish_run(sample_buffer_t *buffer,
+                                    sample_run_t *run) {
+	int err = 0;
+
+	sample_buffer_write_index(buffer, run);
+	if (sample_buffer_write_events(buffer, run) ||
+	    (run->gt_count > 0 && sample_buffer_write_gt(run)) ||
+	    sample_buffer_write_noise(run) ||
+	    sample_buffer_write_coverage(buffer, run)) {
+		err = 1;
+	} else {
+		sample_buffer_punch_tails(buffer, run);
+		log_info("Dump trace to %s", run->filepath);
+	}
+	sample_buffer_unmap_run(run);
+	return err;
+}
+
+/*
+ * Finish the run committed last, if any, and map the run after the one
+ * being profiled into its place
+ */
+static void *sample_buffer_thread(void *args) {
+	sample_buffer_t *buffer = (sample_buffer_t *)args;
+
+	if (buffer->pin_cpu != -1) {
+		pin_cpu(buffer->pin_cpu);
+	}
+
+	pthread_mutex_lock(&buffer->mutex);
+	while (1) {
+		while (!buffer->busy && !buffer->stop) {
+			pthread_cond_wait(&buffer->cond, &buffer->mutex);
+		}
+		if (!buffer->busy && buffer->stop) {
+			break;
+		}
+		sample_run_t *run = &buffer->runs[buffer->active ^ 1];
+		int next = buffer->stop ? -1 : buffer->run + 1;
+		pthread_mutex_unlock(&buffer->mutex);
+
+		int err = 0;
+		if (run->map != NULL) {
+			err = sample_buffer_finish_run(buffer, run);
+		}
+		if (!err && next >= 0) {
+			err = sample_buffer_map_run(buffer, run, next);
+		}
+
+		pthread_mutex_lock(&buffer->mutex);
+		buffer->failed |= err;
+		buffer->busy = 0;
+		pthread_cond_broadcast(&buffer->cond);
+	}
+	pthread_mutex_unlock(&buffer->mutex);
+	return NULL;
+}
+
+int sample_buffer_init(sample_buffer_t *buffer,
+                       const char *dirpath,
+                       uint64_t **sample_tsc,
+                       uint64_t **probe_time,
+                       int cl_cnt,
+                       int sp_cnt,
+                       int pin_cpu) {
+	memset(buffer, 0, sizeof(*buffer));
+	snprintf(buffer->dirpath, sizeof(buffer->dirpath), "%s", dirpath);
+	buffer->cl_cnt = cl_cnt;
+	buffer->sp_cnt = sp_cnt;
+	buffer->sample_tsc = sample_tsc;
+	buffer->probe_time = probe_time;
+	buffer->pin_cpu = pin_cpu;
+
+	for (int k = 0; k < 2; ++k) {
+		sample_run_t *run = &buffer->runs[k];
+		run->fd = -1;
+		run->counts = calloc(cl_cnt, sizeof(uint64_t));
+		run->coverage = calloc(cl_cnt, sizeof(trace_coverage_t));
+		if (run->counts == NULL || run->coverage == NULL) {
+			log_error("Cannot allocate the sample buffer runs");
+			return 1;
+		}
+	}
+	if (create_directory(dirpath)) {
+		return 1;
+	}
+	if (live_trace_enabled()) {
+		buffer->live = live_trace_create(dirpath, cl_cnt);
+		if (buffer->live == NULL) {
+			return 1;
+		}
+	}
+	if (sample_buffer_map_run(buffer, &buffer->runs[0], 0)) {
+		return 1;
+	}
+	sample_buffer_point(buffer, &buffer->runs[0]);
+
+	pthread_mutex_init(&buffer->mutex, NULL);
+	pthread_cond_init(&buffer->cond, NULL);
+	// Run 1 is mapped while run 0 is profiled
+	buffer->busy = 1;
+	int err = pthread_create(
+	    &buffer->thread, NULL, sample_buffer_thread, (void *)buffer);
+	if (err != 0) {
+		log_error("can't create sample buffer thread :[%s]", strerror(err));
+		sample_buffer_unmap_run(&buffer->runs[0]);
+		return 1;
+	}
+	live_trace_begin_run(buffer->live, buffer->run);
+	return 0;
+}
+
+int sample_buffer_commit(sample_buffer_t *buffer,
+                         const uint64_t *sample_count,
+                         int sp_cnt) {
+	sample_run_t *run = &buffer->runs[buffer->active];
+	trace_channel_t *channels = sample_buffer_channels(buffer, run);
+
+	trace_sample_counts(buffer->sample_tsc,
+	                    sample_count,
+	                    buffer->cl_cnt,
+	                    sp_cnt < buffer->sp_cnt ? sp_cnt : buffer->sp_cnt,
+	                    run->counts);
+	// The attacker threads may have filled in the capture after the run
+	// was mapped
+	trace_fill_header(run->map, buffer->cl_cnt);
+	for (int j = 0; j < buffer->cl_cnt; ++j) {
+		channels[j].sample_count = run->counts[j];
+	}
+	run->gt_count = 0;
+	if (buffer->gt_ring != NULL && sample_buffer_drain_gt(buffer, run)) {
+		return 1;
+	}
+	if (sample_buffer_snapshot(buffer, run)) {
+		return 1;
+	}
+	if (msync(run->map, run->map_size, MS_ASYNC) != 0) {
+		log_error("Error syncing sample buffer %s", run->filepath);
+	}
+
+	buffer->aborted = live_trace_aborted(buffer->live);
+	if (buffer->aborted) {
+		log_warn("Live trace aborted after run %d", buffer->run);
+	}
+
+	pthread_mutex_lock(&buffer->mutex);
+	if (buffer->busy) {
+		log_warn("Sample buffer is behind, profiler waits for run %d",
+		         buffer->run + 1);
+	}
+	while (buffer->busy) {
+		pthread_cond_wait(&buffer->cond, &buffer->mutex);
+	}
+	if (buffer->failed) {
+		pthread_mutex_unlock(&buffer->mutex);
+		return 1;
+	}
+	buffer->active ^= 1;
+	buffer->run++;
+	buffer->busy = 1;
+	sample_buffer_point(buffer, &buffer->runs[buffer->active]);
+	pthread_cond_broadcast(&buffer->cond);
+	pthread_mutex_unlock(&buffer->mutex);
+
+	live_trace_begin_run(buffer->live, buffer->run);
+	return 0;
+}
+
+void sample_buffer_destroy(sample_buffer_t *buffer) {
+	live_trace_close(buffer->live);
+	buffer->live = NULL;
+	if (buffer->runs[buffer->active].map != NULL) {
+		pthread_mutex_lock(&buffer->mutex);
+		buffer->stop = 1;
+		pthread_cond_broadcast(&buffer->cond);
+		pthread_mutex_unlock(&buffer->mutex);
+
+		pthread_join(buffer->thread, NULL);
+		pthread_mutex_destroy(&buffer->mutex);
+		pthread_cond_destroy(&buffer->cond);
+	}
+	for (int k = 0; k < 2; ++k) {
+		sample_run_t *run = &buffer->runs[k];
+		if (run->map != NULL) {
+			sample_buffer_unmap_run(run);
+			unlink(run->filepath);
+		}
+		free(run->counts);
+		free(run->gt);
+		free(run->noise);
+		free(run->coverage);
+	}
+}
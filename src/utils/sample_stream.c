@@ -0,0 +1,331 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "sample_stream.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arch.h"
+#include "color_alloc.h"
+#include "fs.h"
+#include "log.h"
+#include "trace.h"
+
+_Static_assert(sizeof(sample_ring_t) == 192, "sample ring size");
+
+// Records spooled per fwrite()
+#define SAMPLE_SPOOL_BATCH (512)
+
+int sample_stream_enabled(void) {
+	const char *env_stream = getenv("TRACE_STREAM");
+	return env_stream != NULL && strlen(env_stream) > 0 &&
+	       strcmp(env_stream, "0") != 0;
+}
+
+static int sample_spool_open(sample_stream_t *stream, sample_spool_t *spool) {
+	for (int k = 0; k < 2; ++k) {
+		char filepath[512];
+		snprintf(filepath,
+		         sizeof(filepath),
+		         "%s/.spoolXXXXXX",
+		         stream->dirpath);
+		spool->fd[k] = mkstemp(filepath);
+		if (spool->fd[k] < 0) {
+			log_error("Error creating stream spool in %s", stream->dirpath);
+			return 1;
+		}
+		// Only the stream keeps the spool files
+		unlink(filepath);
+		spool->fp[k] = fdopen(spool->fd[k], "w+");
+		if (spool->fp[k] == NULL) {
+			log_error("Error opening stream spool in %s", stream->dirpath);
+			close(spool->fd[k]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void sample_spool_close(sample_spool_t *spool) {
+	for (int k = 0; k < 2; ++k) {
+		if (spool->fp[k] != NULL) {
+			fclose(spool->fp[k]);
+			spool->fp[k] = NULL;
+		}
+	}
+}
+
+static int sample_spool_sink(void *arg,
+                             int channel,
+                             const sample_record_t *records,
+                             size_t count) {
+	sample_stream_t *stream = (sample_stream_t *)arg;
+	sample_spool_t *spool = &stream->spools[channel];
+	uint64_t columns[2][SAMPLE_SPOOL_BATCH];
+
+	for (size_t i = 0; i < count; i += SAMPLE_SPOOL_BATCH) {
+		size_t n = count - i < SAMPLE_SPOOL_BATCH ? count - i
+		                                          : SAMPLE_SPOOL_BATCH;
+		for (size_t j = 0; j < n; ++j) {
+			columns[0][j] = records[i + j].tsc;
+			columns[1][j] = records[i + j].latency;
+		}
+		for (int k = 0; k < 2; ++k) {
+			if (fwrite(columns[k], sizeof(uint64_t), n, spool->fp[k]) != n) {
+				log_error("Error spooling channel %d", channel);
+				return 1;
+			}
+		}
+		spool->count += n;
+	}
+	return 0;
+}
+
+/* Hand everything the producers published to the sink, 0 if there was none */
+static size_t sample_stream_drain(sample_stream_t *stream) {
+	size_t drained = 0;
+
+	for (int j = 0; j < stream->cl_cnt; ++j) {
+		sample_ring_t *ring = &stream->rings[j];
+		uint64_t tail = ring->tail;
+
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (tail != ring->head_cache) {
+			// Up to the end of the records, the rest on the next pass
+			uint64_t begin = tail & ring->mask;
+			uint64_t count = ring->head_cache - tail;
+			if (count > ring->mask + 1 - begin) {
+				count = ring->mask + 1 - begin;
+			}
+			const sample_record_t *records = &ring->records[begin];
+			if (!stream->failed &&
+			    stream->sink(stream->sink_arg, j, records, count)) {
+				stream->failed = 1;
+			}
+			tail += count;
+			drained += count;
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+	return drained;
+}
+
+static void *sample_stream_thread(void *args) {
+	sample_stream_t *stream = (sample_stream_t *)args;
+	struct timespec idle = { 0, 20000 };
+
+	if (stream->pin_cpu != -1) {
+		pin_cpu(stream->pin_cpu);
+	}
+	while (!__atomic_load_n(&stream->stop, __ATOMIC_ACQUIRE)) {
+		if (sample_stream_drain(stream) == 0) {
+			nanosleep(&idle, NULL);
+		}
+	}
+	sample_stream_drain(stream);
+	return NULL;
+}
+
+int sample_stream_init(sample_stream_t *stream,
+                       const char *dirpath,
+                       int cl_cnt,
+                       uint64_t ring_size,
+                       int pin_cpu,
+                       sample_sink_t sink,
+                       void *sink_arg) {
+	if (ring_size == 0 || (ring_size & (ring_size - 1)) != 0) {
+		log_error("Stream ring size %lu is not a power of 2", ring_size);
+		return 1;
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	snprintf(stream->dirpath, sizeof(stream->dirpath), "%s", dirpath);
+	stream->cl_cnt = cl_cnt;
+	stream->pin_cpu = pin_cpu;
+	stream->sink = sink;
+	stream->sink_arg = sink_arg;
+
+	if (create_directory(dirpath)) {
+		return 1;
+	}
+	if (sink == NULL) {
+		stream->sink = sample_spool_sink;
+		stream->sink_arg = stream;
+		stream->spools = calloc(cl_cnt, sizeof(sample_spool_t));
+		if (stream->spools == NULL) {
+			log_error("Cannot allocate stream spools");
+			return 1;
+		}
+		for (int j = 0; j < cl_cnt; ++j) {
+			if (sample_spool_open(stream, &stream->spools[j])) {
+				sample_stream_destroy(stream);
+				return 1;
+			}
+		}
+	}
+
+	if (color_arena_get() != NULL) {
+		stream->rings =
+		    color_alloc(color_arena_get(), cl_cnt * sizeof(sample_ring_t), 64);
+		stream->rings_colored = stream->rings != NULL;
+	}
+	if (stream->rings == NULL) {
+		stream->rings = aligned_alloc(64, cl_cnt * sizeof(sample_ring_t));
+	}
+	if (stream->rings == NULL) {
+		log_error("Cannot allocate stream rings");
+		sample_stream_destroy(stream);
+		return 1;
+	}
+	memset(stream->rings, 0, cl_cnt * sizeof(sample_ring_t));
+	for (int j = 0; j < cl_cnt; ++j) {
+		sample_ring_t *ring = &stream->rings[j];
+		ring->mask = ring_size - 1;
+		ring->records = aligned_alloc(64, ring_size * sizeof(sample_record_t));
+		if (ring->records == NULL) {
+			log_error("Cannot allocate stream ring %d", j);
+			sample_stream_destroy(stream);
+			return 1;
+		}
+		// Fault the ring in now, not in the profiling window
+		memset(ring->records, 0, ring_size * sizeof(sample_record_t));
+	}
+
+	int err = pthread_create(
+	    &stream->thread, NULL, sample_stream_thread, (void *)stream);
+	if (err != 0) {
+		log_error("can't create stream consumer thread :[%s]", strerror(err));
+		stream->thread = 0;
+		sample_stream_destroy(stream);
+		return 1;
+	}
+	return 0;
+}
+
+/* Write the spooled run to <dirpath>/rN.out and empty the spools */
+static int sample_stream_write_run(sample_stream_t *stream) {
+	int cl_cnt = stream->cl_cnt;
+	uint64_t *sample_tsc[cl_cnt], *latency[cl_cnt], counts[cl_cnt];
+	size_t map_size[cl_cnt];
+	uint64_t sp_cnt = 0, empty = 0;
+	char filepath[512];
+	int err = 0;
+
+	for (int j = 0; j < cl_cnt; ++j) {
+		sample_spool_t *spool = &stream->spools[j];
+		counts[j] = spool->count;
+		map_size[j] = counts[j] * sizeof(uint64_t);
+		sample_tsc[j] = latency[j] = &empty;
+		if (counts[j] > sp_cnt) {
+			sp_cnt = counts[j];
+		}
+		if (counts[j] == 0) {
+			continue;
+		}
+		uint64_t *columns[2];
+		for (int k = 0; k < 2; ++k) {
+			fflush(spool->fp[k]);
+			columns[k] = mmap(NULL,
+			                  map_size[j],
+			                  PROT_READ,
+			                  MAP_SHARED,
+			                  spool->fd[k],
+			                  0);
+			if (columns[k] == MAP_FAILED) {
+				log_error("Error mapping the spool of channel %d", j);
+				columns[k] = &empty;
+				counts[j] = 0;
+				err = 1;
+			}
+		}
+		sample_tsc[j] = columns[0];
+		latency[j] = columns[1];
+	}
+
+	snprintf(
+	    filepath, sizeof(filepath), "%s/r%d.out", stream->dirpath, stream->run);
+	if (!err) {
+		err = trace_write(
+		    filepath, sample_tsc, latency, counts, cl_cnt, (int)sp_cnt);
+	}
+
+	for (int j = 0; j < cl_cnt; ++j) {
+		sample_spool_t *spool = &stream->spools[j];
+		if (sample_tsc[j] != &empty) {
+			munmap(sample_tsc[j], map_size[j]);
+		}
+		if (latency[j] != &empty) {
+			munmap(latency[j], map_size[j]);
+		}
+		for (int k = 0; k < 2; ++k) {
+			rewind(spool->fp[k]);
+			if (ftruncate(spool->fd[k], 0) != 0) {
+				log_error("Error truncating the spool of channel %d", j);
+				err = 1;
+			}
+		}
+		spool->count = 0;
+	}
+	if (!err) {
+		log_info("Dump trace to %s", filepath);
+	}
+	return err;
+}
+
+int sample_stream_commit(sample_stream_t *stream) {
+	struct timespec idle = { 0, 20000 };
+
+	for (int j = 0; j < stream->cl_cnt; ++j) {
+		sample_ring_t *ring = &stream->rings[j];
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != head) {
+			nanosleep(&idle, NULL);
+		}
+		if (ring->dropped > 0) {
+			log_warn("Stream channel %d dropped %lu samples in run %d",
+			         j,
+			         ring->dropped,
+			         stream->run);
+			ring->dropped = 0;
+		}
+	}
+	if (stream->failed) {
+		log_error("Stream sink failed in run %d", stream->run);
+		return 1;
+	}
+	if (stream->spools != NULL && sample_stream_write_run(stream)) {
+		return 1;
+	}
+	stream->run++;
+	return 0;
+}
+
+void sample_stream_destroy(sample_stream_t *stream) {
+	if (stream->thread != 0) {
+		__atomic_store_n(&stream->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(stream->thread, NULL);
+		stream->thread = 0;
+	}
+	if (stream->rings != NULL) {
+		for (int j = 0; j < stream->cl_cnt; ++j) {
+			free(stream->rings[j].records);
+		}
+		// Arena memory goes with the arena
+		if (!stream->rings_colored) {
+			free(stream->rings);
+		}
+		stream->rings = NULL;
+	}
+	if (stream->spools != NULL) {
+		for (int j = 0; j < stream->cl_cnt; ++j) {
+			sample_spool_close(&stream->spools[j]);
+		}
+		free(stream->spools);
+		stream->spools = NULL;
+	}
+}
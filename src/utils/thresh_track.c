@@ -0,0 +1,132 @@
+#include "thresh_track.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+// Isodata iterations before the split is taken as it is
+#define THRESH_TRACK_ITERATIONS (16)
+
+int thresh_track_enabled(void) {
+	const char *env_thresh = getenv("THRESH_TRACK");
+	return env_thresh != NULL && strlen(env_thresh) > 0 &&
+	       strcmp(env_thresh, "0") != 0;
+}
+
+void thresh_track_init(thresh_track_t *track, int slot, int32_t threshold) {
+	memset(track, 0, sizeof(*track));
+	track->slot = slot;
+	thresh_track_seed(track, threshold);
+}
+
+void thresh_track_seed(thresh_track_t *track, int32_t threshold) {
+	memset(track->hist, 0, sizeof(track->hist));
+	track->threshold = threshold;
+	track->level = threshold;
+}
+
+/* Probes, mean and variance in cycles of the bins [begin, end) */
+static uint64_t thresh_track_mode(const thresh_track_t *track,
+                                  uint32_t begin,
+                                  uint32_t end,
+                                  double *mean,
+                                  double *var) {
+	uint64_t n = 0;
+	double sum = 0, sum2 = 0;
+
+	for (uint32_t b = begin; b < end; ++b) {
+		double lat = (b + 0.5) * THRESH_TRACK_BIN_CYCLES;
+		n += track->hist[b];
+		sum += lat * track->hist[b];
+		sum2 += lat * lat * track->hist[b];
+	}
+	*mean = n ? sum / n : 0;
+	*var = n ? sum2 / n - *mean * *mean : 0;
+	return n;
+}
+
+thresh_track_status_t thresh_track_update(thresh_track_t *track) {
+	// The last bin holds interrupts and everything else out of range
+	const uint32_t bins = THRESH_TRACK_BINS - 1;
+	double split = track->level, hit_var = 0, miss_var = 0;
+	uint64_t hits = 0, misses = 0;
+	thresh_track_status_t status = THRESH_TRACK_KEPT;
+	int restarted = 0;
+
+	for (int i = 0; i < THRESH_TRACK_ITERATIONS; ++i) {
+		uint32_t bin = split < 0 ? 0 : split / THRESH_TRACK_BIN_CYCLES;
+		if (bin > bins) {
+			bin = bins;
+		}
+		hits = thresh_track_mode(track, 0, bin, &track->hit_mean, &hit_var);
+		misses =
+		    thresh_track_mode(track, bin, bins, &track->miss_mean, &miss_var);
+		if (hits == 0 || misses == 0) {
+			// Drifted past a mode, start over from the middle of the range
+			if (restarted || hits + misses == 0) {
+				break;
+			}
+			uint32_t lo = 0, hi = bins - 1;
+			while (track->hist[lo] == 0) {
+				lo++;
+			}
+			while (track->hist[hi] == 0) {
+				hi--;
+			}
+			split = (lo + hi + 1) * THRESH_TRACK_BIN_CYCLES / 2.0;
+			restarted = 1;
+			continue;
+		}
+		double next = (track->hit_mean + track->miss_mean) / 2;
+		if (fabs(next - split) < THRESH_TRACK_BIN_CYCLES) {
+			break;
+		}
+		split = next;
+	}
+
+	memset(track->hist, 0, sizeof(track->hist));
+	if (hits < THRESH_TRACK_MIN_PROBES || misses < THRESH_TRACK_MIN_PROBES) {
+		log_debug("Slot %d threshold %d kept, %lu hit and %lu miss probes",
+		          track->slot,
+		          track->threshold,
+		          hits,
+		          misses);
+		track->strikes = 0;
+		return THRESH_TRACK_KEPT;
+	}
+
+	double spread = sqrt((hit_var + miss_var) / 2);
+	track->separation =
+	    spread > 0 ? (track->miss_mean - track->hit_mean) / spread : INFINITY;
+	if (track->separation < THRESH_TRACK_MIN_SEPARATION) {
+		track->strikes++;
+		log_warn("Slot %d hit and miss latencies overlap: means %.0f and "
+		         "%.0f cycles, separation %.2f, strike %u",
+		         track->slot,
+		         track->hit_mean,
+		         track->miss_mean,
+		         track->separation,
+		         track->strikes);
+		return THRESH_TRACK_INSEPARABLE;
+	}
+	track->strikes = 0;
+
+	track->level += THRESH_TRACK_ALPHA * (split - track->level);
+	int32_t threshold = lround(track->level);
+	if (threshold != track->threshold) {
+		log_info("Slot %d threshold %d -> %d: means %.0f and %.0f cycles, "
+		         "separation %.2f",
+		         track->slot,
+		         track->threshold,
+		         threshold,
+		         track->hit_mean,
+		         track->miss_mean,
+		         track->separation);
+		track->threshold = threshold;
+		track->adjustments++;
+		status = THRESH_TRACK_ADJUSTED;
+	}
+	return status;
+}
@@ -0,0 +1,885 @@
+#include "trace.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+_Static_assert(sizeof(trace_file_header_t) == 64, "trace header size");
+_Static_assert(sizeof(trace_capture_t) == 128, "trace capture size");
+_Static_assert(sizeof(trace_capture_channel_t) == 16,
+               "trace capture channel size");
+_Static_assert(sizeof(trace_channel_t) == 32, "trace channel size");
+_Static_assert(sizeof(trace_index_t) == 16, "trace index size");
+_Static_assert(sizeof(trace_block_t) == 16, "trace block size");
+_Static_assert(sizeof(trace_noise_t) == 24, "trace noise size");
+_Static_assert(sizeof(trace_coverage_t) == 192, "trace coverage size");
+
+static int trace_format = -1;
+static trace_format_t trace_default_format = TRACE_FORMAT_BINARY;
+
+trace_format_t trace_get_format(void) {
+	if (trace_format == -1) {
+		const char *env_format = getenv("TRACE_FORMAT");
+		trace_format = trace_default_format;
+		if (env_format == NULL || strlen(env_format) == 0) {
+			return trace_format;
+		}
+		if (strcmp(env_format, "text") == 0) {
+			trace_format = TRACE_FORMAT_TEXT;
+		} else if (strcmp(env_format, "binary") == 0) {
+			trace_format = TRACE_FORMAT_BINARY;
+		} else if (strcmp(env_format, "packed") == 0) {
+			trace_format = TRACE_FORMAT_PACKED;
+		} else if (strcmp(env_format, "records") == 0) {
+			trace_format = TRACE_FORMAT_RECORDS;
+		} else {
+			log_warn("Unknown TRACE_FORMAT %s", env_format);
+		}
+	}
+	return trace_format;
+}
+
+void trace_set_format(trace_format_t format) {
+	trace_format = format;
+}
+
+void trace_set_default_format(trace_format_t format) {
+	trace_default_format = format;
+	trace_format = -1;
+}
+
+static trace_capture_t trace_capture;
+
+static const trace_capture_channel_t trace_capture_unknown = {
+	.l3_set = -1,
+	.core = TRACE_CAPTURE_UNKNOWN,
+	.node = TRACE_CAPTURE_UNKNOWN,
+};
+
+static trace_capture_channel_t trace_capture_channels[] = {
+	[0 ... TRACE_CAPTURE_MAX_CHANNELS - 1] = {
+		.l3_set = -1,
+		.core = TRACE_CAPTURE_UNKNOWN,
+		.node = TRACE_CAPTURE_UNKNOWN,
+	},
+};
+
+trace_capture_t *trace_get_capture(void) {
+	return &trace_capture;
+}
+
+trace_capture_channel_t *trace_get_capture_channel(int channel) {
+	if (channel < 0 || channel >= TRACE_CAPTURE_MAX_CHANNELS) {
+		return NULL;
+	}
+	return &trace_capture_channels[channel];
+}
+
+void trace_copy_capture(trace_capture_t *capture,
+                        trace_capture_channel_t *channels,
+                        int cl_cnt) {
+	*capture = trace_capture;
+	for (int j = 0; j < cl_cnt; ++j) {
+		channels[j] = j < TRACE_CAPTURE_MAX_CHANNELS ? trace_capture_channels[j]
+		                                             : trace_capture_unknown;
+	}
+}
+
+// Per thread, the trace writer thread dumps other runs than the profilers
+static __thread const trace_capture_t *trace_capture_copy;
+static __thread const trace_capture_channel_t *trace_channels_copy;
+
+void trace_set_capture(const trace_capture_t *capture,
+                       const trace_capture_channel_t *channels) {
+	trace_capture_copy = capture;
+	trace_channels_copy = capture != NULL ? channels : NULL;
+}
+
+static __thread const trace_noise_t *trace_noise;
+static __thread uint64_t trace_noise_count;
+
+void trace_set_noise(const trace_noise_t *noise, uint64_t count) {
+	trace_noise = noise;
+	trace_noise_count = noise != NULL ? count : 0;
+}
+
+const trace_noise_t *trace_get_noise(uint64_t *count) {
+	*count = trace_noise_count;
+	return trace_noise;
+}
+
+static __thread const trace_coverage_t *trace_coverage;
+
+int trace_coverage_enabled(void) {
+	const char *env_coverage = getenv("TRACE_COVERAGE");
+	return env_coverage != NULL && strlen(env_coverage) > 0 &&
+	       strcmp(env_coverage, "0") != 0;
+}
+
+void trace_set_coverage(const trace_coverage_t *coverage) {
+	trace_coverage = coverage;
+}
+
+const trace_coverage_t *trace_get_coverage(void) {
+	return trace_coverage;
+}
+
+uint64_t trace_header_size(int cl_cnt) {
+	return sizeof(trace_file_header_t) + sizeof(trace_capture_t) +
+	       cl_cnt * sizeof(trace_capture_channel_t);
+}
+
+void trace_fill_header(uint8_t *header, int cl_cnt) {
+	trace_file_header_t *file_header = (trace_file_header_t *)header;
+	trace_capture_channel_t *channels = (trace_capture_channel_t *)(
+	    header + sizeof(trace_file_header_t) + sizeof(trace_capture_t));
+
+	memcpy(file_header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	file_header->version = TRACE_VERSION;
+	file_header->header_size = trace_header_size(cl_cnt);
+	file_header->channel_count = cl_cnt;
+	if (trace_capture_copy != NULL) {
+		memcpy(header + sizeof(trace_file_header_t),
+		       trace_capture_copy,
+		       sizeof(trace_capture_t));
+		memcpy(channels,
+		       trace_channels_copy,
+		       cl_cnt * sizeof(trace_capture_channel_t));
+		return;
+	}
+	trace_copy_capture(
+	    (trace_capture_t *)(header + sizeof(trace_file_header_t)),
+	    channels,
+	    cl_cnt);
+}
+
+static uint64_t trace_align(uint64_t offset) {
+	return (offset + TRACE_ALIGN - 1) & ~(uint64_t)(TRACE_ALIGN - 1);
+}
+
+void trace_sample_counts(uint64_t **sample_tsc,
+                         const uint64_t *sample_count,
+                         int cl_cnt,
+                         int sp_cnt,
+                         uint64_t *counts) {
+	for (int j = 0; j < cl_cnt; ++j) {
+		if (sample_count != NULL) {
+			counts[j] = sample_count[j] < (uint64_t)sp_cnt ? sample_count[j]
+			                                               : (uint64_t)sp_cnt;
+			continue;
+		}
+		counts[j] = 0;
+		while (counts[j] < (uint64_t)sp_cnt && sample_tsc[j][counts[j]] > 0) {
+			counts[j]++;
+		}
+	}
+}
+
+uint64_t trace_index_count(uint64_t sample_count, uint32_t index_stride) {
+	return (sample_count + index_stride - 1) / index_stride;
+}
+
+void trace_build_index(const uint64_t *sample_tsc,
+                       uint64_t sample_count,
+                       uint32_t index_stride,
+                       trace_index_t *index) {
+	for (uint64_t i = 0; i < sample_count; i += index_stride) {
+		index->tsc = sample_tsc[i];
+		index->sample = i;
+		index++;
+	}
+}
+
+/* Loser tree order: the lower tsc first, then the lower channel */
+static inline int
+trace_merge_before(const uint64_t *key, uint32_t a, uint32_t b) {
+	return key[a] < key[b] || (key[a] == key[b] && a < b);
+}
+
+void trace_merge(const uint64_t *const *sample_tsc,
+                 const uint64_t *counts,
+                 int cl_cnt,
+                 uint8_t *event_channel) {
+	uint32_t leaves = 1;
+	uint64_t total = 0;
+
+	while (leaves < (uint32_t)cl_cnt) {
+		leaves <<= 1;
+	}
+	uint32_t tree[leaves], winners[2 * leaves];
+	uint64_t key[leaves], next[leaves];
+
+	// Exhausted and padding leaves hold UINT64_MAX, behind any real tsc
+	for (uint32_t j = 0; j < leaves; ++j) {
+		uint64_t count = j < (uint32_t)cl_cnt ? counts[j] : 0;
+		key[j] = count > 0 ? sample_tsc[j][0] : UINT64_MAX;
+		next[j] = 0;
+		winners[leaves + j] = j;
+		total += count;
+	}
+	for (uint32_t n = leaves - 1; n > 0; --n) {
+		uint32_t a = winners[2 * n], b = winners[2 * n + 1];
+		int a_first = trace_merge_before(key, a, b);
+		winners[n] = a_first ? a : b;
+		tree[n] = a_first ? b : a;
+	}
+
+	uint32_t winner = winners[1];
+	for (uint64_t i = 0; i < total; ++i) {
+		event_channel[i] = winner;
+		uint64_t pos = ++next[winner];
+		key[winner] = pos < counts[winner] ? sample_tsc[winner][pos]
+		                                   : UINT64_MAX;
+		// Replay the path to the root against the losers stored on it
+		for (uint32_t n = (winner + leaves) >> 1; n > 0; n >>= 1) {
+			if (trace_merge_before(key, tree[n], winner)) {
+				uint32_t loser = winner;
+				winner = tree[n];
+				tree[n] = loser;
+			}
+		}
+	}
+}
+
+uint64_t trace_events_offset(const trace_file_header_t *header,
+                             const trace_channel_t *channels) {
+	uint64_t offset = header->index_offset;
+
+	for (uint32_t j = 0; j < header->channel_count && header->index_stride;
+	     ++j) {
+		offset += trace_index_count(channels[j].sample_count,
+		                            header->index_stride) *
+		          sizeof(trace_index_t);
+	}
+	return trace_align(offset);
+}
+
+/* Pad fp to the next TRACE_ALIGN boundary after start */
+static int trace_fwrite_align(FILE *fp, long start) {
+	static const uint8_t zero_pad[TRACE_ALIGN] = { 0 };
+	long offset = ftell(fp) - start;
+	size_t pad = trace_align(offset) - offset;
+
+	return offset < 0 || fwrite(zero_pad, 1, pad, fp) != pad;
+}
+
+/*
+ * Place the noise and coverage of the calling thread after the size bytes
+ * of a trace, returns the new size
+ */
+static uint64_t trace_place_tail(trace_file_header_t *header, uint64_t size) {
+	trace_capture_t *capture = (trace_capture_t *)(header + 1);
+
+	if (trace_noise_count > 0) {
+		capture->noise_offset = trace_align(size);
+		capture->noise_count = trace_noise_count;
+		size = capture->noise_offset +
+		       trace_noise_count * sizeof(trace_noise_t);
+	}
+	if (trace_coverage != NULL) {
+		header->flags |= TRACE_FLAG_COVERAGE;
+		capture->coverage_offset = trace_align(size);
+		size = capture->coverage_offset +
+		       header->channel_count * sizeof(trace_coverage_t);
+	}
+	return size;
+}
+
+/* Write the placed noise and coverage, the trace is size bytes so far */
+static int trace_fwrite_tail(FILE *fp,
+                             const trace_file_header_t *header,
+                             uint64_t size) {
+	static const uint8_t zero_pad[TRACE_ALIGN] = { 0 };
+	const trace_capture_t *capture = (const trace_capture_t *)(header + 1);
+	uint64_t count = capture->noise_count;
+	size_t pad;
+
+	if (count > 0) {
+		pad = capture->noise_offset - size;
+		if (fwrite(zero_pad, 1, pad, fp) != pad ||
+		    fwrite(trace_noise, sizeof(trace_noise_t), count, fp) != count) {
+			return 1;
+		}
+		size = capture->noise_offset + count * sizeof(trace_noise_t);
+	}
+	if (header->flags & TRACE_FLAG_COVERAGE) {
+		count = header->channel_count;
+		pad = capture->coverage_offset - size;
+		if (fwrite(zero_pad, 1, pad, fp) != pad ||
+		    fwrite(trace_coverage, sizeof(trace_coverage_t), count, fp) !=
+		        count) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int trace_fwrite_index(FILE *fp,
+                              uint64_t **sample_tsc,
+                              const uint64_t *counts,
+                              int cl_cnt) {
+	for (int j = 0; j < cl_cnt; ++j) {
+		for (uint64_t i = 0; i < counts[j]; i += TRACE_INDEX_STRIDE) {
+			trace_index_t index = { sample_tsc[j][i], i };
+			if (fwrite(&index, sizeof(index), 1, fp) != 1) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int trace_fwrite_events(FILE *fp,
+                               uint64_t **sample_tsc,
+                               const uint64_t *counts,
+                               int cl_cnt) {
+	uint64_t total = 0;
+	for (int j = 0; j < cl_cnt; ++j) {
+		total += counts[j];
+	}
+	uint8_t *event_channel = malloc(total + 1);
+	if (event_channel == NULL) {
+		log_error("Cannot allocate %lu trace events", total);
+		return 1;
+	}
+	trace_merge(
+	    (const uint64_t *const *)sample_tsc, counts, cl_cnt, event_channel);
+	int ret = fwrite(event_channel, 1, total, fp) != total;
+	free(event_channel);
+	return ret;
+}
+
+static int trace_fwrite_text(FILE *fp,
+                             uint64_t **sample_tsc,
+                             uint64_t **latency,
+                             const uint64_t *counts,
+                             int cl_cnt) {
+	uint64_t rows = 0;
+	for (int j = 0; j < cl_cnt; ++j) {
+		rows = counts[j] > rows ? counts[j] : rows;
+	}
+
+	// The text format stays row aligned, shorter channels are padded with
+	// 0:0 and the trace ends with an all-zero row
+	for (uint64_t i = 0; i <= rows; ++i) {
+		for (int j = 0; j < cl_cnt; ++j) {
+			if (i < counts[j]) {
+				fprintf(fp, "%lu:%lu\t", sample_tsc[j][i], latency[j][i]);
+			} else {
+				fprintf(fp, "0:0\t");
+			}
+		}
+		fprintf(fp, "\n");
+	}
+	return ferror(fp) != 0;
+}
+
+static int trace_fwrite_binary(FILE *fp,
+                               uint64_t **sample_tsc,
+                               uint64_t **latency,
+                               const uint64_t *counts,
+                               int cl_cnt) {
+	static const uint8_t zero_pad[TRACE_ALIGN] = { 0 };
+	uint64_t head[trace_header_size(cl_cnt) / sizeof(uint64_t)];
+	trace_file_header_t *header = (trace_file_header_t *)head;
+	trace_channel_t channels[cl_cnt];
+	uint64_t offset = sizeof(head) + sizeof(channels);
+
+	memset(head, 0, sizeof(head));
+	memset(channels, 0, sizeof(channels));
+	for (int j = 0; j < cl_cnt; ++j) {
+		channels[j].sample_count = counts[j];
+		channels[j].tsc_offset = offset = trace_align(offset);
+		offset += counts[j] * sizeof(uint64_t);
+		channels[j].lat_offset = offset;
+		offset += counts[j] * sizeof(uint64_t);
+	}
+
+	trace_fill_header((uint8_t *)head, cl_cnt);
+	header->index_offset = offset = trace_align(offset);
+	header->index_stride = TRACE_INDEX_STRIDE;
+	for (int j = 0; j < cl_cnt; ++j) {
+		offset += trace_index_count(counts[j], TRACE_INDEX_STRIDE) *
+		          sizeof(trace_index_t);
+	}
+	uint64_t index_end = offset;
+	if (cl_cnt <= TRACE_EVENTS_MAX_CHANNELS) {
+		header->flags |= TRACE_FLAG_EVENTS;
+		offset = trace_events_offset(header, channels);
+		for (int j = 0; j < cl_cnt; ++j) {
+			offset += counts[j];
+		}
+	}
+	uint64_t events_end = offset;
+	header->file_size = trace_place_tail(header, offset);
+
+	int ret = fwrite(head, sizeof(head), 1, fp) != 1 ||
+	          fwrite(channels, sizeof(channels), 1, fp) != 1;
+	offset = sizeof(head) + sizeof(channels);
+	for (int j = 0; j < cl_cnt && !ret; ++j) {
+		uint64_t rows = counts[j];
+		size_t pad = channels[j].tsc_offset - offset;
+		ret = fwrite(zero_pad, 1, pad, fp) != pad ||
+		      fwrite(sample_tsc[j], sizeof(uint64_t), rows, fp) != rows ||
+		      fwrite(latency[j], sizeof(uint64_t), rows, fp) != rows;
+		offset = channels[j].lat_offset + rows * sizeof(uint64_t);
+	}
+	size_t pad = header->index_offset - offset;
+	ret = ret || fwrite(zero_pad, 1, pad, fp) != pad ||
+	      trace_fwrite_index(fp, sample_tsc, counts, cl_cnt);
+	if (header->flags & TRACE_FLAG_EVENTS) {
+		pad = trace_events_offset(header, channels) - index_end;
+		ret = ret || fwrite(zero_pad, 1, pad, fp) != pad ||
+		      trace_fwrite_events(fp, sample_tsc, counts, cl_cnt);
+	}
+	return ret || trace_fwrite_tail(fp, header, events_end);
+}
+
+static int trace_fwrite_packed(FILE *fp,
+                               uint64_t **sample_tsc,
+                               uint64_t **latency,
+                               const uint64_t *counts,
+                               int cl_cnt);
+
+void trace_expand_records(const trace_record_t *records,
+                          uint64_t count,
+                          uint64_t tsc_base,
+                          uint64_t *sample_tsc,
+                          uint64_t *latency) {
+	for (uint64_t i = 0; i < count; ++i) {
+		if (sample_tsc != NULL) {
+			sample_tsc[i] = trace_record_tsc(records[i], tsc_base);
+		}
+		if (latency != NULL) {
+			latency[i] = trace_record_latency(records[i]);
+		}
+	}
+}
+
+/*
+ * Write the record columns, the index and the events are built from the
+ * absolute tsc columns sample_tsc
+ */
+static int trace_fwrite_record_image(FILE *fp,
+                                     trace_record_t **records,
+                                     const uint64_t *tsc_base,
+                                     uint64_t **sample_tsc,
+                                     const uint64_t *counts,
+                                     int cl_cnt) {
+	static const uint8_t zero_pad[TRACE_ALIGN] = { 0 };
+	uint64_t head[trace_header_size(cl_cnt) / sizeof(uint64_t)];
+	trace_file_header_t *header = (trace_file_header_t *)head;
+	trace_channel_t channels[cl_cnt];
+	uint64_t offset = sizeof(head) + sizeof(channels);
+
+	memset(head, 0, sizeof(head));
+	memset(channels, 0, sizeof(channels));
+	for (int j = 0; j < cl_cnt; ++j) {
+		channels[j].sample_count = counts[j];
+		channels[j].tsc_offset = offset = trace_align(offset);
+		channels[j].lat_offset = offset;
+		channels[j].tsc_base = tsc_base[j];
+		offset += counts[j] * sizeof(trace_record_t);
+	}
+
+	trace_fill_header((uint8_t *)head, cl_cnt);
+	header->encoding = TRACE_ENCODING_RECORDS;
+	header->index_offset = offset = trace_align(offset);
+	header->index_stride = TRACE_INDEX_STRIDE;
+	for (int j = 0; j < cl_cnt; ++j) {
+		offset += trace_index_count(counts[j], TRACE_INDEX_STRIDE) *
+		          sizeof(trace_index_t);
+	}
+	uint64_t index_end = offset;
+	if (cl_cnt <= TRACE_EVENTS_MAX_CHANNELS) {
+		header->flags |= TRACE_FLAG_EVENTS;
+		offset = trace_events_offset(header, channels);
+		for (int j = 0; j < cl_cnt; ++j) {
+			offset += counts[j];
+		}
+	}
+	uint64_t events_end = offset;
+	header->file_size = trace_place_tail(header, offset);
+
+	int ret = fwrite(head, sizeof(head), 1, fp) != 1 ||
+	          fwrite(channels, sizeof(channels), 1, fp) != 1;
+	offset = sizeof(head) + sizeof(channels);
+	for (int j = 0; j < cl_cnt && !ret; ++j) {
+		uint64_t rows = counts[j];
+		size_t pad = channels[j].tsc_offset - offset;
+		ret = fwrite(zero_pad, 1, pad, fp) != pad ||
+		      fwrite(records[j], sizeof(trace_record_t), rows, fp) != rows;
+		offset = channels[j].tsc_offset + rows * sizeof(trace_record_t);
+	}
+	size_t pad = header->index_offset - offset;
+	ret = ret || fwrite(zero_pad, 1, pad, fp) != pad ||
+	      trace_fwrite_index(fp, sample_tsc, counts, cl_cnt);
+	if (header->flags & TRACE_FLAG_EVENTS) {
+		pad = trace_events_offset(header, channels) - index_end;
+		ret = ret || fwrite(zero_pad, 1, pad, fp) != pad ||
+		      trace_fwrite_events(fp, sample_tsc, counts, cl_cnt);
+	}
+	return ret || trace_fwrite_tail(fp, header, events_end);
+}
+
+int trace_fwrite_records(FILE *fp,
+                         trace_record_t **records,
+                         const uint64_t *tsc_base,
+                         const uint64_t *sample_count,
+                         int cl_cnt) {
+	uint64_t *sample_tsc[cl_cnt];
+	int ret = 0;
+
+	for (int j = 0; j < cl_cnt; ++j) {
+		// Keep a valid pointer for empty channels as well
+		sample_tsc[j] = malloc(sizeof(uint64_t) * (sample_count[j] + 1));
+		if (sample_tsc[j] == NULL) {
+			log_error("Cannot expand channel %d", j);
+			ret = 1;
+			continue;
+		}
+		trace_expand_records(
+		    records[j], sample_count[j], tsc_base[j], sample_tsc[j], NULL);
+	}
+	ret = ret || trace_fwrite_record_image(
+	                 fp, records, tsc_base, sample_tsc, sample_count, cl_cnt);
+	for (int j = 0; j < cl_cnt; ++j) {
+		free(sample_tsc[j]);
+	}
+	return ret;
+}
+
+/* Pack (tsc, latency) columns into records, binary if a run is too long */
+static int trace_fwrite_columns_records(FILE *fp,
+                                        uint64_t **sample_tsc,
+                                        uint64_t **latency,
+                                        const uint64_t *counts,
+                                        int cl_cnt) {
+	trace_record_t *records[cl_cnt];
+	uint64_t tsc_base[cl_cnt];
+	int ret = 0, fits = 1;
+
+	for (int j = 0; j < cl_cnt; ++j) {
+		tsc_base[j] = counts[j] > 0 ? sample_tsc[j][0] : 0;
+		if (counts[j] > 0 &&
+		    sample_tsc[j][counts[j] - 1] - tsc_base[j] > TRACE_RECORD_TSC_MAX) {
+			fits = 0;
+		}
+	}
+	if (!fits) {
+		log_warn("Run exceeds %d tsc bits, dumped as binary",
+		         TRACE_RECORD_TSC_BITS);
+		return trace_fwrite_binary(fp, sample_tsc, latency, counts, cl_cnt);
+	}
+
+	for (int j = 0; j < cl_cnt; ++j) {
+		records[j] = malloc(sizeof(trace_record_t) * (counts[j] + 1));
+		if (records[j] == NULL) {
+			log_error("Cannot pack channel %d", j);
+			ret = 1;
+			continue;
+		}
+		for (uint64_t i = 0; i < counts[j]; ++i) {
+			records[j][i] = trace_record_pack(
+			    sample_tsc[j][i] - tsc_base[j], latency[j][i], 0);
+		}
+	}
+	ret = ret || trace_fwrite_record_image(
+	                 fp, records, tsc_base, sample_tsc, counts, cl_cnt);
+	for (int j = 0; j < cl_cnt; ++j) {
+		free(records[j]);
+	}
+	return ret;
+}
+
+int trace_fwrite(FILE *fp,
+                 trace_format_t format,
+                 uint64_t **sample_tsc,
+                 uint64_t **latency,
+                 const uint64_t *sample_count,
+                 int cl_cnt,
+                 int sp_cnt) {
+	uint64_t counts[cl_cnt];
+
+	trace_sample_counts(sample_tsc, sample_count, cl_cnt, sp_cnt, counts);
+	switch (format) {
+	case TRACE_FORMAT_TEXT:
+		return trace_fwrite_text(fp, sample_tsc, latency, counts, cl_cnt);
+	case TRACE_FORMAT_PACKED:
+		return trace_fwrite_packed(fp, sample_tsc, latency, counts, cl_cnt);
+	case TRACE_FORMAT_RECORDS:
+		return trace_fwrite_columns_records(
+		    fp, sample_tsc, latency, counts, cl_cnt);
+	default:
+		return trace_fwrite_binary(fp, sample_tsc, latency, counts, cl_cnt);
+	}
+}
+
+static int trace_write_file(const char *filepath,
+                            trace_format_t format,
+                            uint64_t **sample_tsc,
+                            uint64_t **latency,
+                            const uint64_t *sample_count,
+                            int cl_cnt,
+                            int sp_cnt) {
+	FILE *fp = fopen(filepath, format == TRACE_FORMAT_TEXT ? "w" : "wb");
+	if (fp == NULL) {
+		log_error("Error opening output file %s", filepath);
+		return 1;
+	}
+
+	int ret = trace_fwrite(
+	    fp, format, sample_tsc, latency, sample_count, cl_cnt, sp_cnt);
+	if (ret) {
+		log_error("Error writing trace file %s", filepath);
+	}
+	fclose(fp);
+	return ret;
+}
+
+int trace_write(const char *filepath,
+                uint64_t **sample_tsc,
+                uint64_t **latency,
+                const uint64_t *sample_count,
+                int cl_cnt,
+                int sp_cnt) {
+	return trace_write_file(filepath,
+	                        trace_get_format(),
+	                        sample_tsc,
+	                        latency,
+	                        sample_count,
+	                        cl_cnt,
+	                        sp_cnt);
+}
+
+int trace_write_text(const char *filepath,
+                     uint64_t **sample_tsc,
+                     uint64_t **latency,
+                     const uint64_t *sample_count,
+                     int cl_cnt,
+                     int sp_cnt) {
+	return trace_write_file(filepath,
+	                        TRACE_FORMAT_TEXT,
+	                        sample_tsc,
+	                        latency,
+	                        sample_count,
+	                        cl_cnt,
+	                        sp_cnt);
+}
+
+int trace_write_binary(const char *filepath,
+                       uint64_t **sample_tsc,
+                       uint64_t **latency,
+                       const uint64_t *sample_count,
+                       int cl_cnt,
+                       int sp_cnt) {
+	return trace_write_file(filepath,
+	                        TRACE_FORMAT_BINARY,
+	                        sample_tsc,
+	                        latency,
+	                        sample_count,
+	                        cl_cnt,
+	                        sp_cnt);
+}
+
+int trace_write_packed(const char *filepath,
+                       uint64_t **sample_tsc,
+                       uint64_t **latency,
+                       const uint64_t *sample_count,
+                       int cl_cnt,
+                       int sp_cnt) {
+	return trace_write_file(filepath,
+	                        TRACE_FORMAT_PACKED,
+	                        sample_tsc,
+	                        latency,
+	                        sample_count,
+	                        cl_cnt,
+	                        sp_cnt);
+}
+
+int trace_write_records(const char *filepath,
+                        trace_record_t **records,
+                        const uint64_t *tsc_base,
+                        const uint64_t *sample_count,
+                        int cl_cnt) {
+	FILE *fp = fopen(filepath, "wb");
+	if (fp == NULL) {
+		log_error("Error opening output file %s", filepath);
+		return 1;
+	}
+
+	int ret =
+	    trace_fwrite_records(fp, records, tsc_base, sample_count, cl_cnt);
+	if (ret) {
+		log_error("Error writing trace file %s", filepath);
+	}
+	fclose(fp);
+	return ret;
+}
+
+static uint32_t trace_bit_width(uint64_t value) {
+	return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+/*
+ * Encode one block of up to TRACE_BLOCK_SIZE values. For delta columns the
+ * values are signed differences, so the reference is the signed minimum.
+ * Returns the number of bytes written to block.
+ */
+static size_t trace_encode_block(const uint64_t *values,
+                                 int count,
+                                 int delta,
+                                 uint8_t *block) {
+	trace_block_t *hdr = (trace_block_t *)block;
+	uint64_t *words = (uint64_t *)(block + sizeof(trace_block_t));
+	uint64_t min = values[0], max = values[0];
+
+	for (int i = 1; i < count; ++i) {
+		if (delta ? (int64_t)values[i] < (int64_t)min : values[i] < min) {
+			min = values[i];
+		}
+		if (delta ? (int64_t)values[i] > (int64_t)max : values[i] > max) {
+			max = values[i];
+		}
+	}
+
+	hdr->ref = min;
+	hdr->width = trace_bit_width(max - min);
+	hdr->reserved = 0;
+	memset(words, 0, hdr->width * TRACE_BLOCK_SIZE / 8);
+	for (int i = 0; i < count && hdr->width > 0; i += TRACE_BLOCK_LANES) {
+		uint64_t bit = (uint64_t)(i / TRACE_BLOCK_LANES) * hdr->width;
+		uint64_t shift = bit % 64;
+		uint64_t *row = &words[bit / 64 * TRACE_BLOCK_LANES];
+		for (int lane = 0; lane < TRACE_BLOCK_LANES; ++lane) {
+			uint64_t value = i + lane < count ? values[i + lane] - min : 0;
+			row[lane] |= value << shift;
+			if (shift + hdr->width > 64) {
+				row[TRACE_BLOCK_LANES + lane] |= value >> (64 - shift);
+			}
+		}
+	}
+	return sizeof(trace_block_t) + hdr->width * TRACE_BLOCK_SIZE / 8;
+}
+
+static int trace_write_packed_column(FILE *fp,
+                                     const uint64_t *column,
+                                     uint64_t sample_count,
+                                     int delta) {
+	uint8_t block[sizeof(trace_block_t) + 64 * TRACE_BLOCK_SIZE / 8];
+	uint64_t values[TRACE_BLOCK_SIZE];
+	uint64_t prev = sample_count > 0 ? column[0] : 0;
+
+	for (uint64_t i = 0; i < sample_count; i += TRACE_BLOCK_SIZE) {
+		int count = sample_count - i < TRACE_BLOCK_SIZE ? sample_count - i
+		                                                 : TRACE_BLOCK_SIZE;
+		for (int k = 0; k < count; ++k) {
+			values[k] = column[i + k];
+			if (delta) {
+				values[k] -= prev;
+				prev = column[i + k];
+			}
+		}
+		size_t size = trace_encode_block(values, count, delta, block);
+		if (fwrite(block, 1, size, fp) != size) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int trace_fwrite_packed(FILE *fp,
+                               uint64_t **sample_tsc,
+                               uint64_t **latency,
+                               const uint64_t *counts,
+                               int cl_cnt) {
+	uint64_t head[trace_header_size(cl_cnt) / sizeof(uint64_t)];
+	trace_file_header_t *header = (trace_file_header_t *)head;
+	trace_channel_t channels[cl_cnt];
+	long start = ftell(fp);
+
+	memset(head, 0, sizeof(head));
+	memset(channels, 0, sizeof(channels));
+	trace_fill_header((uint8_t *)head, cl_cnt);
+	header->encoding = TRACE_ENCODING_PACKED;
+	header->block_size = TRACE_BLOCK_SIZE;
+	header->index_stride = TRACE_INDEX_STRIDE;
+
+	// Columns are streamed out block by block, the offsets are known only
+	// afterwards, so the header and the channel table are written twice
+	int ret = start < 0 || fwrite(head, sizeof(head), 1, fp) != 1 ||
+	          fwrite(channels, sizeof(channels), 1, fp) != 1;
+	for (int j = 0; j < cl_cnt && !ret; ++j) {
+		channels[j].sample_count = counts[j];
+		channels[j].tsc_base = counts[j] > 0 ? sample_tsc[j][0] : 0;
+		channels[j].tsc_offset = ftell(fp) - start;
+		ret = trace_write_packed_column(fp, sample_tsc[j], counts[j], 1);
+		channels[j].lat_offset = ftell(fp) - start;
+		ret = ret || trace_write_packed_column(fp, latency[j], counts[j], 0);
+	}
+	ret = ret || trace_fwrite_align(fp, start);
+	header->index_offset = ftell(fp) - start;
+	ret = ret || trace_fwrite_index(fp, sample_tsc, counts, cl_cnt);
+	if (cl_cnt <= TRACE_EVENTS_MAX_CHANNELS) {
+		header->flags |= TRACE_FLAG_EVENTS;
+		ret = ret || trace_fwrite_align(fp, start) ||
+		      trace_fwrite_events(fp, sample_tsc, counts, cl_cnt);
+	}
+	uint64_t events_end = ftell(fp) - start;
+	header->file_size = trace_place_tail(header, events_end);
+	ret = ret || trace_fwrite_tail(fp, header, events_end);
+	ret = ret || fseek(fp, start, SEEK_SET) != 0 ||
+	      fwrite(head, sizeof(head), 1, fp) != 1 ||
+	      fwrite(channels, sizeof(channels), 1, fp) != 1 ||
+	      fseek(fp, start + header->file_size, SEEK_SET) != 0;
+	return ret;
+}
+
+uint64_t trace_decode_column(const uint8_t *src,
+                             uint64_t sample_count,
+                             uint64_t base,
+                             int delta,
+                             uint64_t *dst) {
+	const uint8_t *block = src;
+	uint64_t acc = base;
+
+	for (uint64_t i = 0; i < sample_count; i += TRACE_BLOCK_SIZE) {
+		trace_block_t hdr;
+		memcpy(&hdr, block, sizeof(hdr));
+		const uint64_t *words =
+		    (const uint64_t *)(block + sizeof(trace_block_t));
+		uint64_t mask = hdr.width == 64 ? ~0UL : (1UL << hdr.width) - 1;
+		uint64_t values[TRACE_BLOCK_SIZE];
+		int count = sample_count - i < TRACE_BLOCK_SIZE ? sample_count - i
+		                                                 : TRACE_BLOCK_SIZE;
+
+		// The whole block, the lanes of a row in step
+		for (int k = 0; k < TRACE_BLOCK_SIZE; k += TRACE_BLOCK_LANES) {
+			uint64_t bit = (uint64_t)(k / TRACE_BLOCK_LANES) * hdr.width;
+			uint64_t shift = bit % 64;
+			const uint64_t *row = &words[bit / 64 * TRACE_BLOCK_LANES];
+			for (int lane = 0; lane < TRACE_BLOCK_LANES; ++lane) {
+				uint64_t value = 0;
+				if (hdr.width > 0) {
+					value = row[lane] >> shift;
+					if (shift + hdr.width > 64) {
+						value |= row[TRACE_BLOCK_LANES + lane] << (64 - shift);
+					}
+				}
+				values[k + lane] = (value & mask) + hdr.ref;
+			}
+		}
+		for (int k = 0; k < count; ++k) {
+			if (delta) {
+				acc += values[k];
+				values[k] = acc;
+			}
+			dst[i + k] = values[k];
+		}
+		block += sizeof(trace_block_t) + hdr.width * TRACE_BLOCK_SIZE / 8;
+	}
+	return block - src;
+}
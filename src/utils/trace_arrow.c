@@ -0,0 +1,580 @@
+#include "trace_arrow.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_ALIGN (8)
+#define ARROW_CONTINUATION (0xffffffffU)
+#define ARROW_METADATA_V5 (4)
+
+enum {
+	ARROW_HEADER_SCHEMA = 1,
+	ARROW_HEADER_DICTIONARY_BATCH = 2,
+	ARROW_HEADER_RECORD_BATCH = 3,
+};
+
+enum {
+	ARROW_TYPE_INT = 2,
+	ARROW_TYPE_UTF8 = 5,
+};
+
+enum {
+	ARROW_DICT_EXPERIMENT,
+	ARROW_DICT_LABEL,
+};
+
+/*
+ * Minimal flatbuffer builder for the Arrow metadata. Objects are laid out
+ * front to back, a table is written before the objects it references and
+ * its offset fields are patched once they exist.
+ */
+typedef struct fb_builder_t {
+	uint8_t *buf;
+	size_t size;
+	size_t capacity;
+	int error;
+} fb_builder_t;
+
+/* One table field, size 0 leaves it out */
+typedef struct fb_field_t {
+	uint8_t size;
+	uint64_t value;
+	size_t pos;
+} fb_field_t;
+
+static size_t fb_grow(fb_builder_t *fb, size_t size) {
+	if (fb->size + size > fb->capacity) {
+		size_t capacity = fb->capacity ? fb->capacity : 1024;
+		while (capacity < fb->size + size) {
+			capacity *= 2;
+		}
+		uint8_t *buf = realloc(fb->buf, capacity);
+		if (buf == NULL) {
+			fb->error = 1;
+			return 0;
+		}
+		fb->buf = buf;
+		fb->capacity = capacity;
+	}
+	size_t pos = fb->size;
+	memset(fb->buf + pos, 0, size);
+	fb->size += size;
+	return pos;
+}
+
+/* Pad until size + shift is a multiple of align */
+static void fb_pad(fb_builder_t *fb, size_t align, size_t shift) {
+	fb_grow(fb, (align - (fb->size + shift) % align) % align);
+}
+
+static void fb_patch(fb_builder_t *fb, size_t pos, size_t target) {
+	if (!fb->error) {
+		uint32_t offset = target - pos;
+		memcpy(fb->buf + pos, &offset, sizeof(offset));
+	}
+}
+
+static size_t fb_table(fb_builder_t *fb, fb_field_t *fields, int count) {
+	uint16_t vtable[2 + count];
+	uint16_t size = sizeof(int32_t);
+
+	for (int i = 0; i < count; ++i) {
+		vtable[2 + i] = 0;
+	}
+	for (int width = 8; width > 0; width /= 2) {
+		for (int i = 0; i < count; ++i) {
+			if (fields[i].size == width) {
+				size = (size + width - 1) & ~(width - 1);
+				vtable[2 + i] = size;
+				size += width;
+			}
+		}
+	}
+	vtable[0] = sizeof(vtable);
+	vtable[1] = size;
+
+	fb_pad(fb, sizeof(uint16_t), 0);
+	size_t vpos = fb_grow(fb, sizeof(vtable));
+	fb_pad(fb, 8, 0);
+	size_t table = fb_grow(fb, size);
+	if (fb->error) {
+		return 0;
+	}
+
+	int32_t soffset = table - vpos;
+	memcpy(fb->buf + vpos, vtable, sizeof(vtable));
+	memcpy(fb->buf + table, &soffset, sizeof(soffset));
+	for (int i = 0; i < count; ++i) {
+		if (fields[i].size > 0) {
+			fields[i].pos = table + vtable[2 + i];
+			memcpy(fb->buf + fields[i].pos, &fields[i].value, fields[i].size);
+		}
+	}
+	return table;
+}
+
+static size_t fb_vector(fb_builder_t *fb,
+                        size_t count,
+                        size_t width,
+                        const void *data,
+                        size_t align) {
+	fb_pad(fb, align, sizeof(uint32_t));
+	size_t pos = fb_grow(fb, sizeof(uint32_t) + count * width);
+	if (!fb->error) {
+		uint32_t length = count;
+		memcpy(fb->buf + pos, &length, sizeof(length));
+		if (data != NULL && count > 0) {
+			memcpy(fb->buf + pos + sizeof(length), data, count * width);
+		}
+	}
+	return pos;
+}
+
+static size_t fb_string(fb_builder_t *fb, const char *str) {
+	size_t length = strlen(str);
+	size_t pos = fb_vector(fb, length + 1, 1, str, sizeof(uint32_t));
+	if (!fb->error) {
+		// The terminating NUL is not part of the length
+		uint32_t size = length;
+		memcpy(fb->buf + pos, &size, sizeof(size));
+	}
+	return pos;
+}
+
+static size_t arrow_int_type(fb_builder_t *fb, int bit_width, int is_signed) {
+	fb_field_t fields[2] = {
+		{ .size = 4, .value = bit_width },
+		{ .size = 1, .value = is_signed },
+	};
+	return fb_table(fb, fields, 2);
+}
+
+/* Integer field, or a utf8 field with integer indices if dict_id >= 0 */
+static size_t arrow_field(fb_builder_t *fb,
+                          const char *name,
+                          int bit_width,
+                          int is_signed,
+                          int64_t dict_id) {
+	fb_field_t fields[6] = {
+		{ .size = 4 },
+		{ .size = 0 },
+		{ .size = 1, .value = dict_id < 0 ? ARROW_TYPE_INT : ARROW_TYPE_UTF8 },
+		{ .size = 4 },
+		{ .size = dict_id < 0 ? 0 : 4 },
+		{ .size = 4 },
+	};
+	size_t table = fb_table(fb, fields, 6);
+
+	fb_patch(fb, fields[0].pos, fb_string(fb, name));
+	if (dict_id < 0) {
+		fb_patch(fb, fields[3].pos, arrow_int_type(fb, bit_width, is_signed));
+	} else {
+		fb_patch(fb, fields[3].pos, fb_table(fb, NULL, 0));
+
+		fb_field_t dict[2] = {
+			{ .size = 8, .value = dict_id },
+			{ .size = 4 },
+		};
+		fb_patch(fb, fields[4].pos, fb_table(fb, dict, 2));
+		fb_patch(fb, dict[1].pos, arrow_int_type(fb, bit_width, is_signed));
+	}
+	fb_patch(fb, fields[5].pos, fb_vector(fb, 0, 4, NULL, 4));
+	return table;
+}
+
+static size_t arrow_schema(fb_builder_t *fb, const trace_arrow_t *arrow) {
+	fb_field_t schema[2] = {
+		{ .size = 0 },
+		{ .size = 4 },
+	};
+	size_t table = fb_table(fb, schema, 2);
+	int count = arrow->with_latency ? 6 : 5;
+	size_t vector = fb_vector(fb, count, 4, NULL, 4);
+	size_t fields[6];
+
+	fb_patch(fb, schema[1].pos, vector);
+	fields[0] = arrow_field(fb, "experiment", 8, 1, ARROW_DICT_EXPERIMENT);
+	fields[1] = arrow_field(fb, "key", 32, 0, -1);
+	fields[2] = arrow_field(fb, "run", 32, 0, -1);
+	fields[3] = arrow_field(fb, arrow->label_name, 8, 1, ARROW_DICT_LABEL);
+	fields[4] = arrow_field(fb, "tsc", 64, 0, -1);
+	fields[5] = arrow_field(fb, "latency", 64, 0, -1);
+	for (int i = 0; i < count; ++i) {
+		fb_patch(fb, vector + 4 + 4 * i, fields[i]);
+	}
+	return table;
+}
+
+/* Start a Message, returns the position of its header offset */
+static size_t
+arrow_message(fb_builder_t *fb, int header_type, int64_t body_length) {
+	fb_field_t message[4] = {
+		{ .size = 2, .value = ARROW_METADATA_V5 },
+		{ .size = 1, .value = header_type },
+		{ .size = 4 },
+		{ .size = 8, .value = body_length },
+	};
+	fb_grow(fb, sizeof(uint32_t));
+	fb_patch(fb, 0, fb_table(fb, message, 4));
+	return message[2].pos;
+}
+
+static size_t arrow_record_batch(fb_builder_t *fb,
+                                 int64_t length,
+                                 const int64_t *nodes,
+                                 int node_count,
+                                 const int64_t *buffers,
+                                 int buffer_count) {
+	fb_field_t batch[3] = {
+		{ .size = 8, .value = length },
+		{ .size = 4 },
+		{ .size = 4 },
+	};
+	size_t table = fb_table(fb, batch, 3);
+	fb_patch(fb, batch[1].pos, fb_vector(fb, node_count, 16, nodes, 8));
+	fb_patch(fb, batch[2].pos, fb_vector(fb, buffer_count, 16, buffers, 8));
+	return table;
+}
+
+static int arrow_write(trace_arrow_t *arrow, const void *data, size_t size) {
+	if (size == 0) {
+		return 0;
+	}
+	arrow->offset += size;
+	return fwrite(data, 1, size, arrow->fp) != size;
+}
+
+static int arrow_write_pad(trace_arrow_t *arrow) {
+	static const uint8_t zero_pad[ARROW_ALIGN] = { 0 };
+	size_t pad = (ARROW_ALIGN - arrow->offset % ARROW_ALIGN) % ARROW_ALIGN;
+	return arrow_write(arrow, zero_pad, pad);
+}
+
+/* Write count copies of the width-byte little-endian value */
+static int arrow_write_fill(trace_arrow_t *arrow,
+                            uint64_t value,
+                            size_t width,
+                            uint64_t count) {
+	uint8_t chunk[4096];
+	uint64_t per_chunk = sizeof(chunk) / width;
+
+	for (uint64_t i = 0; i < per_chunk; ++i) {
+		memcpy(chunk + i * width, &value, width);
+	}
+	while (count > 0) {
+		uint64_t n = count < per_chunk ? count : per_chunk;
+		if (arrow_write(arrow, chunk, n * width)) {
+			return 1;
+		}
+		count -= n;
+	}
+	return 0;
+}
+
+/* Write the encapsulated flatbuffer, the body has to follow */
+static int arrow_write_metadata(trace_arrow_t *arrow,
+                                fb_builder_t *fb,
+                                int64_t body_length,
+                                trace_arrow_block_t *block) {
+	fb_pad(fb, ARROW_ALIGN, 0);
+	if (fb->error) {
+		log_error("Cannot allocate Arrow metadata");
+		free(fb->buf);
+		return 1;
+	}
+
+	uint32_t prefix[2] = { ARROW_CONTINUATION, fb->size };
+	if (block != NULL) {
+		block->offset = arrow->offset;
+		block->meta_length = sizeof(prefix) + fb->size;
+		block->reserved = 0;
+		block->body_length = body_length;
+	}
+	int ret = arrow_write(arrow, prefix, sizeof(prefix)) ||
+	          arrow_write(arrow, fb->buf, fb->size);
+	free(fb->buf);
+	return ret;
+}
+
+/* Buffers of non-null fixed width columns, returns the body length */
+static int64_t arrow_layout(uint64_t rows,
+                            const size_t *widths,
+                            int count,
+                            int64_t *nodes,
+                            int64_t *buffers) {
+	int64_t offset = 0;
+
+	for (int i = 0; i < count; ++i) {
+		int64_t size = rows * widths[i];
+		nodes[2 * i] = rows;
+		nodes[2 * i + 1] = 0;
+		// validity bitmap, left empty since nothing is null
+		buffers[4 * i] = offset;
+		buffers[4 * i + 1] = 0;
+		buffers[4 * i + 2] = offset;
+		buffers[4 * i + 3] = size;
+		offset += (size + ARROW_ALIGN - 1) & ~(int64_t)(ARROW_ALIGN - 1);
+	}
+	return offset;
+}
+
+static int arrow_write_batch_header(trace_arrow_t *arrow,
+                                    uint64_t rows,
+                                    const size_t *widths,
+                                    int count) {
+	int64_t nodes[2 * count], buffers[4 * count];
+	int64_t body_length = arrow_layout(rows, widths, count, nodes, buffers);
+	fb_builder_t fb = { 0 };
+
+	if (arrow->batch_count == arrow->batch_capacity) {
+		uint64_t capacity = arrow->batch_capacity ? 2 * arrow->batch_capacity
+		                                          : 64;
+		trace_arrow_block_t *batches =
+		    realloc(arrow->batches, capacity * sizeof(*batches));
+		if (batches == NULL) {
+			log_error("Cannot allocate Arrow batch index");
+			return 1;
+		}
+		arrow->batches = batches;
+		arrow->batch_capacity = capacity;
+	}
+
+	size_t header = arrow_message(&fb, ARROW_HEADER_RECORD_BATCH, body_length);
+	fb_patch(&fb,
+	         header,
+	         arrow_record_batch(&fb, rows, nodes, count, buffers, 2 * count));
+	return arrow_write_metadata(
+	    arrow, &fb, body_length, &arrow->batches[arrow->batch_count++]);
+}
+
+static int arrow_write_dictionary(trace_arrow_t *arrow,
+                                  int64_t id,
+                                  const char **values,
+                                  int count) {
+	int32_t offsets[count + 1];
+	fb_builder_t fb = { 0 };
+
+	offsets[0] = 0;
+	for (int i = 0; i < count; ++i) {
+		offsets[i + 1] = offsets[i] + strlen(values[i]);
+	}
+
+	int64_t offsets_size = sizeof(offsets);
+	int64_t data_offset = (offsets_size + ARROW_ALIGN - 1) & ~(ARROW_ALIGN - 1);
+	int64_t nodes[2] = { count, 0 };
+	int64_t buffers[6] = {
+		0, 0, 0, offsets_size, data_offset, offsets[count],
+	};
+	int64_t body_length =
+	    data_offset + ((offsets[count] + ARROW_ALIGN - 1) & ~(ARROW_ALIGN - 1));
+
+	fb_field_t dict[2] = {
+		{ .size = 8, .value = id },
+		{ .size = 4 },
+	};
+	size_t header =
+	    arrow_message(&fb, ARROW_HEADER_DICTIONARY_BATCH, body_length);
+	fb_patch(&fb, header, fb_table(&fb, dict, 2));
+	fb_patch(&fb,
+	         dict[1].pos,
+	         arrow_record_batch(&fb, count, nodes, 1, buffers, 3));
+
+	int ret = arrow_write_metadata(
+	              arrow, &fb, body_length, &arrow->dictionaries[id]) ||
+	          arrow_write(arrow, offsets, sizeof(offsets)) ||
+	          arrow_write_pad(arrow);
+	for (int i = 0; i < count && !ret; ++i) {
+		ret = arrow_write(arrow, values[i], strlen(values[i]));
+	}
+	return ret || arrow_write_pad(arrow);
+}
+
+static int trace_arrow_open(trace_arrow_t *arrow,
+                            const char *filepath,
+                            const char *experiment,
+                            const char *label_name,
+                            const char **labels,
+                            int label_count,
+                            int with_latency) {
+	static const char magic[ARROW_ALIGN] = ARROW_MAGIC;
+	fb_builder_t fb = { 0 };
+
+	if (label_count > TRACE_ARROW_MAX_LABELS) {
+		log_error("Arrow export supports up to %d labels",
+		          TRACE_ARROW_MAX_LABELS);
+		return 1;
+	}
+
+	memset(arrow, 0, sizeof(*arrow));
+	snprintf(arrow->filepath, sizeof(arrow->filepath), "%s", filepath);
+	arrow->label_name = label_name;
+	arrow->label_count = label_count;
+	arrow->with_latency = with_latency;
+	arrow->fp = fopen(filepath, "wb");
+	if (arrow->fp == NULL) {
+		log_error("Error opening Arrow file %s", filepath);
+		return 1;
+	}
+
+	int ret = arrow_write(arrow, magic, sizeof(magic));
+	if (!ret) {
+		size_t header = arrow_message(&fb, ARROW_HEADER_SCHEMA, 0);
+		fb_patch(&fb, header, arrow_schema(&fb, arrow));
+		ret = arrow_write_metadata(arrow, &fb, 0, NULL);
+	}
+	ret = ret ||
+	          arrow_write_dictionary(
+	              arrow, ARROW_DICT_EXPERIMENT, &experiment, 1) ||
+	          arrow_write_dictionary(
+	              arrow, ARROW_DICT_LABEL, labels, label_count);
+	if (ret) {
+		log_error("Error writing Arrow file %s", filepath);
+		fclose(arrow->fp);
+		arrow->fp = NULL;
+	}
+	return ret;
+}
+
+int trace_arrow_open_traces(trace_arrow_t *arrow,
+                            const char *filepath,
+                            const char *experiment,
+                            const char **labels,
+                            int label_count) {
+	return trace_arrow_open(
+	    arrow, filepath, experiment, "channel", labels, label_count, 1);
+}
+
+int trace_arrow_open_ground_truth(trace_arrow_t *arrow,
+                                  const char *filepath,
+                                  const char *experiment,
+                                  const char **labels,
+                                  int label_count) {
+	return trace_arrow_open(
+	    arrow, filepath, experiment, "opcode", labels, label_count, 0);
+}
+
+int trace_arrow_append_run(trace_arrow_t *arrow,
+                           uint32_t key_id,
+                           uint32_t run_id,
+                           const uint64_t **sample_tsc,
+                           const uint64_t **latency,
+                           const uint64_t *sample_count,
+                           int cl_cnt) {
+	static const size_t widths[6] = { 1, 4, 4, 1, 8, 8 };
+	uint64_t rows = 0;
+
+	if (cl_cnt > arrow->label_count) {
+		log_error("%d channels but only %d labels", cl_cnt, arrow->label_count);
+		return 1;
+	}
+	for (int j = 0; j < cl_cnt; ++j) {
+		rows += sample_count[j];
+	}
+
+	int ret = arrow_write_batch_header(arrow, rows, widths, 6) ||
+	          arrow_write_fill(arrow, 0, 1, rows) || arrow_write_pad(arrow) ||
+	          arrow_write_fill(arrow, key_id, 4, rows) ||
+	          arrow_write_pad(arrow) ||
+	          arrow_write_fill(arrow, run_id, 4, rows) ||
+	          arrow_write_pad(arrow);
+	for (int j = 0; j < cl_cnt && !ret; ++j) {
+		ret = arrow_write_fill(arrow, j, 1, sample_count[j]);
+	}
+	ret = ret || arrow_write_pad(arrow);
+	for (int j = 0; j < cl_cnt && !ret; ++j) {
+		ret = arrow_write(arrow, sample_tsc[j], 8 * sample_count[j]);
+	}
+	ret = ret || arrow_write_pad(arrow);
+	for (int j = 0; j < cl_cnt && !ret; ++j) {
+		ret = arrow_write(arrow, latency[j], 8 * sample_count[j]);
+	}
+	ret = ret || arrow_write_pad(arrow);
+	if (ret) {
+		log_error("Error writing run %u of key %u to %s",
+		          run_id,
+		          key_id,
+		          arrow->filepath);
+	}
+	return ret;
+}
+
+int trace_arrow_append_ground_truth(trace_arrow_t *arrow,
+                                    uint32_t key_id,
+                                    uint32_t run_id,
+                                    const uint64_t *tsc,
+                                    const uint8_t *opcode,
+                                    uint64_t count) {
+	static const size_t widths[5] = { 1, 4, 4, 1, 8 };
+
+	for (uint64_t i = 0; i < count; ++i) {
+		if (opcode[i] >= arrow->label_count) {
+			log_error("Unknown opcode label %u", opcode[i]);
+			return 1;
+		}
+	}
+
+	int ret = arrow_write_batch_header(arrow, count, widths, 5) ||
+	          arrow_write_fill(arrow, 0, 1, count) || arrow_write_pad(arrow) ||
+	          arrow_write_fill(arrow, key_id, 4, count) ||
+	          arrow_write_pad(arrow) ||
+	          arrow_write_fill(arrow, run_id, 4, count) ||
+	          arrow_write_pad(arrow) || arrow_write(arrow, opcode, count) ||
+	          arrow_write_pad(arrow) || arrow_write(arrow, tsc, 8 * count) ||
+	          arrow_write_pad(arrow);
+	if (ret) {
+		log_error("Error writing ground truth of run %u to %s",
+		          run_id,
+		          arrow->filepath);
+	}
+	return ret;
+}
+
+int trace_arrow_close(trace_arrow_t *arrow) {
+	static const uint32_t eos[2] = { ARROW_CONTINUATION, 0 };
+	fb_builder_t fb = { 0 };
+	fb_field_t footer[4] = {
+		{ .size = 2, .value = ARROW_METADATA_V5 },
+		{ .size = 4 },
+		{ .size = 4 },
+		{ .size = 4 },
+	};
+
+	fb_grow(&fb, sizeof(uint32_t));
+	fb_patch(&fb, 0, fb_table(&fb, footer, 4));
+	fb_patch(&fb, footer[1].pos, arrow_schema(&fb, arrow));
+	fb_patch(&fb,
+	         footer[2].pos,
+	         fb_vector(&fb,
+	                   2,
+	                   sizeof(trace_arrow_block_t),
+	                   arrow->dictionaries,
+	                   8));
+	fb_patch(&fb,
+	         footer[3].pos,
+	         fb_vector(&fb,
+	                   arrow->batch_count,
+	                   sizeof(trace_arrow_block_t),
+	                   arrow->batches,
+	                   8));
+	fb_pad(&fb, ARROW_ALIGN, 0);
+
+	int32_t footer_size = fb.size;
+	int ret = fb.error || arrow_write(arrow, eos, sizeof(eos)) ||
+	          arrow_write(arrow, fb.buf, fb.size) ||
+	          arrow_write(arrow, &footer_size, sizeof(footer_size)) ||
+	          arrow_write(arrow, ARROW_MAGIC, strlen(ARROW_MAGIC));
+	if (ret) {
+		log_error("Error writing Arrow footer to %s", arrow->filepath);
+	}
+	log_info("Exported %lu runs to %s", arrow->batch_count, arrow->filepath);
+
+	free(fb.buf);
+	free(arrow->batches);
+	fclose(arrow->fp);
+	arrow->fp = NULL;
+	arrow->batches = NULL;
+	return ret;
+}
@@ -0,0 +1,338 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+#include "log.h"
+#include "trace_arrow.h"
+#include "trace_reader.h"
+#include "trace_segment.h"
+
+#define DEFAULT_LABEL_COUNT (8)
+
+/* Events of the cpython_pow ground truth, see cpython_push_gt() */
+static const char *cpython_gt_labels[] = { "zero", "window", "trailing" };
+
+typedef struct export_t {
+	const char *dataset;
+	const char *experiment;
+	trace_arrow_t traces;
+	trace_arrow_t ground_truth;
+	int with_ground_truth;
+} export_t;
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+	        "Usage: %s -o <dataset dir> [-e experiment] [-k key id]\n"
+	        "       [-l label,...] [-g ground truth dir] <trace>...\n"
+	        "\n"
+	        "<trace> is a run directory of rN.out files, a single binary\n"
+	        "trace or a key-pool segment file. Ground truth stored in the\n"
+	        "traces is exported along with them.\n",
+	        prog);
+}
+
+/* ground_truth.arrow is only created once there is ground truth */
+static int open_ground_truth(export_t *export) {
+	char filepath[512];
+
+	if (export->with_ground_truth) {
+		return 0;
+	}
+	snprintf(filepath,
+	         sizeof(filepath),
+	         "%s/ground_truth.arrow",
+	         export->dataset);
+	if (trace_arrow_open_ground_truth(&export->ground_truth,
+	                                  filepath,
+	                                  export->experiment,
+	                                  cpython_gt_labels,
+	                                  3)) {
+		return 1;
+	}
+	export->with_ground_truth = 1;
+	return 0;
+}
+
+static int export_image_ground_truth(export_t *export,
+                                     uint32_t key_id,
+                                     uint32_t run_id,
+                                     trace_reader_t *reader) {
+	uint64_t count;
+	const trace_gt_t *gt = trace_reader_ground_truth(reader, &count);
+
+	if (count == 0) {
+		return 0;
+	}
+	uint64_t *tsc = malloc(count * sizeof(*tsc));
+	uint8_t *event = malloc(count);
+	int ret = tsc == NULL || event == NULL;
+	if (ret) {
+		log_error("Cannot allocate ground truth buffer");
+	}
+	for (uint64_t i = 0; i < count && !ret; ++i) {
+		tsc[i] = gt[i].tsc;
+		event[i] = gt[i].event;
+	}
+	ret = ret || open_ground_truth(export) ||
+	      trace_arrow_append_ground_truth(
+	          &export->ground_truth, key_id, run_id, tsc, event, count);
+	free(tsc);
+	free(event);
+	return ret;
+}
+
+static int export_image(export_t *export,
+                        uint32_t key_id,
+                        uint32_t run_id,
+                        trace_reader_t *reader) {
+	uint32_t cl_cnt = trace_reader_channel_count(reader);
+	const uint64_t *sample_tsc[cl_cnt], *latency[cl_cnt];
+	uint64_t sample_count[cl_cnt];
+
+	for (uint32_t j = 0; j < cl_cnt; ++j) {
+		sample_count[j] = trace_reader_sample_count(reader, j);
+		sample_tsc[j] = trace_reader_tsc(reader, j);
+		latency[j] = trace_reader_latency(reader, j);
+		if (sample_tsc[j] == NULL || latency[j] == NULL) {
+			return 1;
+		}
+	}
+	return trace_arrow_append_run(&export->traces,
+	                              key_id,
+	                              run_id,
+	                              sample_tsc,
+	                              latency,
+	                              sample_count,
+	                              cl_cnt) ||
+	       export_image_ground_truth(export, key_id, run_id, reader);
+}
+
+static int export_file(export_t *export,
+                       uint32_t key_id,
+                       uint32_t run_id,
+                       const char *filepath) {
+	trace_reader_t reader;
+
+	if (trace_reader_open(&reader, filepath)) {
+		return 1;
+	}
+	int ret = export_image(export, key_id, run_id, &reader);
+	trace_reader_close(&reader);
+	return ret;
+}
+
+static int export_segment(export_t *export, const char *filepath) {
+	trace_segment_reader_t segment;
+	int ret = 0;
+
+	if (trace_segment_map(&segment, filepath)) {
+		return 1;
+	}
+	for (uint64_t i = 0; i < segment.entry_count && !ret; ++i) {
+		const trace_segment_entry_t *entry = &segment.entries[i];
+		trace_reader_t reader;
+		if (entry->channel != TRACE_SEGMENT_RUN) {
+			continue;
+		}
+		ret = trace_reader_attach(
+		    &reader, segment.base + entry->offset, entry->length);
+		if (!ret) {
+			ret = export_image(export, entry->key_id, entry->run_id, &reader);
+			trace_reader_close(&reader);
+		}
+	}
+	trace_segment_unmap(&segment);
+	return ret;
+}
+
+static int is_segment(const char *filepath) {
+	char magic[sizeof(TRACE_SEGMENT_MAGIC)] = { 0 };
+	FILE *fp = fopen(filepath, "rb");
+
+	if (fp == NULL) {
+		return 0;
+	}
+	size_t n = fread(magic, 1, sizeof(magic), fp);
+	fclose(fp);
+	return n == sizeof(magic) &&
+	       memcmp(magic, TRACE_SEGMENT_MAGIC, sizeof(magic)) == 0;
+}
+
+static int export_trace(export_t *export,
+                        uint32_t key_id,
+                        const char *path) {
+	struct stat st;
+	char filepath[512];
+	unsigned run_id = 0;
+
+	if (stat(path, &st) != 0) {
+		log_error("Trace %s not found", path);
+		return 1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		if (is_segment(path)) {
+			return export_segment(export, path);
+		}
+		const char *name = strrchr(path, '/');
+		sscanf(name ? name + 1 : path, "r%u.out", &run_id);
+		return export_file(export, key_id, run_id, path);
+	}
+
+	for (;; ++run_id) {
+		snprintf(filepath, sizeof(filepath), "%s/r%u.out", path, run_id);
+		if (!path_exists(filepath)) {
+			break;
+		}
+		if (export_file(export, key_id, run_id, filepath)) {
+			return 1;
+		}
+	}
+	log_info("Exported %u runs of %s", run_id, path);
+	return 0;
+}
+
+/* Read one "opcode:tsc:name" gt_N.out file of older cpython_pow runs */
+static int
+export_ground_truth_file(export_t *export,
+                         uint32_t key_id,
+                         uint32_t run_id,
+                         const char *filepath) {
+	uint64_t *tsc = NULL;
+	uint8_t *opcode = NULL;
+	uint64_t count = 0, capacity = 0;
+	unsigned op;
+	uint64_t time;
+	int ret = 0;
+
+	FILE *fp = fopen(filepath, "r");
+	if (fp == NULL) {
+		log_error("Error opening ground truth file %s", filepath);
+		return 1;
+	}
+	while (fscanf(fp, "%u:%lu:%*s", &op, &time) == 2) {
+		if (count == capacity) {
+			capacity = capacity ? 2 * capacity : 4096;
+			uint64_t *new_tsc = realloc(tsc, capacity * sizeof(*tsc));
+			uint8_t *new_opcode = realloc(opcode, capacity);
+			tsc = new_tsc ? new_tsc : tsc;
+			opcode = new_opcode ? new_opcode : opcode;
+			if (new_tsc == NULL || new_opcode == NULL) {
+				log_error("Cannot allocate ground truth buffer");
+				ret = 1;
+				break;
+			}
+		}
+		tsc[count] = time;
+		opcode[count++] = op;
+	}
+	fclose(fp);
+
+	ret = ret || open_ground_truth(export) ||
+	      trace_arrow_append_ground_truth(
+	          &export->ground_truth, key_id, run_id, tsc, opcode, count);
+	free(tsc);
+	free(opcode);
+	return ret;
+}
+
+static int export_ground_truth(export_t *export,
+                               uint32_t key_id,
+                               const char *gt_dir) {
+	char filepath[512];
+	int ret = 0;
+
+	for (uint32_t run_id = 0; !ret; ++run_id) {
+		snprintf(filepath, sizeof(filepath), "%s/gt_%u.out", gt_dir, run_id);
+		if (!path_exists(filepath)) {
+			break;
+		}
+		ret = export_ground_truth_file(export, key_id, run_id, filepath);
+	}
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	const char *dataset = NULL, *experiment = NULL, *gt_dir = NULL;
+	const char *labels[TRACE_ARROW_MAX_LABELS];
+	char default_labels[DEFAULT_LABEL_COUNT][8];
+	char *label_list = NULL;
+	int label_count = 0;
+	uint32_t key_id = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:e:k:l:g:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			dataset = optarg;
+			break;
+		case 'e':
+			experiment = optarg;
+			break;
+		case 'k':
+			key_id = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			label_list = optarg;
+			break;
+		case 'g':
+			gt_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (dataset == NULL || (optind == argc && gt_dir == NULL)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (experiment == NULL) {
+		const char *name = optind < argc ? argv[optind] : gt_dir;
+		experiment = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+	}
+
+	if (label_list != NULL) {
+		for (char *label = strtok(label_list, ",");
+		     label != NULL && label_count < TRACE_ARROW_MAX_LABELS;
+		     label = strtok(NULL, ",")) {
+			labels[label_count++] = label;
+		}
+	} else {
+		for (int j = 0; j < DEFAULT_LABEL_COUNT; ++j) {
+			snprintf(default_labels[j], sizeof(default_labels[j]), "ch%d", j);
+			labels[label_count++] = default_labels[j];
+		}
+	}
+
+	if (create_directory(dataset)) {
+		return 1;
+	}
+
+	export_t export = {
+		.dataset = dataset,
+		.experiment = experiment,
+	};
+	int ret = 0;
+	if (optind < argc) {
+		char filepath[512];
+		snprintf(filepath, sizeof(filepath), "%s/traces.arrow", dataset);
+		if (trace_arrow_open_traces(
+		        &export.traces, filepath, experiment, labels, label_count)) {
+			return 1;
+		}
+		for (int i = optind; i < argc && !ret; ++i) {
+			ret = export_trace(&export, key_id, argv[i]);
+		}
+		ret = trace_arrow_close(&export.traces) || ret;
+	}
+	if (gt_dir != NULL && !ret) {
+		ret = export_ground_truth(&export, key_id, gt_dir);
+	}
+	if (export.with_ground_truth) {
+		ret = trace_arrow_close(&export.ground_truth) || ret;
+	}
+	return ret;
+}
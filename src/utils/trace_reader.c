@@ -0,0 +1,438 @@
+#include "trace_reader.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+size_t trace_reader_size(void) {
+	return sizeof(trace_reader_t);
+}
+
+static uint64_t trace_reader_index_count(const trace_reader_t *reader,
+                                         uint32_t channel) {
+	return trace_index_count(reader->channels[channel].sample_count,
+	                         reader->header->index_stride);
+}
+
+/* Older traces have no index and are searched column-wide */
+static int trace_reader_attach_index(trace_reader_t *reader) {
+	const trace_file_header_t *header = reader->header;
+	uint64_t offset = header->index_offset;
+
+	if (offset == 0 || header->index_stride == 0) {
+		return 0;
+	}
+	for (uint32_t j = 0; j < header->channel_count; ++j) {
+		uint64_t entries = trace_reader_index_count(reader, j);
+		if (offset > reader->size ||
+		    entries > (reader->size - offset) / sizeof(trace_index_t)) {
+			log_error("Index of channel %u exceeds the trace", j);
+			trace_reader_close(reader);
+			return 1;
+		}
+		reader->index[j] = (const trace_index_t *)(reader->base + offset);
+		offset += entries * sizeof(trace_index_t);
+	}
+	return 0;
+}
+
+int trace_reader_attach(trace_reader_t *reader,
+                        const uint8_t *image,
+                        uint64_t size) {
+	const trace_file_header_t *header = (const trace_file_header_t *)image;
+
+	memset(reader, 0, sizeof(*reader));
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+		log_error("No binary trace found");
+		return 1;
+	}
+	if (header->file_size > size ||
+	    header->header_size +
+	            (uint64_t)header->channel_count * sizeof(trace_channel_t) >
+	        size) {
+		log_error("Truncated trace, %lu of %lu bytes",
+		          size,
+		          header->file_size);
+		return 1;
+	}
+
+	reader->base = image;
+	reader->size = size;
+	reader->header = header;
+	reader->channels =
+	    (const trace_channel_t *)(image + header->header_size);
+	for (uint32_t j = 0; j < header->channel_count; ++j) {
+		const trace_channel_t *ch = &reader->channels[j];
+		if (ch->tsc_offset > size || ch->lat_offset > size ||
+		    (header->encoding != TRACE_ENCODING_PACKED &&
+		     (ch->sample_count * sizeof(uint64_t) > size - ch->tsc_offset ||
+		      ch->sample_count * sizeof(uint64_t) > size - ch->lat_offset))) {
+			log_error("Channel %u exceeds the trace", j);
+			return 1;
+		}
+	}
+
+	reader->decoded = calloc(2 * header->channel_count, sizeof(uint64_t *));
+	reader->index = calloc(header->channel_count, sizeof(trace_index_t *));
+	if ((reader->decoded == NULL || reader->index == NULL) &&
+	    header->channel_count > 0) {
+		log_error("Cannot allocate trace reader");
+		free(reader->decoded);
+		free(reader->index);
+		return 1;
+	}
+	return trace_reader_attach_index(reader);
+}
+
+int trace_reader_open(trace_reader_t *reader, const char *filepath) {
+	struct stat st;
+
+	int fd = open(filepath, O_RDONLY);
+	if (fd < 0) {
+		log_error("Error opening trace file %s", filepath);
+		return 1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		log_error("Empty trace file %s", filepath);
+		close(fd);
+		return 1;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_error("Error mapping trace file %s", filepath);
+		return 1;
+	}
+
+	if (trace_reader_attach(reader, map, st.st_size)) {
+		log_error("Invalid trace file %s", filepath);
+		munmap(map, st.st_size);
+		return 1;
+	}
+	reader->map = map;
+	reader->map_size = st.st_size;
+	return 0;
+}
+
+void trace_reader_close(trace_reader_t *reader) {
+	if (reader->decoded != NULL) {
+		for (uint32_t j = 0; j < 2 * reader->header->channel_count; ++j) {
+			free(reader->decoded[j]);
+		}
+		free(reader->decoded);
+	}
+	free(reader->index);
+	if (reader->map != NULL) {
+		munmap(reader->map, reader->map_size);
+	}
+	memset(reader, 0, sizeof(*reader));
+}
+
+uint32_t trace_reader_channel_count(const trace_reader_t *reader) {
+	return reader->header->channel_count;
+}
+
+uint64_t trace_reader_sample_count(const trace_reader_t *reader,
+                                   uint32_t channel) {
+	if (channel >= reader->header->channel_count) {
+		return 0;
+	}
+	return reader->channels[channel].sample_count;
+}
+
+const trace_capture_t *trace_reader_capture(const trace_reader_t *reader) {
+	const trace_file_header_t *header = reader->header;
+
+	if (header->header_size < trace_header_size(header->channel_count)) {
+		return NULL;
+	}
+	return (const trace_capture_t *)(reader->base + sizeof(*header));
+}
+
+const trace_capture_channel_t *
+trace_reader_capture_channel(const trace_reader_t *reader, uint32_t channel) {
+	const trace_capture_t *capture = trace_reader_capture(reader);
+
+	if (capture == NULL || channel >= reader->header->channel_count) {
+		return NULL;
+	}
+	return (const trace_capture_channel_t *)(capture + 1) + channel;
+}
+
+const trace_gt_t *trace_reader_ground_truth(const trace_reader_t *reader,
+                                            uint64_t *count) {
+	const trace_file_header_t *header = reader->header;
+
+	*count = 0;
+	if (header->gt_count == 0 || header->gt_offset > reader->size ||
+	    header->gt_count >
+	        (reader->size - header->gt_offset) / sizeof(trace_gt_t)) {
+		return NULL;
+	}
+	*count = header->gt_count;
+	return (const trace_gt_t *)(reader->base + header->gt_offset);
+}
+
+const trace_noise_t *trace_reader_noise(const trace_reader_t *reader,
+                                        uint64_t *count) {
+	const trace_capture_t *capture = trace_reader_capture(reader);
+
+	*count = 0;
+	if (capture == NULL || capture->noise_count == 0 ||
+	    capture->noise_offset > reader->size ||
+	    capture->noise_count >
+	        (reader->size - capture->noise_offset) / sizeof(trace_noise_t)) {
+		return NULL;
+	}
+	*count = capture->noise_count;
+	return (const trace_noise_t *)(reader->base + capture->noise_offset);
+}
+
+const trace_coverage_t *trace_reader_coverage(const trace_reader_t *reader) {
+	const trace_capture_t *capture = trace_reader_capture(reader);
+	uint32_t cl_cnt = reader->header->channel_count;
+
+	if (capture == NULL || !(reader->header->flags & TRACE_FLAG_COVERAGE) ||
+	    capture->coverage_offset > reader->size ||
+	    cl_cnt > (reader->size - capture->coverage_offset) /
+	                 sizeof(trace_coverage_t)) {
+		return NULL;
+	}
+	return (const trace_coverage_t *)(reader->base + capture->coverage_offset);
+}
+
+static const uint64_t *
+trace_reader_column(trace_reader_t *reader, uint32_t channel, int latency) {
+	if (channel >= reader->header->channel_count) {
+		log_error("No channel %u in trace", channel);
+		return NULL;
+	}
+
+	const trace_channel_t *ch = &reader->channels[channel];
+	uint64_t offset = latency ? ch->lat_offset : ch->tsc_offset;
+	if (reader->header->encoding == TRACE_ENCODING_RAW) {
+		return (const uint64_t *)(reader->base + offset);
+	}
+
+	uint64_t **column = &reader->decoded[2 * channel + latency];
+	if (*column == NULL) {
+		// Keep a valid pointer for empty channels as well
+		*column = malloc(sizeof(uint64_t) * (ch->sample_count + 1));
+		if (*column == NULL) {
+			log_error("Cannot decode channel %u", channel);
+			return NULL;
+		}
+		if (reader->header->encoding == TRACE_ENCODING_RECORDS) {
+			trace_expand_records(
+			    (const trace_record_t *)(reader->base + offset),
+			    ch->sample_count,
+			    ch->tsc_base,
+			    latency ? NULL : *column,
+			    latency ? *column : NULL);
+		} else {
+			trace_decode_column(reader->base + offset,
+			                    ch->sample_count,
+			                    latency ? 0 : ch->tsc_base,
+			                    !latency,
+			                    *column);
+		}
+	}
+	return *column;
+}
+
+const trace_record_t *trace_reader_records(const trace_reader_t *reader,
+                                           uint32_t channel,
+                                           uint64_t *tsc_base) {
+	if (channel >= reader->header->channel_count ||
+	    reader->header->encoding != TRACE_ENCODING_RECORDS) {
+		return NULL;
+	}
+	const trace_channel_t *ch = &reader->channels[channel];
+	*tsc_base = ch->tsc_base;
+	return (const trace_record_t *)(reader->base + ch->tsc_offset);
+}
+
+const uint64_t *trace_reader_tsc(trace_reader_t *reader, uint32_t channel) {
+	return trace_reader_column(reader, channel, 0);
+}
+
+const uint64_t *trace_reader_latency(trace_reader_t *reader, uint32_t channel) {
+	return trace_reader_column(reader, channel, 1);
+}
+
+uint64_t trace_reader_event_count(const trace_reader_t *reader) {
+	uint64_t count = 0;
+
+	for (uint32_t j = 0; j < reader->header->channel_count; ++j) {
+		count += reader->channels[j].sample_count;
+	}
+	return count;
+}
+
+const uint8_t *trace_reader_event_channels(const trace_reader_t *reader) {
+	const trace_file_header_t *header = reader->header;
+
+	if (!(header->flags & TRACE_FLAG_EVENTS) || header->index_offset == 0) {
+		return NULL;
+	}
+	uint64_t offset = trace_events_offset(header, reader->channels);
+	if (offset > reader->size ||
+	    trace_reader_event_count(reader) > reader->size - offset) {
+		log_warn("Event channels exceed the trace");
+		return NULL;
+	}
+	return reader->base + offset;
+}
+
+int trace_reader_events(trace_reader_t *reader, trace_event_t *events) {
+	uint32_t cl_cnt = reader->header->channel_count;
+	uint64_t total = trace_reader_event_count(reader);
+
+	if (cl_cnt > TRACE_EVENTS_MAX_CHANNELS) {
+		log_error("Cannot merge %u channels", cl_cnt);
+		return 1;
+	}
+	const uint64_t *sample_tsc[cl_cnt + 1], *latency[cl_cnt + 1];
+	uint64_t counts[cl_cnt + 1], next[cl_cnt + 1];
+	for (uint32_t j = 0; j < cl_cnt; ++j) {
+		sample_tsc[j] = trace_reader_tsc(reader, j);
+		latency[j] = trace_reader_latency(reader, j);
+		if (sample_tsc[j] == NULL || latency[j] == NULL) {
+			return 1;
+		}
+		counts[j] = reader->channels[j].sample_count;
+		next[j] = 0;
+	}
+
+	const uint8_t *event_channel = trace_reader_event_channels(reader);
+	uint8_t *merged = NULL;
+	if (event_channel == NULL) {
+		merged = malloc(total + 1);
+		if (merged == NULL) {
+			log_error("Cannot allocate %lu trace events", total);
+			return 1;
+		}
+		trace_merge(sample_tsc, counts, cl_cnt, merged);
+		event_channel = merged;
+	}
+
+	int ret = 0;
+	for (uint64_t i = 0; i < total; ++i) {
+		uint32_t j = event_channel[i];
+		if (j >= cl_cnt || next[j] >= counts[j]) {
+			log_error("Invalid event channel %u at event %lu", j, i);
+			ret = 1;
+			break;
+		}
+		uint64_t k = next[j]++;
+		events[i].tsc = sample_tsc[j][k];
+		events[i].channel = j;
+		events[i].latency =
+		    latency[j][k] < UINT32_MAX ? latency[j][k] : UINT32_MAX;
+	}
+	free(merged);
+	return ret;
+}
+
+/* First sample in [begin, end) with tsc >= value, end if there is none */
+static uint64_t trace_lower_bound(const uint64_t *sample_tsc,
+                                  uint64_t begin,
+                                  uint64_t end,
+                                  uint64_t value) {
+	while (begin < end) {
+		uint64_t mid = begin + (end - begin) / 2;
+		if (sample_tsc[mid] < value) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+	return begin;
+}
+
+static uint64_t trace_reader_seek(const trace_reader_t *reader,
+                                  uint32_t channel,
+                                  const uint64_t *sample_tsc,
+                                  uint64_t value) {
+	const trace_index_t *index = reader->index[channel];
+	uint64_t begin = 0, end = reader->channels[channel].sample_count;
+
+	if (index != NULL) {
+		uint64_t lo = 0, hi = trace_reader_index_count(reader, channel);
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			if (index[mid].tsc < value) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		// The first sample >= value lies between the two index entries
+		end = lo < trace_reader_index_count(reader, channel) ? index[lo].sample
+		                                                     : end;
+		begin = lo > 0 ? index[lo - 1].sample + 1 : 0;
+	}
+	return trace_lower_bound(sample_tsc, begin, end, value);
+}
+
+int trace_range(trace_reader_t *reader,
+                uint32_t channel,
+                uint64_t tsc_lo,
+                uint64_t tsc_hi,
+                trace_slice_t *slice) {
+	const uint64_t *sample_tsc = trace_reader_tsc(reader, channel);
+	const uint64_t *latency = trace_reader_latency(reader, channel);
+
+	if (sample_tsc == NULL || latency == NULL) {
+		return 1;
+	}
+	uint64_t first = trace_reader_seek(reader, channel, sample_tsc, tsc_lo);
+	uint64_t last = tsc_hi > tsc_lo
+	                    ? trace_reader_seek(reader, channel, sample_tsc, tsc_hi)
+	                    : first;
+	slice->tsc = sample_tsc + first;
+	slice->latency = latency + first;
+	slice->first = first;
+	slice->count = last - first;
+	return 0;
+}
+
+trace_cache_level_t trace_cache_level(uint64_t latency) {
+	if (latency == 0) {
+		return TRACE_CLEVEL_UND;
+	} else if (latency < 70) {
+		return TRACE_CLEVEL_L1;
+	} else if (latency < 90) {
+		return TRACE_CLEVEL_L2;
+	} else if (latency < 140) {
+		return TRACE_CLEVEL_L3;
+	} else if (latency < 240) {
+		return TRACE_CLEVEL_RML2;
+	} else if (latency < 460) {
+		return TRACE_CLEVEL_DRAM;
+	}
+	return TRACE_CLEVEL_PAGE;
+}
+
+uint64_t trace_hit_mask(const uint64_t *latency,
+                        uint64_t sample_count,
+                        trace_attack_t attack,
+                        uint8_t *mask) {
+	uint64_t hits = 0;
+
+	for (uint64_t i = 0; i < sample_count; ++i) {
+		if (attack == TRACE_ATTACK_FR) {
+			mask[i] = trace_cache_level(latency[i]) < TRACE_CLEVEL_DRAM;
+		} else {
+			mask[i] = latency[i] > 0;
+		}
+		hits += mask[i];
+	}
+	return hits;
+}
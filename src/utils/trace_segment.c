@@ -0,0 +1,370 @@
+#include "trace_segment.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+_Static_assert(sizeof(trace_segment_header_t) == 64, "segment header size");
+_Static_assert(sizeof(trace_segment_record_t) == 64, "segment record size");
+_Static_assert(sizeof(trace_segment_entry_t) == 32, "segment entry size");
+_Static_assert(sizeof(trace_segment_trailer_t) == 32, "segment trailer size");
+
+static uint64_t trace_segment_align(uint64_t offset) {
+	return (offset + TRACE_ALIGN - 1) & ~(uint64_t)(TRACE_ALIGN - 1);
+}
+
+static int trace_segment_entry_cmp(const void *a, const void *b) {
+	const trace_segment_entry_t *x = a, *y = b;
+	if (x->key_id != y->key_id) {
+		return x->key_id < y->key_id ? -1 : 1;
+	}
+	if (x->run_id != y->run_id) {
+		return x->run_id < y->run_id ? -1 : 1;
+	}
+	if (x->channel != y->channel) {
+		return x->channel < y->channel ? -1 : 1;
+	}
+	return 0;
+}
+
+static int trace_segment_add_entry(trace_segment_t *segment,
+                                   uint32_t key_id,
+                                   uint32_t run_id,
+                                   uint32_t channel,
+                                   uint64_t offset,
+                                   uint64_t length) {
+	if (segment->entry_count == segment->entry_capacity) {
+		uint64_t capacity =
+		    segment->entry_capacity ? 2 * segment->entry_capacity : 1024;
+		trace_segment_entry_t *entries = realloc(
+		    segment->entries, capacity * sizeof(trace_segment_entry_t));
+		if (entries == NULL) {
+			log_error("Cannot grow segment index of %s", segment->filepath);
+			return 1;
+		}
+		segment->entries = entries;
+		segment->entry_capacity = capacity;
+	}
+
+	trace_segment_entry_t *entry = &segment->entries[segment->entry_count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->key_id = key_id;
+	entry->run_id = run_id;
+	entry->channel = channel;
+	entry->offset = offset;
+	entry->length = length;
+	return 0;
+}
+
+/* Index the run whose record header sits at offset */
+static int trace_segment_index_record(trace_segment_t *segment,
+                                      uint64_t offset,
+                                      const trace_segment_record_t *record) {
+	uint64_t image = offset + sizeof(trace_segment_record_t);
+	trace_file_header_t header;
+
+	if (fseek(segment->fp, image, SEEK_SET) != 0 ||
+	    fread(&header, sizeof(header), 1, segment->fp) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+		return 1;
+	}
+
+	trace_channel_t channels[header.channel_count];
+	if (fseek(segment->fp, image + header.header_size, SEEK_SET) != 0 ||
+	    fread(channels, sizeof(channels), 1, segment->fp) != 1) {
+		return 1;
+	}
+
+	int ret = trace_segment_add_entry(segment,
+	                                  record->key_id,
+	                                  record->run_id,
+	                                  TRACE_SEGMENT_RUN,
+	                                  image,
+	                                  record->length);
+	for (uint32_t j = 0; j < header.channel_count && !ret; ++j) {
+		uint64_t end = j + 1 < header.channel_count
+		                   ? channels[j + 1].tsc_offset
+		                   : header.file_size;
+		ret = trace_segment_add_entry(segment,
+		                              record->key_id,
+		                              record->run_id,
+		                              j,
+		                              image + channels[j].tsc_offset,
+		                              end - channels[j].tsc_offset);
+	}
+	return ret;
+}
+
+/* Read the trailing index, or rebuild it from the records after a crash */
+static int trace_segment_load_index(trace_segment_t *segment,
+                                    uint64_t file_size) {
+	trace_segment_trailer_t trailer;
+
+	if (file_size >= sizeof(trace_segment_header_t) + sizeof(trailer) &&
+	    fseek(segment->fp, file_size - sizeof(trailer), SEEK_SET) == 0 &&
+	    fread(&trailer, sizeof(trailer), 1, segment->fp) == 1 &&
+	    memcmp(trailer.magic,
+	           TRACE_SEGMENT_INDEX_MAGIC,
+	           sizeof(TRACE_SEGMENT_INDEX_MAGIC)) == 0) {
+		segment->entries =
+		    malloc((trailer.entry_count + 1) * sizeof(trace_segment_entry_t));
+		if (segment->entries == NULL) {
+			return 1;
+		}
+		segment->entry_capacity = trailer.entry_count + 1;
+		segment->entry_count = trailer.entry_count;
+		segment->end = trailer.index_offset;
+		return fseek(segment->fp, trailer.index_offset, SEEK_SET) != 0 ||
+		       fread(segment->entries,
+		             sizeof(trace_segment_entry_t),
+		             trailer.entry_count,
+		             segment->fp) != trailer.entry_count;
+	}
+
+	log_warn("Segment %s has no index, rebuilding it", segment->filepath);
+	uint64_t offset = sizeof(trace_segment_header_t);
+	trace_segment_record_t record;
+	while (offset + sizeof(record) <= file_size &&
+	       fseek(segment->fp, offset, SEEK_SET) == 0 &&
+	       fread(&record, sizeof(record), 1, segment->fp) == 1 &&
+	       memcmp(record.magic,
+	              TRACE_SEGMENT_MAGIC,
+	              sizeof(TRACE_SEGMENT_MAGIC)) == 0 &&
+	       offset + sizeof(record) + record.length <= file_size) {
+		if (trace_segment_index_record(segment, offset, &record)) {
+			break;
+		}
+		offset = trace_segment_align(offset + sizeof(record) + record.length);
+	}
+	segment->end = offset;
+	return 0;
+}
+
+int trace_segment_open(trace_segment_t *segment, const char *filepath) {
+	trace_segment_header_t header;
+	struct stat st;
+
+	memset(segment, 0, sizeof(*segment));
+	snprintf(segment->filepath, sizeof(segment->filepath), "%s", filepath);
+	// Runs are embedded binary images, never text
+	segment->format = trace_get_format() == TRACE_FORMAT_TEXT
+	                      ? TRACE_FORMAT_BINARY
+	                      : trace_get_format();
+
+	segment->fp = fopen(filepath, "r+b");
+	if (segment->fp == NULL) {
+		segment->fp = fopen(filepath, "w+b");
+		if (segment->fp == NULL) {
+			log_error("Error opening segment file %s", filepath);
+			return 1;
+		}
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, TRACE_SEGMENT_MAGIC, sizeof(TRACE_SEGMENT_MAGIC));
+		header.version = TRACE_SEGMENT_VERSION;
+		header.header_size = sizeof(header);
+		segment->end = sizeof(header);
+		if (fwrite(&header, sizeof(header), 1, segment->fp) != 1) {
+			log_error("Error writing segment file %s", filepath);
+			fclose(segment->fp);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (fstat(fileno(segment->fp), &st) != 0 ||
+	    fread(&header, sizeof(header), 1, segment->fp) != 1 ||
+	    memcmp(header.magic,
+	           TRACE_SEGMENT_MAGIC,
+	           sizeof(TRACE_SEGMENT_MAGIC)) != 0) {
+		log_error("%s is not a trace segment", filepath);
+		fclose(segment->fp);
+		return 1;
+	}
+
+	// The old index is rewritten on close, drop it so that new records
+	// directly follow the last one
+	if (trace_segment_load_index(segment, st.st_size) ||
+	    ftruncate(fileno(segment->fp), segment->end) != 0) {
+		log_error("Error loading segment index of %s", filepath);
+		fclose(segment->fp);
+		free(segment->entries);
+		return 1;
+	}
+	log_info("Append to segment %s, %lu index entries",
+	         filepath,
+	         segment->entry_count);
+	return 0;
+}
+
+int trace_segment_append(trace_segment_t *segment,
+                         uint32_t key_id,
+                         uint32_t run_id,
+                         uint64_t **sample_tsc,
+                         uint64_t **latency,
+                         const uint64_t *sample_count,
+                         int cl_cnt,
+                         int sp_cnt) {
+	static const uint8_t zero_pad[TRACE_ALIGN] = { 0 };
+	trace_segment_record_t record;
+	uint64_t offset = segment->end;
+	uint64_t image = offset + sizeof(record);
+
+	memset(&record, 0, sizeof(record));
+	memcpy(record.magic, TRACE_SEGMENT_MAGIC, sizeof(TRACE_SEGMENT_MAGIC));
+	record.key_id = key_id;
+	record.run_id = run_id;
+
+	int ret = fseek(segment->fp, image, SEEK_SET) != 0 ||
+	          trace_fwrite(segment->fp,
+	                       segment->format,
+	                       sample_tsc,
+	                       latency,
+	                       sample_count,
+	                       cl_cnt,
+	                       sp_cnt);
+	if (!ret) {
+		record.length = ftell(segment->fp) - image;
+		size_t pad = trace_segment_align(image + record.length) -
+		             (image + record.length);
+		ret = fwrite(zero_pad, 1, pad, segment->fp) != pad ||
+		      fseek(segment->fp, offset, SEEK_SET) != 0 ||
+		      fwrite(&record, sizeof(record), 1, segment->fp) != 1 ||
+		      trace_segment_index_record(segment, offset, &record);
+	}
+	if (ret) {
+		log_error("Error appending run %u of key %u to %s",
+		          run_id,
+		          key_id,
+		          segment->filepath);
+		return 1;
+	}
+	segment->end = trace_segment_align(image + record.length);
+	return 0;
+}
+
+int trace_segment_close(trace_segment_t *segment) {
+	trace_segment_trailer_t trailer;
+
+	qsort(segment->entries,
+	      segment->entry_count,
+	      sizeof(trace_segment_entry_t),
+	      trace_segment_entry_cmp);
+
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.index_offset = segment->end;
+	trailer.entry_count = segment->entry_count;
+	memcpy(trailer.magic,
+	       TRACE_SEGMENT_INDEX_MAGIC,
+	       sizeof(TRACE_SEGMENT_INDEX_MAGIC));
+
+	int ret = fseek(segment->fp, segment->end, SEEK_SET) != 0 ||
+	          fwrite(segment->entries,
+	                 sizeof(trace_segment_entry_t),
+	                 segment->entry_count,
+	                 segment->fp) != segment->entry_count ||
+	          fwrite(&trailer, sizeof(trailer), 1, segment->fp) != 1;
+	ret = fclose(segment->fp) != 0 || ret;
+	if (ret) {
+		log_error("Error writing segment index of %s", segment->filepath);
+	}
+	free(segment->entries);
+	segment->entries = NULL;
+	segment->fp = NULL;
+	return ret;
+}
+
+int trace_segment_map(trace_segment_reader_t *reader, const char *filepath) {
+	const trace_segment_header_t *header;
+	const trace_segment_trailer_t *trailer;
+	struct stat st;
+
+	memset(reader, 0, sizeof(*reader));
+	int fd = open(filepath, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		log_error("Error opening segment file %s", filepath);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 1;
+	}
+	if ((uint64_t)st.st_size < sizeof(*header) + sizeof(*trailer)) {
+		log_error("%s is not a trace segment", filepath);
+		close(fd);
+		return 1;
+	}
+
+	reader->size = st.st_size;
+	reader->base = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (reader->base == MAP_FAILED) {
+		log_error("Error mapping segment file %s", filepath);
+		reader->base = NULL;
+		return 1;
+	}
+
+	header = (const trace_segment_header_t *)reader->base;
+	trailer = (const trace_segment_trailer_t *)(reader->base + reader->size -
+	                                            sizeof(*trailer));
+	if (memcmp(header->magic,
+	           TRACE_SEGMENT_MAGIC,
+	           sizeof(TRACE_SEGMENT_MAGIC)) != 0 ||
+	    memcmp(trailer->magic,
+	           TRACE_SEGMENT_INDEX_MAGIC,
+	           sizeof(TRACE_SEGMENT_INDEX_MAGIC)) != 0 ||
+	    trailer->index_offset +
+	            trailer->entry_count * sizeof(trace_segment_entry_t) >
+	        reader->size) {
+		log_error("Segment %s has no valid index", filepath);
+		trace_segment_unmap(reader);
+		return 1;
+	}
+
+	reader->entries = (const trace_segment_entry_t *)(reader->base +
+	                                                  trailer->index_offset);
+	reader->entry_count = trailer->entry_count;
+	return 0;
+}
+
+void trace_segment_unmap(trace_segment_reader_t *reader) {
+	if (reader->base != NULL) {
+		munmap((void *)reader->base, reader->size);
+	}
+	memset(reader, 0, sizeof(*reader));
+}
+
+const trace_segment_entry_t *
+trace_segment_find(const trace_segment_reader_t *reader,
+                   uint32_t key_id,
+                   uint32_t run_id,
+                   uint32_t channel) {
+	trace_segment_entry_t key = {
+		.key_id = key_id,
+		.run_id = run_id,
+		.channel = channel,
+	};
+	return bsearch(&key,
+	               reader->entries,
+	               reader->entry_count,
+	               sizeof(trace_segment_entry_t),
+	               trace_segment_entry_cmp);
+}
+
+const uint8_t *trace_segment_run(const trace_segment_reader_t *reader,
+                                 uint32_t key_id,
+                                 uint32_t run_id,
+                                 uint64_t *length) {
+	const trace_segment_entry_t *entry =
+	    trace_segment_find(reader, key_id, run_id, TRACE_SEGMENT_RUN);
+	if (entry == NULL) {
+		return NULL;
+	}
+	if (length != NULL) {
+		*length = entry->length;
+	}
+	return reader->base + entry->offset;
+}